@@ -0,0 +1,340 @@
+/*
+luaprofile 开销与规模基准。
+
+内嵌 3rd/lua-5.4.8，直接把 luaprofilecore.c 链接进来，测量：
+1. lua 调用、c 调用、尾调用在 profile 关闭、只统计次数、只开 cpu、开内存四种模式下的单次耗时；
+2. _hook_alloc 引入的单次 alloc/free 开销；
+3. 不同栈深度下的协程切换开销；
+4. 不同调用树规模下 dump_json、dump 和 stop 的耗时以及峰值 RSS。
+
+每个测量结果输出一行 json（json lines），便于脚本对比前后两次结果；进度信息输出到 stderr。
+用法：luaprofile_bench [output_file] [max_tree_nodes]
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#define NANOSEC                 1000000000
+#define CALL_LOOPS              2000000
+#define ALLOC_LOOPS             1000000
+#define CO_SWITCH_LOOPS         200000
+#define BENCH_REPEAT            3
+#define TREE_WIDTH              10
+#define DEFAULT_MAX_TREE_NODES  1000000
+
+int luaopen_luaprofilecore(lua_State* L);
+
+enum BENCH_MODE {
+    BENCH_MODE_OFF,     // 不开 profile
+    BENCH_MODE_CALLS,   // level = "count"
+    BENCH_MODE_CPU,     // level = "time"
+    BENCH_MODE_MEM,     // level = "time+mem"
+    BENCH_MODE_SIZE,
+};
+
+static const char* mode_names[BENCH_MODE_SIZE] = {"off", "count", "cpu", "mem"};
+static const char* mode_opts[BENCH_MODE_SIZE] = {NULL, "{ level = \"count\" }", "{ level = \"time\" }", "{ level = \"time+mem\" }"};
+
+static FILE* out = NULL;
+
+static const char* bench_chunk =
+    "local cfunc = ...\n"
+    "local function empty() end\n"
+    "local function tail() return empty() end\n"
+    "function bench_loop(n) for i = 1, n do end end\n"
+    "function bench_lua_call(n) for i = 1, n do empty() end end\n"
+    "function bench_c_call(n) for i = 1, n do cfunc() end end\n"
+    "function bench_tail_call(n) for i = 1, n do tail() end end\n"
+    "function bench_alloc(n)\n"
+    "    for i = 1, n do local t = {} end\n"
+    "    collectgarbage()\n"
+    "end\n"
+    "function bench_co_switch(n, depth)\n"
+    "    local function dive(d)\n"
+    "        if d > 1 then dive(d - 1) else while true do coroutine.yield() end end\n"
+    "    end\n"
+    "    local co = coroutine.wrap(function() dive(depth) end)\n"
+    "    for i = 1, n do co() end\n"
+    "end\n"
+    // 每个函数单独 load，保证是不同的 Proto，得到 width + width^2 + ... + width^depth 个节点
+    "function make_tree(width, depth)\n"
+    "    local level = {}\n"
+    "    for j = 1, width do level[j] = load(\"return function() end\")() end\n"
+    "    for d = depth - 1, 1, -1 do\n"
+    "        local upper = {}\n"
+    "        for j = 1, width do\n"
+    "            upper[j] = load(\"local nxt = ... return function() for k = 1, #nxt do nxt[k]() end end\")(level)\n"
+    "        end\n"
+    "        level = upper\n"
+    "    end\n"
+    "    return function() for k = 1, #level do level[k]() end end\n"
+    "end\n";
+
+static int
+bench_cfunc(lua_State* L) {
+    (void)L;
+    return 0;
+}
+
+static inline uint64_t
+get_mono_ns() {
+    struct timespec ti;
+    clock_gettime(CLOCK_MONOTONIC, &ti);
+    return (uint64_t)ti.tv_sec * (uint64_t)NANOSEC + (uint64_t)ti.tv_nsec;
+}
+
+static void
+check_lua(lua_State* L, int ret, const char* what) {
+    if (ret != LUA_OK) {
+        fprintf(stderr, "ERROR: %s fail, %s\n", what, lua_tostring(L, -1));
+        exit(1);
+    }
+}
+
+static void
+run_string(lua_State* L, const char* code) {
+    check_lua(L, luaL_dostring(L, code), code);
+}
+
+static lua_State*
+bench_state_create() {
+    lua_State* L = luaL_newstate();
+    luaL_openlibs(L);
+    luaL_requiref(L, "luaprofilecore", luaopen_luaprofilecore, 1);
+    lua_pop(L, 1);
+    check_lua(L, luaL_loadstring(L, bench_chunk), "load bench chunk");
+    lua_pushcfunction(L, bench_cfunc);
+    check_lua(L, lua_pcall(L, 1, 0, 0), "run bench chunk");
+    return L;
+}
+
+static void
+profile_start(lua_State* L, int mode) {
+    if (BENCH_MODE_OFF == mode) return;
+    char code[256];
+    snprintf(code, sizeof(code), "local c = require 'luaprofilecore' c.start(%s) c.mark_all()", mode_opts[mode]);
+    run_string(L, code);
+}
+
+static void
+profile_stop(lua_State* L, int mode) {
+    if (BENCH_MODE_OFF == mode) return;
+    run_string(L, "require('luaprofilecore').stop()");
+}
+
+// 调用全局函数 fname(n, arg)，重复 BENCH_REPEAT 次取最短耗时
+static uint64_t
+time_global(lua_State* L, const char* fname, lua_Integer n, lua_Integer arg) {
+    uint64_t best = 0;
+    for (int r = 0; r < BENCH_REPEAT; r++) {
+        lua_getglobal(L, fname);
+        lua_pushinteger(L, n);
+        lua_pushinteger(L, arg);
+        uint64_t t0 = get_mono_ns();
+        check_lua(L, lua_pcall(L, 2, 0, 0), fname);
+        uint64_t cost = get_mono_ns() - t0;
+        if (best == 0 || cost < best) best = cost;
+    }
+    return best;
+}
+
+static double
+per_op(uint64_t total, uint64_t base, lua_Integer n) {
+    double diff = total > base ? (double)(total - base) : 0.0;
+    return diff / (double)n;
+}
+
+static void
+bench_calls(int mode) {
+    lua_State* L = bench_state_create();
+    profile_start(L, mode);
+
+    const char* kinds[] = {"lua", "c", "tail"};
+    const char* funcs[] = {"bench_lua_call", "bench_c_call", "bench_tail_call"};
+    uint64_t base = time_global(L, "bench_loop", CALL_LOOPS, 0);
+    for (int i = 0; i < 3; i++) {
+        uint64_t cost = time_global(L, funcs[i], CALL_LOOPS, 0);
+        fprintf(out, "{\"bench\":\"call\",\"kind\":\"%s\",\"mode\":\"%s\",\"loops\":%d,\"ns_per_op\":%.2f}\n",
+            kinds[i], mode_names[mode], CALL_LOOPS, per_op(cost, base, CALL_LOOPS));
+    }
+
+    profile_stop(L, mode);
+    lua_close(L);
+}
+
+// 同样的分配循环在 off 和 mem 模式下各跑一次，差值即 _hook_alloc 的开销（每次 alloc 对应一次 free）
+static void
+bench_alloc() {
+    uint64_t cost[BENCH_MODE_SIZE] = {0};
+    for (int mode = 0; mode < BENCH_MODE_SIZE; mode++) {
+        lua_State* L = bench_state_create();
+        profile_start(L, mode);
+        cost[mode] = time_global(L, "bench_alloc", ALLOC_LOOPS, 0);
+        profile_stop(L, mode);
+        lua_close(L);
+        fprintf(out, "{\"bench\":\"alloc\",\"mode\":\"%s\",\"loops\":%d,\"ns_per_op\":%.2f}\n",
+            mode_names[mode], ALLOC_LOOPS, per_op(cost[mode], 0, ALLOC_LOOPS));
+    }
+    fprintf(out, "{\"bench\":\"hook_alloc\",\"loops\":%d,\"ns_per_alloc_free\":%.2f}\n",
+        ALLOC_LOOPS, per_op(cost[BENCH_MODE_MEM], cost[BENCH_MODE_CPU], ALLOC_LOOPS));
+}
+
+static void
+bench_co_switch(int mode) {
+    static const int depths[] = {1, 16, 64, 256};
+    lua_State* L = bench_state_create();
+    profile_start(L, mode);
+    for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+        uint64_t cost = time_global(L, "bench_co_switch", CO_SWITCH_LOOPS, depths[i]);
+        fprintf(out, "{\"bench\":\"co_switch\",\"mode\":\"%s\",\"depth\":%d,\"loops\":%d,\"ns_per_resume_yield\":%.2f}\n",
+            mode_names[mode], depths[i], CO_SWITCH_LOOPS, per_op(cost, 0, CO_SWITCH_LOOPS));
+    }
+    profile_stop(L, mode);
+    lua_close(L);
+}
+
+// 从 /proc/self/status 读取 VmHWM / VmRSS（kB），读取失败返回 0
+static long
+read_status_kb(const char* field) {
+    FILE* fp = fopen("/proc/self/status", "r");
+    if (!fp) return 0;
+    char line[256];
+    size_t len = strlen(field);
+    long kb = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, field, len) == 0 && line[len] == ':') {
+            kb = strtol(line + len + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+// 重置峰值 RSS，内核不支持时忽略
+static void
+reset_peak_rss() {
+    FILE* fp = fopen("/proc/self/clear_refs", "w");
+    if (!fp) return;
+    fputs("5", fp);
+    fclose(fp);
+}
+
+// 在子进程中跑，峰值 RSS 互不影响
+static void
+bench_tree_child(int depth, long nodes) {
+    lua_State* L = bench_state_create();
+    reset_peak_rss();
+    long rss_base = read_status_kb("VmRSS");
+
+    lua_getglobal(L, "make_tree");
+    lua_pushinteger(L, TREE_WIDTH);
+    lua_pushinteger(L, depth);
+    check_lua(L, lua_pcall(L, 2, 1, 0), "make_tree");
+    int tree_fn = lua_gettop(L);
+
+    profile_start(L, BENCH_MODE_CPU);
+    uint64_t t0 = get_mono_ns();
+    lua_pushvalue(L, tree_fn);
+    check_lua(L, lua_pcall(L, 0, 0, 0), "run tree");
+    uint64_t run_cost = get_mono_ns() - t0;
+
+    lua_getglobal(L, "require");
+    lua_pushstring(L, "luaprofilecore");
+    check_lua(L, lua_pcall(L, 1, 1, 0), "require");
+    int core = lua_gettop(L);
+
+    // 先测 dump_json，此时还没有 dump 生成的 table，峰值 RSS 只反映流式写出的开销
+    lua_getfield(L, core, "dump_json");
+    lua_pushstring(L, "/dev/null");
+    t0 = get_mono_ns();
+    check_lua(L, lua_pcall(L, 1, 1, 0), "dump_json");
+    uint64_t dump_json_cost = get_mono_ns() - t0;
+    lua_pop(L, 1);
+    long rss_json_peak = read_status_kb("VmHWM");
+
+    lua_getfield(L, core, "dump");
+    t0 = get_mono_ns();
+    check_lua(L, lua_pcall(L, 0, 1, 0), "dump");
+    uint64_t dump_cost = get_mono_ns() - t0;
+    lua_pop(L, 1);
+
+    lua_getfield(L, core, "stop");
+    t0 = get_mono_ns();
+    check_lua(L, lua_pcall(L, 0, 0, 0), "stop");
+    uint64_t stop_cost = get_mono_ns() - t0;
+
+    long rss_peak = read_status_kb("VmHWM");
+    fprintf(out, "{\"bench\":\"tree\",\"nodes\":%ld,\"run_ms\":%.3f,\"dump_json_ms\":%.3f,\"dump_ms\":%.3f,\"stop_ms\":%.3f,"
+        "\"rss_base_kb\":%ld,\"rss_json_peak_kb\":%ld,\"rss_peak_kb\":%ld}\n",
+        nodes, run_cost / 1e6, dump_json_cost / 1e6, dump_cost / 1e6, stop_cost / 1e6, rss_base, rss_json_peak, rss_peak);
+    fflush(out);
+    lua_close(L);
+}
+
+static void
+bench_tree(long max_nodes) {
+    long nodes = 0;
+    long level_nodes = 1;
+    for (int depth = 1; ; depth++) {
+        level_nodes *= TREE_WIDTH;
+        nodes += level_nodes;
+        if (nodes > max_nodes) break;
+        if (nodes < 1000) continue;
+
+        fflush(out);
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "ERROR: fork fail, tree bench skipped\n");
+            return;
+        }
+        if (pid == 0) {
+            bench_tree_child(depth, nodes);
+            _exit(0);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "ERROR: tree bench with %ld nodes fail\n", nodes);
+        }
+    }
+}
+
+int
+main(int argc, char** argv) {
+    const char* path = argc > 1 ? argv[1] : NULL;
+    long max_nodes = argc > 2 ? strtol(argv[2], NULL, 10) : DEFAULT_MAX_TREE_NODES;
+    // profile 自身的提示信息走 stdout，指定输出文件时结果不会和它们混在一起
+    out = path ? fopen(path, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "ERROR: open %s fail\n", path);
+        return 1;
+    }
+
+    for (int mode = 0; mode < BENCH_MODE_SIZE; mode++) {
+        fprintf(stderr, "bench call, mode = %s\n", mode_names[mode]);
+        bench_calls(mode);
+    }
+    fprintf(stderr, "bench alloc\n");
+    bench_alloc();
+    for (int mode = 0; mode < BENCH_MODE_SIZE; mode++) {
+        fprintf(stderr, "bench co_switch, mode = %s\n", mode_names[mode]);
+        bench_co_switch(mode);
+    }
+    fprintf(stderr, "bench tree, max_nodes = %ld\n", max_nodes);
+    bench_tree(max_nodes);
+
+    if (out != stdout) fclose(out);
+    return 0;
+}
@@ -3,7 +3,6 @@ package.path = package.path .. ";" .. root .. "?.lua" .. ";" .. root .. "example
 package.cpath = package.cpath .. ";" .. root .. "?.so"
 
 local lpaux = require "luaprofileaux"
-local json = require "json"
 
 local OUTPUT_FILE = "./output_of_example.json"
 local PROFILE_OPTS = { mem_profile = "off" }
@@ -17,18 +16,6 @@ local function print_ts(...)
     io.stdout:write("[" .. ts .. "] ", table.concat(parts, "\t"), "\n")
 end
 
-local function write_profile_result(filepath, content)
-    local file, err = io.open(filepath, "w")
-    if not file then
-        io.stderr:write("open file failed: " .. tostring(err) .. "\n")
-        return false
-    end
-    file:write(content, "\n")
-    file:close()
-    print_ts("write profile result to " .. filepath)
-    return true
-end
-
 -- 场景1：Lua 函数调用和 table.insert 热点
 local function scenario_lua_call_and_insert()
     local function test3()
@@ -144,9 +131,12 @@ local function run_example_with_profile()
     print_ts("profile start")
     lpaux.start(PROFILE_OPTS)
     run_scenarios()
-    local result = lpaux.stop()
-    local encoded = json.encode(result)
-    write_profile_result(OUTPUT_FILE, encoded)
+    local ok, err = lpaux.stop_json(OUTPUT_FILE)
+    if not ok then
+        io.stderr:write("write profile result failed: " .. tostring(err) .. "\n")
+    else
+        print_ts("write profile result to " .. OUTPUT_FILE)
+    end
     print_ts("profile stop")
 end
 
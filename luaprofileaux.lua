@@ -5,25 +5,30 @@ local M = {
     _profile_start_time = 0,
 }
 
-local old_co_create = coroutine.create
-local old_co_wrap = coroutine.wrap
-
-local function my_coroutine_create(f)
-    return old_co_create(function (...)
-            c.mark()
-            return f(...)
-        end)
-end
-
-local function my_coroutine_wrap(f)
-    return old_co_wrap(function (...)
-            c.mark()
-            return f(...)
-        end)
-end
-
 ---启动 profile
----@param opts table 启动参数，格式为 { mem_profile = "off|on" }，mem_profile 为 on 表示需要内存 profile， off 反之。
+---@param opts table 启动参数，格式为 { level = "count|time|time+mem|full", mem_profile = "off|on", structure = "tree|graph", fold_recursion = false, merge_reloads = false, include = {...}, exclude = {...}, skip_c_functions = false, calibrate = true, max_tags = 256, windows = 0, window_seconds = 60, max_overhead_percent = 0, instrument = true, counters = {...}, extraspace = false }，mem_profile 为 on 表示需要内存 profile， off 反之；
+---开启内存 profile 时节点还带有 alloc_sizes、realloc_sizes，为按 2 的幂分档（"<=8"、"<=16" ... "<=128K"、">128K"）的分配次数（含子调用），只列出非 0 的档；
+---level 为统计级别，默认 full（不指定时是否统计内存仍由 mem_profile 决定），指定时覆盖 mem_profile：count 只统计调用次数（hook 不读时钟，适合常开），time 统计 cpu 耗时，
+---time+mem 再加上内存 profile，full 再加上分类校准的开销扣除和 profile_lines 逐行统计；
+---structure 为 tree（默认）表示完整调用树，为 graph 表示按函数和调用边聚合的调用图；
+---fold_recursion 为 true 表示把递归调用折叠回路径上已有的祖先节点；
+---merge_reloads 为 true 表示热更新后重新加载的同一函数（source、linedefined、lastlinedefined 相同）合并到同一节点；
+---include、exclude 为字符串列表，按子串匹配 lua 函数的 source（如 "@./game/"），include 非空时只统计匹配的函数，匹配 exclude 的函数不统计；
+---skip_c_functions 为 true 表示不统计 c 函数。被过滤的函数不产生节点，其耗时计入最近的未过滤祖先；
+---calibrate 为 true（默认）表示 level 为 full 时启动时校准 lua 调用、c 调用、尾调用、协程切换各自的 hook 开销，cpu_cost_real 按节点实际的事件构成扣除；
+---max_tags 为 M.set_tag 可用的最多 tag 数，超出后新的 tag 都归到 "[other]"；
+---windows 大于 0 时额外保留最近 windows 个、每个 window_seconds 秒的统计，供 M.window_dump 查询（tree 结构，level 不低于 time），
+---开销调节降到 count 级别时窗口只记调用次数，窗口按开销调节每隔一批事件读一次的时钟推进；
+---max_overhead_percent 大于 0 时，profile 自身的开销占比超过该值就自动逐级降低统计级别（level -> time -> count -> count 加时间片采样），
+---开销包括内存 profile 的 alloc hook，降到 time 及以下时不再记录新的内存分配，
+---负载降下来后再逐级恢复，导出结果根节点的 active_level 为当前所在的级别，level_changes 为切换次数，适合在线上常开；
+---instrument 为 false 表示不装 call/ret hook，只统计 M.zone_begin/M.zone_end 标出的区域；
+---extraspace 为 true 表示宿主不使用 lua_getextraspace，profile 把协程的统计状态存在里面，协程切换时省去一次查表；
+---counters 为 perf_event_open 计数器的名字列表，最多 4 个，可选 "instructions"、"cycles"、"cache-references"、"cache-misses"、"branches"、
+---"branch-misses"、"page-faults"、"context-switches"、"cpu-migrations"，统计调用 start 的线程，按调用路径累计（含子调用，扣除协程挂起期间），
+---导出在节点的 counters 字段里，同时有 instructions 和 cycles 时带上 ipc；打不开的计数器（如虚拟机里的硬件计数器）跳过，其余照常统计。
+---计数器在计时 hook 中读取，能用 rdpmc 时不进内核，否则每次事件多一次 read 系统调用，这部分开销在校准时一并测量扣除；
+---计数器多于 PMU 而被内核轮流调度时计数偏小，导出时会打印 WARNING（tree 结构，level 不低于 time，window_dump 不含计数器）。
 function M.start(opts)
     if M._is_profile_started then
         print("profile start fail, already started")
@@ -32,26 +37,270 @@ function M.start(opts)
     M._is_profile_started = true
     M._profile_start_time = os.time()
     c.start(opts)
-    c.mark_all()
-    coroutine.create = my_coroutine_create
-    coroutine.wrap = my_coroutine_wrap
+    -- 已有的协程一次性装上 hook，之后新建的协程（包括 c 代码用 lua_newthread 创建的）从创建者继承 hook
+    if not opts or opts.instrument ~= false then
+        c.mark_all()
+    end
 end
 
 ---停止 profile
----@return table 返回 profile 结果，格式为 { start_time = "YYYY-MM-DD HH:MM:SS", duration_seconds = 100, nodes = table }
-function M.stop()
+---@param dump_opts table|nil 导出参数，格式为 { min_percent = 1.0, min_ns = 1000000, top_children = 20 }，都可省略；
+---cpu_cost_raw 占父节点百分比低于 min_percent、低于 min_ns 纳秒、或排在前 top_children 之外的子节点合并为一个 [other] 节点；
+---子节点按 cpu_cost_raw 降序排列
+---@return table 返回 profile 结果，格式为 { start_time = "YYYY-MM-DD HH:MM:SS", duration_seconds = 100, nodes = table, lines = table|nil }，lines 为 M.profile_lines 的逐行统计
+function M.stop(dump_opts)
     if not M._is_profile_started then
         print("profile stop fail, not started")
         return
     end
-    coroutine.create = old_co_create
-    coroutine.wrap = old_co_wrap    
-    local duration_seconds, nodes = c.dump()
+    local duration_seconds, nodes = c.dump(dump_opts)
+    local lines = c.dump_lines()
     c.unmark_all()
     c.stop()
     M._is_profile_started = false
     local start_time = os.date("%Y-%m-%d %H:%M:%S", M._profile_start_time)
+    if lines and #lines == 0 then
+        lines = nil
+    end
+    return {start_time = start_time, duration_seconds = duration_seconds, nodes = nodes, lines = lines}
+end
+
+---暂停 profile，调用树、符号、内存分配记录和协程栈都保留，M.resume 后继续累计，比 stop/start 重新建树便宜得多
+---暂停期间 hook 只检查一次标记就返回，新的内存分配不记录；暂停的时长不计入 duration 和跨越暂停的函数耗时
+---@return boolean 是否暂停成功
+---@return string|nil 失败原因
+function M.pause()
+    if not M._is_profile_started then
+        return false, "profile not started"
+    end
+    return c.pause()
+end
+
+---恢复 M.pause 暂停的 profile，暂停期间已返回的函数按暂停时刻结算，暂停期间进入、仍在执行的函数从恢复时刻开始统计
+---@return boolean 是否恢复成功
+---@return string|nil 失败原因
+function M.resume()
+    if not M._is_profile_started then
+        return false, "profile not started"
+    end
+    return c.resume()
+end
+
+---导出最近 n 个时间窗口合并后的调用树，用于事后查看"最近几分钟什么最热"，不需要提前持续导出（需要以 windows 启动）
+---当前还没结束的窗口也包含在内，窗口内没有活动的子节点不导出
+---@param n integer|nil 窗口数，默认为启动参数 windows
+---@param dump_opts table|nil 导出参数，同 M.stop
+---@return table|boolean { start_time, duration_seconds, nodes }，start_time 为覆盖范围的开始时间，duration_seconds 为其中扣除 pause 后实际统计的时长；失败返回 false
+---@return string|nil 失败原因
+function M.window_dump(n, dump_opts)
+    if not M._is_profile_started then
+        return false, "profile not started"
+    end
+    local duration_seconds, nodes, span_seconds = c.window_dump(n, dump_opts)
+    if not duration_seconds then
+        return false, nodes
+    end
+    local start_time = os.date("%Y-%m-%d %H:%M:%S", os.time() - math.floor(span_seconds))
     return {start_time = start_time, duration_seconds = duration_seconds, nodes = nodes}
 end
 
+---把调用树直接从 C 流式写成 json，不构造 lua table，适合调用树很大的场景（仅支持 tree 模式）
+---格式同 M.stop() 的返回值（不含 lines），统计不受影响，可以多次调用
+---@param target string|integer|file* 输出文件路径、文件描述符或 io.open 打开的文件（只 flush 不关闭）
+---@param dump_opts table|nil 导出参数，同 M.stop
+---@return boolean 是否写入成功
+---@return string|nil 失败原因
+function M.dump_json(target, dump_opts)
+    if not M._is_profile_started then
+        return false, "profile not started"
+    end
+    return c.dump_json(target, dump_opts)
+end
+
+---停止 profile，并把调用树用 M.dump_json 写出，代替 M.stop() 之后再在 lua 里 json 编码
+---@param target string|integer|file* 同 M.dump_json
+---@param dump_opts table|nil 导出参数，同 M.stop
+---@return boolean 是否写入成功
+---@return string|nil 失败原因
+function M.stop_json(target, dump_opts)
+    if not M._is_profile_started then
+        print("profile stop fail, not started")
+        return false, "profile not started"
+    end
+    local ok, err = c.dump_json(target, dump_opts)
+    c.unmark_all()
+    c.stop()
+    M._is_profile_started = false
+    return ok, err
+end
+
+---把到目前为止的调用树换下来，由后台线程写到文件，调用方几乎不会被阻塞（仅支持 tree 模式）
+---之后的 stop/swap_dump 只包含换树之后的统计
+---@param path string 输出文件路径
+---@param fmt string|nil "json"（默认，格式同 M.stop() 的返回值）或 "folded"（每行 "root;f1;f2 self_ns"，可直接用于火焰图）
+---@param dump_opts table|nil 导出参数，同 M.stop
+---@return boolean 是否成功换树并启动后台写入
+---@return string|nil 失败原因
+function M.swap_dump(path, fmt, dump_opts)
+    if not M._is_profile_started then
+        return false, "profile not started"
+    end
+    return c.swap_dump(path, fmt, dump_opts)
+end
+
+---等待上一次 swap_dump 的后台写入完成
+---@return boolean 是否写入成功
+function M.swap_wait()
+    if not M._is_profile_started then
+        return false, "profile not started"
+    end
+    return c.swap_wait()
+end
+
+---fork 子进程导出调用树，父进程只承担 fork 的开销，统计不受影响（仅支持 tree 模式）
+---mem_profile 为 on 时，结果中还包含 fork 时刻各节点的存活内存 heap_bytes、heap_blocks
+---@param path string 输出文件路径
+---@param fmt string|nil "json"（默认）或 "folded"
+---@param dump_opts table|nil 导出参数，同 M.stop
+---@return integer|boolean 成功返回句柄，失败返回 false
+---@return string|nil 失败原因
+function M.dump_async(path, fmt, dump_opts)
+    if not M._is_profile_started then
+        return false, "profile not started"
+    end
+    return c.dump_async(path, fmt, dump_opts)
+end
+
+---查询 dump_async 的状态，需要轮询到结束以回收子进程
+---@param handle integer M.dump_async 返回的句柄
+---@return string "running"、"done" 或 "failed"
+function M.dump_poll(handle)
+    return c.dump_poll(handle)
+end
+
+---对指定的 lua 函数做逐行统计，只在这些函数处于栈顶时开启 line hook，替换之前的设置，传空列表即关闭
+---行的耗时为该行到下一行（或函数返回）之间的时间，包含行内的子调用；被 include/exclude 过滤的函数没有逐行统计，需要 level 为 full
+---@param functions table lua 函数列表
+---@return boolean 是否设置成功
+---@return string|nil 失败原因
+function M.profile_lines(functions)
+    if not M._is_profile_started then
+        return false, "profile not started"
+    end
+    return c.profile_lines({functions = functions})
+end
+
+---查询当前最热的函数，不导出调用树，也不触发 gc，适合在线上随时调用
+---按函数聚合的统计在每次函数返回时增量更新，还在栈上的调用要等返回后才计入
+---@param n integer|nil 返回的函数数，默认 10
+---@param metric string|nil 排序指标："self"（默认，自身耗时）、"incl"（含子调用耗时）或 "calls"（调用次数）
+---@return table { { name, call_count, ["cpu_cost_self(ns)"], ["cpu_cost_incl(ns)"] }, ... }，按 metric 降序
+function M.top(n, metric)
+    if not M._is_profile_started then
+        return nil
+    end
+    return c.top(n, metric)
+end
+
+---开始新的一代内存分配（需要 mem_profile 为 on），默认先做一次 full gc，之后分配的块都记为新一代
+---@param collect boolean|nil 是否先 full gc，默认 true
+---@return integer 新一代的编号
+function M.mark_generation(collect)
+    if not M._is_profile_started then
+        return nil
+    end
+    return c.mark_generation(collect)
+end
+
+---泄漏嫌疑报告：统计分配后经过了至少 min_age 次 M.mark_generation 仍然存活的块，按 (调用路径, 分配的代) 汇总，按存活字节降序
+---@param opts table|nil { min_age = 1, top = 50 }
+---@return table { { path = "f1 src:1;f2 src:2", generation, live_bytes, live_blocks }, ... }，mem_profile 为 off 时返回 nil 和原因
+function M.leak_report(opts)
+    if not M._is_profile_started then
+        return nil, "profile not started"
+    end
+    return c.leak_report(opts)
+end
+
+---注册 tag，返回 tag id，请求处理的热路径上用 id 调用 M.set_tag 不需要查名字
+---@param name string tag 名字，如消息类型
+---@return integer tag id，超过启动参数 max_tags 后新的名字都归到 "[other]"
+function M.register_tag(name)
+    if not M._is_profile_started then
+        return nil
+    end
+    return c.register_tag(name)
+end
+
+---设置 tag（仅支持 tree 模式），之后的调用归到该 tag 下：同一函数在不同 tag 下是不同的节点，
+---tag 子树的根节点带有 tag 字段，根节点的 tags 字段为各 tag 的汇总（call_count、cpu 耗时，mem_profile 为 on 时还有内存分配），按 cpu_cost_raw 降序
+---@param tag string|integer|nil tag 名字、M.register_tag 返回的 id，nil 表示清除
+---@param co thread|nil 传入时只设置该协程的 tag（覆盖全局 tag），否则设置全局 tag
+---@return boolean 是否设置成功
+---@return string|nil 失败原因
+function M.set_tag(tag, co)
+    if not M._is_profile_started then
+        return false, "profile not started"
+    end
+    return c.set_tag(tag, co)
+end
+
+---登记 zone，返回 zone id，热路径上用 id 调用 M.zone_begin 不需要查名字
+---@param name string zone 名字，如 "dispatch"、"db_encode"
+---@return integer zone id
+function M.zone_register(name)
+    if not M._is_profile_started then
+        return nil
+    end
+    return c.zone_register(name)
+end
+
+---开始一个 zone：在当前协程的调用栈上压一个帧，和函数的帧共用调用树，可以嵌套，协程挂起的时间会扣除
+---zone 在调用树中的节点名为 zone 名字，source 为 "[zone]"；不装 hook（instrument = false）时每个 zone 只有几十纳秒的开销
+---zone 按当前生效的级别统计，count 级别（包括开销调节降到的 count）只统计次数，不读时钟和计数器
+---@param zone integer|string M.zone_register 返回的 id 或名字
+---@return boolean 是否成功
+---@return string|nil 失败原因
+function M.zone_begin(zone)
+    if not M._is_profile_started then
+        return false, "profile not started"
+    end
+    return c.zone_begin(zone)
+end
+
+---结束当前协程最内层的 zone，需要在调用 M.zone_begin 的同一个函数里调用；装了 hook 时，函数返回时没有结束的 zone 自动结束
+---@return boolean 是否成功
+---@return string|nil 失败原因
+function M.zone_end()
+    if not M._is_profile_started then
+        return false, "profile not started"
+    end
+    return c.zone_end()
+end
+
+local function dot_escape(s)
+    return (tostring(s):gsub("\\", "\\\\"):gsub('"', '\\"'))
+end
+
+---把 graph 模式的 profile 结果转换为 graphviz DOT 格式
+---@param result table M.stop() 的返回值，需要以 structure = "graph" 启动
+---@return string DOT 文本
+function M.to_dot(result)
+    local graph = result and result.nodes
+    if not graph or not graph.functions then
+        return nil
+    end
+    local lines = { "digraph luaprofile {", "    node [shape=box];" }
+    for _, f in ipairs(graph.functions) do
+        lines[#lines + 1] = string.format('    f%d [label="%s\\nself %.3fms / incl %.3fms\\ncalls %d"];',
+            f.id, dot_escape(f.name), f["cpu_cost_self(ns)"] / 1e6, f["cpu_cost_incl(ns)"] / 1e6, f.call_count)
+    end
+    for _, e in ipairs(graph.edges) do
+        lines[#lines + 1] = string.format('    f%d -> f%d [label="%d calls\\n%.3fms"];',
+            e.caller, e.callee, e.call_count, e["cpu_cost(ns)"] / 1e6)
+    end
+    lines[#lines + 1] = "}"
+    return table.concat(lines, "\n")
+end
+
 return M
@@ -5,6 +5,7 @@ Original version is https://github.com/lvzixun/luaprofile .
 Check https://github.com/antsmallant/luaprofile for more.
 */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -15,9 +16,19 @@ Check https://github.com/antsmallant/luaprofile for more.
 #include <stdint.h>
 #include <math.h>
 #include <errno.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #include "lobject.h"
 #include "lfunc.h"
 #include "lstate.h"
+#include "lopcodes.h"
 #include "lua.h"
 #include "lauxlib.h"
 
@@ -28,7 +39,6 @@ Check https://github.com/antsmallant/luaprofile for more.
 #define pcalloc   calloc
 
 #define MAX_CALL_SIZE               2048
-#define MAX_CO_SIZE                 10240
 #define NANOSEC                     1000000000
 #define MICROSEC                    1000000
 
@@ -37,9 +47,58 @@ enum PROFILE_MODE {
     PROFILE_MODE_ON,
 };
 
+enum PROFILE_STRUCTURE {
+    PROFILE_STRUCTURE_TREE,     // 完整调用树，每个不同的调用栈一个节点
+    PROFILE_STRUCTURE_GRAPH,    // gprof 风格的调用图，按函数和 (caller, callee) 边聚合
+};
+
+// 统计级别：级别越低 hook 越轻，每个级别安装一个特化的 hook
+enum PROFILE_LEVEL {
+    PROFILE_LEVEL_COUNT,        // 只统计调用次数，hook 中不读时钟
+    PROFILE_LEVEL_TIME,         // 调用次数 + cpu 耗时，按平均开销扣除 hook 开销
+    PROFILE_LEVEL_TIME_MEM,     // time + 内存 profile
+    PROFILE_LEVEL_FULL,         // time+mem + 分类校准的开销扣除 + 逐行统计
+};
+
+// hook 开销的事件分类，每类的单次开销不同，按节点实际的事件构成扣除
+enum OVERHEAD_CLASS {
+    OVH_LUA_CALL,       // lua 函数的 call + ret
+    OVH_C_CALL,         // c 函数的 call + ret
+    OVH_TAIL_CALL,      // 尾调用事件
+    OVH_CO_SWITCH,      // hook 中发现协程切换
+    OVH_FIRST_VISIT,    // 首次见到 lua 函数，分配 key 和锚定闭包
+    OVH_CLASS_COUNT,
+};
+
+#define CALIBRATE_LOOPS             10000
+#define CALIBRATE_REPEAT            3
+
 #define DEFAULT_IMAP_SLOT_SIZE      1024
+#define GRAPH_EDGE_SLOT_SIZE        8
+#define LUA_FUNC_KEY_BIT            ((uint64_t)1 << 63)    // lua 函数的 key 带上最高位，和 c 函数指针区分开
+#define TAG_KEY_SHIFT               48                     // 函数 key 的 48~62 位总是 0（lua 函数序号、用户态指针都用不到），tag 放在这里
+#define DEFAULT_MAX_TAGS            256
+#define MAX_TAGS_LIMIT              ((1 << (63 - TAG_KEY_SHIFT)) - 2)
+#define DEFAULT_WINDOW_SECONDS      60
+#define MAX_WINDOWS                 1024
+#define SIZE_CLASS_COUNT            16                     // 分配大小直方图的档数，见 size_class
+#define MAX_COUNTERS                4                      // 同时打开的 perf 计数器数，和通用 PMU 计数器的个数相当
+
+#define GOVERNOR_CHECK_EVENTS       1024                   // 开销调节：每隔多少个 hook 事件读一次时钟
+#define GOVERNOR_INTERVAL_NS        ((uint64_t)NANOSEC)    // 开销调节的统计区间
+#define GOVERNOR_SAMPLE_PERIOD      4                      // 最低一级每几个区间统计一个
+#define GOVERNOR_DEFAULT_EVENT_NS   100.0                  // 没有校准时计时 hook 单次事件开销的初始估计
+#define GOVERNOR_MAX_RUNGS          4
+#define GOVERNOR_ALLOC_SAMPLE       64                     // 开销调节：alloc hook 每隔多少次取一次耗时
+
+// paused 的位，用户的 pause 和开销调节的时间片采样互不覆盖
+#define PAUSE_USER                  1
+#define PAUSE_GOVERNOR              2
 
 static char profile_context_key = 'x';
+static char profile_anchor_key = 'a';   // 注册表中锚定 lua 闭包的 table，保证 Proto 在 dump 前不被回收
+static char profile_tag_key = 't';      // 注册表中 tag 名字 -> tag id 的 table
+static char profile_zone_key = 'z';     // 注册表中 zone 名字 -> zone id 的 table
 
 struct icallpath_context {
     uint64_t key;
@@ -64,6 +123,7 @@ struct imap_slot {
 struct imap_context {
     struct imap_slot* slots;
     size_t size;
+    size_t min_size;
     size_t count;
     struct imap_slot* lastfree;
 };
@@ -73,15 +133,21 @@ static void imap_set(struct imap_context* imap, uint64_t key, void* value);
 static void icallpath_free(struct icallpath_context* icallpath);
 
 static struct imap_context *
-imap_create(void) {
+imap_create_sized(size_t size) {
     struct imap_context* imap = (struct imap_context*)pmalloc(sizeof(*imap));
-    imap->slots = (struct imap_slot*)pcalloc(DEFAULT_IMAP_SLOT_SIZE, sizeof(struct imap_slot));
-    imap->size = DEFAULT_IMAP_SLOT_SIZE;
+    imap->slots = (struct imap_slot*)pcalloc(size, sizeof(struct imap_slot));
+    imap->size = size;
+    imap->min_size = size;
     imap->count = 0;
     imap->lastfree = imap->slots + imap->size;
     return imap;
 }
 
+static struct imap_context *
+imap_create(void) {
+    return imap_create_sized(DEFAULT_IMAP_SLOT_SIZE);
+}
+
 static void
 imap_free(struct imap_context* imap) {
     pfree(imap->slots);
@@ -96,7 +162,7 @@ _imap_hash(struct imap_context* imap, uint64_t key) {
 
 static void
 _imap_rehash(struct imap_context* imap) {
-    size_t new_sz = DEFAULT_IMAP_SLOT_SIZE;
+    size_t new_sz = imap->min_size;
     struct imap_slot* old_slots = imap->slots;
     size_t old_count = imap->count;
     size_t old_size = imap->size;
@@ -235,18 +301,37 @@ static struct icallpath_context* icallpath_create(uint64_t key, void* value) {
     return icallpath;
 }
 
-static void icallpath_free_child(uint64_t key, void* value, void* ud) {
-    icallpath_free((struct icallpath_context*)value);
+// 遍历调用树用的显式栈，深树不会在 C 栈上递归
+struct icallpath_stack {
+    struct icallpath_context** items;
+    size_t size;
+    size_t cap;
+};
+
+static void icallpath_stack_push(struct icallpath_stack* st, struct icallpath_context* icallpath) {
+    if (st->size >= st->cap) {
+        st->cap = st->cap ? st->cap * 2 : 64;
+        st->items = (struct icallpath_context**)prealloc(st->items, sizeof(struct icallpath_context*) * st->cap);
+    }
+    st->items[st->size++] = icallpath;
+}
+
+static void _icallpath_stack_push_child(uint64_t key, void* value, void* ud) {
+    (void)key;
+    icallpath_stack_push((struct icallpath_stack*)ud, (struct icallpath_context*)value);
 }
 
 static void icallpath_free(struct icallpath_context* icallpath) {
-    if (icallpath->value) {
-        pfree(icallpath->value);
-        icallpath->value = NULL;
+    struct icallpath_stack st = {NULL, 0, 0};
+    icallpath_stack_push(&st, icallpath);
+    while (st.size > 0) {
+        struct icallpath_context* cur = st.items[--st.size];
+        imap_dump(cur->children, _icallpath_stack_push_child, &st);
+        imap_free(cur->children);
+        if (cur->value) pfree(cur->value);
+        pfree(cur);
     }
-    imap_dump(icallpath->children, icallpath_free_child, NULL);
-    imap_free(icallpath->children);
-    pfree(icallpath);
+    pfree(st.items);
 }
 
 static struct icallpath_context* icallpath_get_child(struct icallpath_context* icallpath, uint64_t key) {
@@ -290,12 +375,16 @@ static inline uint64_t safe_u64_minus(uint64_t big, uint64_t small) {
     return big-small;
 }
 
-static inline uint64_t calc_cpu_cost_real(uint64_t cpu_cost_raw, uint64_t call_count, double avg_profiler_cost_per_call) {
-    if (avg_profiler_cost_per_call <= 0.0 || call_count == 0) {
+// ev_incl 为节点 incl 范围内各类事件的次数，class_cost 为各类事件的单次开销
+static inline uint64_t calc_cpu_cost_real(uint64_t cpu_cost_raw, const uint64_t* ev_incl, const double* class_cost) {
+    double overhead = 0;
+    for (int i = 0; i < OVH_CLASS_COUNT; i++) {
+        overhead += class_cost[i] * (double)ev_incl[i];
+    }
+    if (overhead <= 0.0) {
         return cpu_cost_raw;
     }
-    uint64_t avg_cost = (uint64_t)(avg_profiler_cost_per_call * (double)call_count);
-    return safe_u64_minus(cpu_cost_raw, avg_cost);
+    return safe_u64_minus(cpu_cost_raw, (uint64_t)overhead);
 }
 
 #ifdef GET_REALTIME
@@ -311,62 +400,601 @@ get_realtime_ns() {
 }
 #endif
 
-// 读取启动参数：{ mem_profile = "off|on" }
+static inline char*
+pstrdup(const char* s) {
+    if (!s) return NULL;
+    size_t n = strlen(s);
+    char* d = (char*)pmalloc(n + 1);
+    memcpy(d, s, n);
+    d[n] = '\0';
+    return d;
+}
+
+/*
+perf_event_open 计数器：start 时在当前线程上打开一组计数器，hook 中和时钟一起读一次，按调用路径累计增量。
+组里只要有一个计数器不能在用户态 rdpmc（软件事件、不支持 rdpmc 的平台），就用一次 read 读整组。
+硬件计数器打不开（比如虚拟机里没有 PMU）时只跳过它，软件事件照常工作。
+*/
+struct counter_def {
+    const char* name;
+    uint32_t    type;
+    uint64_t    config;
+};
+
+static const struct counter_def counter_defs[] = {
+    {"instructions",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cycles",              PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"cache-references",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {"cache-misses",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branches",            PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"branch-misses",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"page-faults",         PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    {"context-switches",    PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {"cpu-migrations",      PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+};
+
+#define COUNTER_DEF_COUNT   ((int)(sizeof(counter_defs) / sizeof(counter_defs[0])))
+
+static int
+find_counter_def(const char* name) {
+    for (int i = 0; i < COUNTER_DEF_COUNT; i++) {
+        if (strcmp(counter_defs[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+struct perf_counters {
+    int     count;                      // 打开成功的计数器数，0 表示未启用
+    int     group_fd;                   // 组长，read 整组时用
+    int     fds[MAX_COUNTERS];          // 按入组顺序，和 read 返回的值一一对应
+    const char* names[MAX_COUNTERS];    // 指向 counter_defs
+    struct perf_event_mmap_page* pages[MAX_COUNTERS];   // rdpmc 用的映射页，没有映射为 NULL
+    bool    rdpmc;                      // 组里的计数器都可以在用户态 rdpmc 读
+    bool    multiplex_warned;           // 已经提示过计数器被轮流调度
+};
+
+static void
+init_perf_counters(struct perf_counters* pc) {
+    pc->count = 0;
+    pc->group_fd = -1;
+    pc->rdpmc = false;
+    pc->multiplex_warned = false;
+    for (int i = 0; i < MAX_COUNTERS; i++) {
+        pc->fds[i] = -1;
+        pc->names[i] = NULL;
+        pc->pages[i] = NULL;
+    }
+}
+
+static void
+close_perf_counters(struct perf_counters* pc) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    for (int i = 0; i < pc->count; i++) {
+        if (pc->pages[i]) munmap(pc->pages[i], (size_t)page_size);
+        if (pc->fds[i] >= 0) close(pc->fds[i]);
+    }
+    init_perf_counters(pc);
+}
+
+static int
+_perf_event_open(const struct counter_def* def, int group_fd, bool exclude_kernel) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = def->type;
+    attr.config = def->config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.disabled = group_fd < 0 ? 1 : 0;   // 组长先关着，整组建好后一起打开
+    attr.exclude_kernel = exclude_kernel ? 1 : 0;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+// 按 defs 打开计数器，打不开的跳过并打印原因，返回打开成功的个数
+static int
+open_perf_counters(struct perf_counters* pc, const int* defs, int n) {
+    init_perf_counters(pc);
+    long page_size = sysconf(_SC_PAGESIZE);
+    bool rdpmc = true;
+    for (int i = 0; i < n && pc->count < MAX_COUNTERS; i++) {
+        const struct counter_def* def = &counter_defs[defs[i]];
+        // 硬件事件只数用户态；软件事件（缺页、上下文切换）发生在内核里，权限不够时退回只数用户态
+        bool hardware = PERF_TYPE_HARDWARE == def->type;
+        int fd = _perf_event_open(def, pc->group_fd, hardware);
+        if (fd < 0 && !hardware && (errno == EACCES || errno == EPERM)) {
+            fd = _perf_event_open(def, pc->group_fd, true);
+        }
+        if (fd < 0) {
+            printf("WARNING: counter %s unavailable: %s, ignored\n", def->name, strerror(errno));
+            continue;
+        }
+        struct perf_event_mmap_page* page = NULL;
+        if (hardware) {
+            void* p = mmap(NULL, (size_t)page_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) page = (struct perf_event_mmap_page*)p;
+        }
+        if (!page || !page->cap_user_rdpmc) rdpmc = false;
+        if (pc->group_fd < 0) pc->group_fd = fd;
+        pc->fds[pc->count] = fd;
+        pc->names[pc->count] = def->name;
+        pc->pages[pc->count] = page;
+        pc->count++;
+    }
+    if (pc->count == 0) return 0;
+#if defined(__x86_64__) || defined(__i386__)
+    pc->rdpmc = rdpmc;
+#else
+    (void)rdpmc;
+#endif
+    ioctl(pc->group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(pc->group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return pc->count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 按 perf_event_mmap_page 的约定用 rdpmc 读计数器，计数器当前不在 PMU 上时返回 false
+static inline bool
+_read_counter_rdpmc(const volatile struct perf_event_mmap_page* page, uint64_t* out) {
+    uint32_t seq;
+    uint64_t count;
+    do {
+        seq = page->lock;
+        __asm__ volatile("" ::: "memory");
+        uint32_t idx = page->index;
+        if (!page->cap_user_rdpmc || idx == 0) return false;
+        count = page->offset;
+        uint32_t lo, hi;
+        __asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(idx - 1));
+        int shift = 64 - page->pmc_width;
+        int64_t pmc = (int64_t)(((uint64_t)hi << 32) | lo);
+        count += (uint64_t)((pmc << shift) >> shift);
+        __asm__ volatile("" ::: "memory");
+    } while (page->lock != seq);
+    *out = count;
+    return true;
+}
+#endif
+
+// 读整组计数器到 out，读失败时 out 保持不变
+static inline void
+read_perf_counters(const struct perf_counters* pc, uint64_t* out) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (pc->rdpmc) {
+        uint64_t v[MAX_COUNTERS];
+        int i = 0;
+        while (i < pc->count && _read_counter_rdpmc(pc->pages[i], &v[i])) i++;
+        if (i == pc->count) {
+            memcpy(out, v, sizeof(uint64_t) * pc->count);
+            return;
+        }
+    }
+#endif
+    // 格式为 nr, time_enabled, time_running, 各计数器的值
+    uint64_t buf[3 + MAX_COUNTERS];
+    ssize_t want = (ssize_t)(sizeof(uint64_t) * (3 + pc->count));
+    if (read(pc->group_fd, buf, (size_t)want) == want && buf[0] == (uint64_t)pc->count) {
+        memcpy(out, &buf[3], sizeof(uint64_t) * pc->count);
+    }
+}
+
+// 计数器多于 PMU 时内核轮流调度，组只在 time_running 内计数，累计的增量偏小。返回计数时间的占比，未启用或读失败时返回 1
+static double
+perf_counters_running_ratio(const struct perf_counters* pc) {
+    if (pc->count == 0) return 1.0;
+    uint64_t buf[3 + MAX_COUNTERS];
+    ssize_t want = (ssize_t)(sizeof(uint64_t) * (3 + pc->count));
+    if (read(pc->group_fd, buf, (size_t)want) != want || buf[0] != (uint64_t)pc->count || buf[1] == 0) return 1.0;
+    return (double)buf[2] / (double)buf[1];
+}
+
+// 按 lua 函数的 source 做子串匹配的模式列表
+struct source_filter {
+    char**  patterns;
+    int     count;
+};
+
+static void
+free_source_filter(struct source_filter* filter) {
+    for (int i = 0; i < filter->count; i++) {
+        pfree(filter->patterns[i]);
+    }
+    pfree(filter->patterns);
+    filter->patterns = NULL;
+    filter->count = 0;
+}
+
+static bool
+source_filter_match(const struct source_filter* filter, const char* source) {
+    for (int i = 0; i < filter->count; i++) {
+        if (strstr(source, filter->patterns[i])) return true;
+    }
+    return false;
+}
+
+// 读取栈顶的字符串数组
+static bool
+read_source_filter(lua_State* L, const char* field, struct source_filter* filter) {
+    if (lua_isnil(L, -1)) return true;
+    if (!lua_istable(L, -1)) {printf("ERROR: %s should be a list of strings\n", field); return false;}
+    int n = (int)lua_rawlen(L, -1);
+    filter->patterns = (char**)pcalloc(n > 0 ? n : 1, sizeof(char*));
+    for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, -1, i);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            printf("ERROR: %s[%d] should be a string\n", field, i);
+            lua_pop(L, 1);
+            return false;
+        }
+        filter->patterns[filter->count++] = pstrdup(lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+    return true;
+}
+
+struct profile_options {
+    int level;              // define in PROFILE_LEVEL enum
+    int mem_profile_mode;   // define in PROFILE_MODE enum
+    int structure;          // define in PROFILE_STRUCTURE enum
+    bool fold_recursion;    // 递归折叠：路径上已出现的函数再次调用时回到祖先节点
+    bool merge_reloads;     // 热更新合并：以 (source, linedefined, lastlinedefined) 识别函数，重新加载的同一函数合并到同一节点
+    bool skip_c_functions;  // 过滤所有 c 函数
+    bool calibrate;         // 启动时运行微基准测出各类事件的 hook 开销
+    int max_tags;           // 最多的 tag 数，超出后新的 tag 都归到 [other]
+    int windows;            // 保留最近多少个时间窗口的统计，0 表示不启用
+    double max_overhead_percent;    // hook 开销占比的上限，超出时自动降低统计级别，0 表示不启用
+    bool instrument;        // false 表示只用 zone 统计，不装 call/ret hook
+    bool extraspace;        // true 表示宿主不使用 lua_getextraspace，允许把 call_state 指针存在里面
+    int window_seconds;     // 每个时间窗口的长度
+    int counters[MAX_COUNTERS];     // 要打开的 perf 计数器，counter_defs 的下标
+    int counter_count;
+    struct source_filter include;   // 非空时，只统计 source 匹配其中之一的 lua 函数
+    struct source_filter exclude;   // source 匹配其中之一的 lua 函数不统计
+};
+
+static void
+init_profile_options(struct profile_options* opts) {
+    opts->level = PROFILE_LEVEL_FULL;
+    opts->mem_profile_mode = PROFILE_MODE_OFF;
+    opts->structure = PROFILE_STRUCTURE_TREE;
+    opts->fold_recursion = false;
+    opts->merge_reloads = false;
+    opts->skip_c_functions = false;
+    opts->calibrate = true;
+    opts->max_tags = DEFAULT_MAX_TAGS;
+    opts->windows = 0;
+    opts->max_overhead_percent = 0;
+    opts->instrument = true;
+    opts->extraspace = false;
+    opts->window_seconds = DEFAULT_WINDOW_SECONDS;
+    opts->counter_count = 0;
+    opts->include.patterns = NULL;
+    opts->include.count = 0;
+    opts->exclude.patterns = NULL;
+    opts->exclude.count = 0;
+}
+
+static void
+free_profile_options(struct profile_options* opts) {
+    free_source_filter(&opts->include);
+    free_source_filter(&opts->exclude);
+}
+
+// 读取启动参数：{ level = "count|time|time+mem|full", mem_profile = "off|on", structure = "tree|graph", fold_recursion = true|false, merge_reloads = true|false,
+//               include = {...}, exclude = {...}, skip_c_functions = true|false, calibrate = true|false, max_tags = n,
+//               windows = k, window_seconds = t, max_overhead_percent = p, instrument = true|false, counters = {...},
+//               extraspace = true|false }
 static bool
-read_arg(lua_State* L, int* out_mem_profile) {
-    if (!out_mem_profile) return false;
+read_arg(lua_State* L, struct profile_options* opts) {
+    if (!opts) return false;
     if (lua_gettop(L) < 1 || !lua_istable(L, 1)) return true;
 
     // 是否启用内存 profile
     lua_getfield(L, 1, "mem_profile");
     if (lua_isstring(L, -1)) {
         const char* s = lua_tostring(L, -1);
-        if (strcmp(s, "off") == 0) *out_mem_profile = PROFILE_MODE_OFF;
-        else if (strcmp(s, "on") == 0) *out_mem_profile = PROFILE_MODE_ON;
+        if (strcmp(s, "off") == 0) opts->mem_profile_mode = PROFILE_MODE_OFF;
+        else if (strcmp(s, "on") == 0) opts->mem_profile_mode = PROFILE_MODE_ON;
         else {printf("ERROR: invalid mem_profile mode: %s\n", s); return false;}
     }
     lua_pop(L, 1);
 
+    // 统计级别，指定时覆盖 mem_profile
+    lua_getfield(L, 1, "level");
+    if (lua_isstring(L, -1)) {
+        const char* s = lua_tostring(L, -1);
+        if (strcmp(s, "count") == 0) opts->level = PROFILE_LEVEL_COUNT;
+        else if (strcmp(s, "time") == 0) opts->level = PROFILE_LEVEL_TIME;
+        else if (strcmp(s, "time+mem") == 0) opts->level = PROFILE_LEVEL_TIME_MEM;
+        else if (strcmp(s, "full") == 0) opts->level = PROFILE_LEVEL_FULL;
+        else {printf("ERROR: invalid level: %s\n", s); lua_pop(L, 1); return false;}
+        opts->mem_profile_mode = (opts->level >= PROFILE_LEVEL_TIME_MEM) ? PROFILE_MODE_ON : PROFILE_MODE_OFF;
+    }
+    lua_pop(L, 1);
+
+    // 统计结构：完整调用树，或者按函数聚合的调用图
+    lua_getfield(L, 1, "structure");
+    if (lua_isstring(L, -1)) {
+        const char* s = lua_tostring(L, -1);
+        if (strcmp(s, "tree") == 0) opts->structure = PROFILE_STRUCTURE_TREE;
+        else if (strcmp(s, "graph") == 0) opts->structure = PROFILE_STRUCTURE_GRAPH;
+        else {printf("ERROR: invalid structure: %s\n", s); lua_pop(L, 1); return false;}
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "fold_recursion");
+    if (lua_isboolean(L, -1)) {
+        opts->fold_recursion = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "merge_reloads");
+    if (lua_isboolean(L, -1)) {
+        opts->merge_reloads = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "skip_c_functions");
+    if (lua_isboolean(L, -1)) {
+        opts->skip_c_functions = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "calibrate");
+    if (lua_isboolean(L, -1)) {
+        opts->calibrate = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "instrument");
+    if (lua_isboolean(L, -1)) {
+        opts->instrument = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "extraspace");
+    if (lua_isboolean(L, -1)) {
+        opts->extraspace = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "max_tags");
+    if (lua_isinteger(L, -1)) {
+        lua_Integer n = lua_tointeger(L, -1);
+        if (n < 1 || n > MAX_TAGS_LIMIT) {printf("ERROR: invalid max_tags: %lld\n", (long long)n); lua_pop(L, 1); return false;}
+        opts->max_tags = (int)n;
+    }
+    lua_pop(L, 1);
+
+    // 时间窗口：保留最近 windows 个、每个 window_seconds 秒的统计，供 window_dump 查询
+    lua_getfield(L, 1, "windows");
+    if (lua_isinteger(L, -1)) {
+        lua_Integer n = lua_tointeger(L, -1);
+        if (n < 0 || n > MAX_WINDOWS) {printf("ERROR: invalid windows: %lld\n", (long long)n); lua_pop(L, 1); return false;}
+        opts->windows = (int)n;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "window_seconds");
+    if (lua_isinteger(L, -1)) {
+        lua_Integer n = lua_tointeger(L, -1);
+        if (n < 1) {printf("ERROR: invalid window_seconds: %lld\n", (long long)n); lua_pop(L, 1); return false;}
+        opts->window_seconds = (int)n;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "max_overhead_percent");
+    if (lua_isnumber(L, -1)) {
+        double p = lua_tonumber(L, -1);
+        if (!(p >= 0 && p < 100)) {printf("ERROR: invalid max_overhead_percent: %f\n", p); lua_pop(L, 1); return false;}
+        opts->max_overhead_percent = p;
+    }
+    lua_pop(L, 1);
+
+    // perf 计数器：名字列表，见 counter_defs
+    lua_getfield(L, 1, "counters");
+    if (lua_istable(L, -1)) {
+        int n = (int)lua_rawlen(L, -1);
+        if (n > MAX_COUNTERS) {printf("ERROR: at most %d counters\n", MAX_COUNTERS); lua_pop(L, 1); return false;}
+        for (int i = 1; i <= n; i++) {
+            lua_rawgeti(L, -1, i);
+            int def = lua_type(L, -1) == LUA_TSTRING ? find_counter_def(lua_tostring(L, -1)) : -1;
+            if (def < 0) {
+                printf("ERROR: invalid counters[%d]: %s\n", i, lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : "not a string");
+                lua_pop(L, 2);
+                return false;
+            }
+            lua_pop(L, 1);
+            opts->counters[opts->counter_count++] = def;
+        }
+    } else if (!lua_isnil(L, -1)) {
+        printf("ERROR: counters should be a list of strings\n");
+        lua_pop(L, 1);
+        return false;
+    }
+    lua_pop(L, 1);
+
+    // 源码过滤：按 source 子串匹配，每个函数只在第一次见到时判断一次
+    lua_getfield(L, 1, "include");
+    bool filter_ok = read_source_filter(L, "include", &opts->include);
+    lua_pop(L, 1);
+    if (!filter_ok) return false;
+
+    lua_getfield(L, 1, "exclude");
+    filter_ok = read_source_filter(L, "exclude", &opts->exclude);
+    lua_pop(L, 1);
+    if (!filter_ok) return false;
+
+    return true;
+}
+
+// 导出参数，裁剪掉的兄弟节点合并为一个 [other] 节点
+struct dump_prune {
+    double   min_percent;   // cpu_cost_raw 占父节点的百分比低于该值的子节点被裁剪
+    uint64_t min_ns;        // cpu_cost_raw 低于该值的子节点被裁剪
+    uint32_t top_children;  // 每个节点最多保留的子节点数，0 表示不限制
+    bool     skip_idle;     // 去掉没有调用、耗时和内存分配的子节点，不合并到 [other]，window_dump 使用
+};
+
+static void
+init_dump_prune(struct dump_prune* prune) {
+    prune->min_percent = 0;
+    prune->min_ns = 0;
+    prune->top_children = 0;
+    prune->skip_idle = false;
+}
+
+// 读取导出参数：{ min_percent = 1.0, min_ns = 1000000, top_children = 20 }
+static bool
+read_dump_prune(lua_State* L, int idx, struct dump_prune* prune) {
+    init_dump_prune(prune);
+    if (lua_gettop(L) < idx || !lua_istable(L, idx)) return true;
+
+    lua_getfield(L, idx, "min_percent");
+    if (lua_isnumber(L, -1)) {
+        prune->min_percent = lua_tonumber(L, -1);
+        if (prune->min_percent < 0) {printf("ERROR: invalid min_percent\n"); lua_pop(L, 1); return false;}
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "min_ns");
+    if (lua_isnumber(L, -1)) {
+        lua_Integer v = lua_tointeger(L, -1);
+        if (v < 0) {printf("ERROR: invalid min_ns\n"); lua_pop(L, 1); return false;}
+        prune->min_ns = (uint64_t)v;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "top_children");
+    if (lua_isnumber(L, -1)) {
+        lua_Integer v = lua_tointeger(L, -1);
+        if (v < 0) {printf("ERROR: invalid top_children\n"); lua_pop(L, 1); return false;}
+        prune->top_children = (uint32_t)v;
+    }
+    lua_pop(L, 1);
+
     return true;
 }
 
 struct call_frame {
-    const void* prototype;
+    uint64_t    key;        // 函数 key，见 get_function_key
     struct icallpath_context*   path;
+    struct func_stat*   func;   // 函数的聚合统计，graph 模式下是函数节点，tree 模式下供 top 查询
+    struct graph_edge*  edge;   // graph 模式下 caller -> 本函数的边
     bool    tail_pending;  // true: 该帧已发起 tailcall，等待子调用返回后再隐式结算
+    bool    skip_cost;     // true: 节点已被本协程更外层的帧统计，返回时不再累加耗时（递归折叠）
+    bool    holds_active;  // true: 本帧计入了节点的 active 计数
+    bool    holds_func;    // true: 本帧计入了 func 的 active 计数
+    bool    filtered;      // true: 被过滤函数的占位帧（只在未过滤的帧尾调用被过滤函数时产生），path/func 沿用调用者的，不统计
+    bool    zone;          // true: zone_begin 压入的帧，ci 为打开它的函数的 CallInfo
+    uint32_t recursion;    // 折叠到本帧的直接递归层数，这些层不单独压帧
+    int     tag;           // 压帧时生效的 tag，0 表示没有 tag
+    const CallInfo* ci;    // 最内层的 CallInfo，过滤时用来判断尾调用和递归是否来自本帧
+    struct line_table*  lines;  // profile_lines 选中的函数的逐行统计，其他函数为 NULL
+    int     line;           // 当前执行的行，0 表示还没有收到 line 事件
+    uint64_t line_time;     // 当前行开始的时间
+    uint64_t line_co_cost;  // 当前行开始时的 co_cost，用于扣除行内的 co yield 耗时
     uint64_t call_time;
     uint64_t co_cost;     // co yield cost 
+    uint64_t child_cost;  // 已返回的子调用耗时，用于计算 self 耗时
+    uint64_t ctr_call[MAX_COUNTERS];  // 压帧时的计数器读数，启用 counters 时才有效
+    uint64_t ctr_co[MAX_COUNTERS];    // co yield 期间的计数器增量，同 co_cost
 };
 
 struct call_state {
     lua_State*  co;
     uint64_t    leave_time; // co yield begin time
+    uint32_t    epoch;      // 栈上帧所属的统计周期，见 sync_call_state
+    uint32_t    pause_seq;  // 栈上帧对齐过的 resume 次数，见 resync_call_state
+    int         tag;        // 本协程的 tag，非 0 时覆盖全局 tag
     int         top;
+    uint64_t    leave_ctr[MAX_COUNTERS];    // 挂起时的计数器读数，同 leave_time
     struct call_frame call_list[0];
 };
 
 struct profile_context {
     uint64_t    start_time;
     bool        is_ready;
+    uint8_t     paused;                     // PAUSE_USER/PAUSE_GOVERNOR 的组合，非 0 时 hook 只检查该标记就返回，调用树、符号、alloc_map、协程栈都保留
     bool        running_in_hook;
     lua_Alloc   last_alloc_f;
     void*       last_alloc_ud;
     struct imap_context*        cs_map;
     struct imap_context*        alloc_map;
+    struct icallpath_context*   leak_paths; // swap_dump 换下的树上仍有存活块的路径，只有符号，供 leak_report 使用
     struct imap_context*        symbol_map;
+    struct imap_context*        func_map;   // key -> func_stat，按函数聚合，tree 模式下供 top 查询
+    struct imap_context*        proto_map;  // Proto 地址 -> proto_ident
+    struct imap_context*        stable_map; // merge_reloads：(source, linedefined, lastlinedefined) 的 hash -> symbol_info
+    uint64_t    func_seq;                   // 分配 lua 函数 key 的序号
     struct icallpath_context*   callpath;
     struct call_state*          cur_cs;
+    bool        use_extraspace;             // 协程的 call_state 指针存在 lua_getextraspace 里，未开启 extraspace 或宿主占用了该区域时用 cs_map 查询
+    int         level;            // define in PROFILE_LEVEL enum
+    lua_Hook    hook;             // level 对应的特化 hook
     int         mem_profile_mode; // define in PROFILE_MODE enum
+    int         structure;        // define in PROFILE_STRUCTURE enum
+    bool        fold_recursion;
+    bool        merge_reloads;
+    bool        filtering;                  // 是否设置了 include/exclude/skip_c_functions
+    bool        skip_c_functions;
+    struct source_filter    include;
+    struct source_filter    exclude;
+    struct imap_context*        line_map;   // profile_lines：函数 key -> line_table
+    int         line_targets;               // 启用逐行统计的函数数
+    int         tag;                        // 全局 tag，0 表示没有 tag
+    int         max_tags;
+    char**      tag_names;                  // tag id -> 名字，大小为 max_tags + 2（0 不用，max_tags + 1 为 [other]），只追加
+    int         tag_count;                  // 已注册的 tag 数，不含 [other]
+    bool        instrument;                 // false 时 mark/mark_all 不装 hook，只有 zone 压帧
+    uint64_t*   zone_keys;                  // zone id - 1 -> 帧的 key
+    int         zone_count;
+    int         zone_cap;
     uint64_t    profiler_cpu_cost_total;
     uint64_t    cpu_call_count_total;
+    bool        calibrated;                         // overhead_cost 是否来自启动时的校准
+    double      overhead_cost[OVH_CLASS_COUNT];     // 校准得到的各类事件单次开销(ns)，OVH_FIRST_VISIT 在运行中统计
+    uint64_t    first_visit_cost_total;             // 首次见到函数的 hook 的总耗时
+    uint64_t    first_visit_count;
+    uint32_t    epoch;                      // 统计周期，每次 swap_dump 换树后加 1
+    uint64_t    epoch_start_time;           // 当前统计周期的开始时间
+    uint64_t    pause_time;                 // 最近一次 pause 的时间
+    uint64_t    paused_ns;                  // 当前统计周期内已结束的 pause 的总时长，不计入 duration
+    uint32_t    pause_seq;                  // resume 次数，协程栈在下次遇到时按真实的 CallInfo 链对齐
+    size_t      unresolved_symbols;         // 尚未解析的符号数，为 0 时 swap_dump 跳过解析
+    uint32_t    generation;                 // 当前的分配代，mark_generation 时加 1
+    int         windows;                    // 时间窗口数，0 表示不启用
+    uint64_t    window_ns;                  // 时间窗口的长度
+    uint64_t    window_seq;                 // 当前窗口的序号，从 1 开始，窗口 s 覆盖 [start_time + (s-1)*window_ns, start_time + s*window_ns)
+    uint64_t    window_next_time;           // 当前窗口的结束时间，hook 中到点时推进 window_seq
+    struct window_pause* window_paused;     // 各窗口内的 pause 时长，window_dump 时从覆盖的时长中扣除
+    double      max_overhead_percent;       // 大于 0 时启用开销调节，见 governor_poll
+    int         gov_rungs[GOVERNOR_MAX_RUNGS];  // 从高到低可用的统计级别，最后一级是 count 加时间片采样
+    int         gov_rung_count;
+    int         gov_rung;                   // 当前所在的级别
+    uint32_t    gov_events;                 // 距上次读时钟的 hook 事件数
+    uint64_t    gov_interval_events;        // 当前区间的 hook 事件数
+    uint64_t    gov_interval_start;
+    uint64_t    gov_cost_mark;              // 区间开始时的 profiler_cpu_cost_total
+    double      gov_event_cost;             // 计时 hook 单次事件开销的估计(ns)，计时级别下按实测更新
+    uint64_t    gov_alloc_events;           // 当前区间 alloc hook 的调用次数
+    uint64_t    gov_alloc_cost;             // 当前区间 alloc hook 的开销(ns)，按抽样的耗时乘以 GOVERNOR_ALLOC_SAMPLE 推算
+    double      gov_alloc_event_cost;       // 记录内存分配时 alloc hook 单次开销的估计(ns)，在记录内存的级别下按实测更新
+    uint32_t    gov_phase;                  // 采样级别下的区间序号
+    uint64_t    gov_level_changes;
+    struct perf_counters        counters;   // 启用 counters 时打开的 perf 计数器，只在计时级别下读
+    uint64_t    ctr_now[MAX_COUNTERS];      // 最近一次读到的计数器，计时 hook 和 zone 开头更新
+    uint64_t    ctr_pause[MAX_COUNTERS];    // 最近一次 pause 时的读数，同 pause_time
+    uint64_t    ctr_epoch[MAX_COUNTERS];    // 当前统计周期开始时的读数，同 epoch_start_time
+    struct dump_job*            dump_job;   // swap_dump 的后台任务
 };
 
 struct callpath_node {
     struct callpath_node*   parent;
-    const char* source;
-    const char* name;
-    int     line;
+    struct symbol_info*     sym;    // 符号信息，dump 时才解析
     int     depth;
+    int     tag;                // 节点所在子树的 tag，和父节点不同时该节点是 tag 子树的根
+    int     active;             // 递归折叠时，节点在 active_cs 栈上的活跃帧数
+    const void* active_cs;      // 递归折叠时，当前占有该节点的协程
     uint64_t last_ret_time;
     uint64_t call_count;
     uint64_t call_count_incl;
@@ -376,27 +1004,143 @@ struct callpath_node {
     uint64_t alloc_times;
     uint64_t free_times;
     uint64_t realloc_times;
+    uint64_t heap_bytes;        // dump_async 子进程中根据 alloc_map 汇总的存活字节
+    uint64_t heap_blocks;       // dump_async 子进程中根据 alloc_map 汇总的存活块数
+    // 以下 incl 指标在导出前由 compute_inclusive 汇总
+    uint64_t alloc_bytes_incl;
+    uint64_t free_bytes_incl;
+    uint64_t alloc_times_incl;
+    uint64_t free_times_incl;
+    uint64_t realloc_times_incl;
+    uint64_t heap_bytes_incl;
+    uint64_t heap_blocks_incl;
+    uint64_t ev[OVH_CLASS_COUNT];       // 落在本节点的各类 hook 事件数
+    uint64_t ev_incl[OVH_CLASS_COUNT];
+    struct window_slot* win;    // 启用时间窗口时的环，大小为 windows，第一次更新时分配
+    uint64_t* ctr;              // 启用 counters 时各计数器的 incl 增量，大小为 MAX_COUNTERS，第一次结算时分配
+    struct size_hist* hist;     // 分配大小直方图，第一次在本节点分配时创建
+};
+
+// 按 2 的幂分档的分配大小直方图：第 0 档为 <=8，第 i 档为 (8<<(i-1), 8<<i]，最后一档包含所有更大的
+struct size_hist {
+    uint64_t alloc[SIZE_CLASS_COUNT];
+    uint64_t realloc[SIZE_CLASS_COUNT];     // realloc 按新的大小分档
+    // 以下 incl 在导出前由 compute_inclusive 汇总
+    uint64_t alloc_incl[SIZE_CLASS_COUNT];
+    uint64_t realloc_incl[SIZE_CLASS_COUNT];
+};
+
+static const char* size_class_names[SIZE_CLASS_COUNT] = {
+    "<=8", "<=16", "<=32", "<=64", "<=128", "<=256", "<=512", "<=1K",
+    "<=2K", "<=4K", "<=8K", "<=16K", "<=32K", "<=64K", "<=128K", ">128K",
+};
+
+static inline int
+size_class(size_t size) {
+    if (size <= 8) return 0;
+    int c = 64 - __builtin_clzll((unsigned long long)(size - 1)) - 3;
+    return c < SIZE_CLASS_COUNT ? c : SIZE_CLASS_COUNT - 1;
+}
+
+// 一个时间窗口内落在节点上的统计。环按窗口序号取模复用，seq 和当前序号不同的槽是旧窗口的，写之前清零
+struct window_slot {
+    uint64_t seq;
+    uint64_t call_count;
+    uint64_t cpu_cost_raw;
+    uint64_t alloc_bytes;
+    uint64_t free_bytes;
+    uint64_t alloc_times;
+    uint64_t free_times;
+    uint64_t realloc_times;
+};
+
+// 一个时间窗口内已结束的 pause 时长，同 window_slot 按窗口序号取模复用
+struct window_pause {
+    uint64_t seq;
+    uint64_t paused_ns;
+};
+
+// 按函数聚合的统计，graph 模式下是函数节点，内存只和函数数、边数相关，和调用栈的数量无关
+struct func_stat {
+    uint64_t key;
+    struct symbol_info* sym;
+    uint64_t call_count;
+    uint64_t cpu_cost_self;
+    uint64_t cpu_cost_incl;
+    int     active;     // 当前在 active_cs 栈上的层数，递归时只在最外层累计 incl
+    const struct call_state* active_cs;   // 持有 active 计数的协程，其他协程里的帧各自按最外层统计
+    int     id;         // dump 时分配的序号，edges 中用它引用函数
+    struct imap_context* callees;   // callee key -> graph_edge
+};
+
+struct graph_edge {
+    struct func_stat* caller;
+    struct func_stat* callee;
+    uint64_t call_count;
+    uint64_t cpu_cost;  // 从 caller 调用时 callee 的 incl 耗时
+};
+
+// profile_lines 选中的函数的逐行统计，按函数聚合，和调用路径无关
+struct line_stat {
+    uint64_t count;
+    uint64_t cpu_cost;  // 从该行的 line 事件到下一次 line 事件（或函数返回）的耗时，包含行内的子调用
+};
+
+struct line_table {
+    uint64_t key;
+    struct symbol_info* sym;
+    bool    enabled;
+    struct imap_context* lines;     // line -> line_stat
 };
 
 struct alloc_node {
     size_t live_bytes;                // 当前存活字节
     struct callpath_node* path;       // 当前所有权路径
+    uint32_t epoch;                   // 分配时的统计周期，旧周期的树已经导出释放，不能再更新 path
+    uint32_t generation;              // 分配时的代，见 mark_generation；realloc 保留原来的代
+};
+
+enum SYMBOL_KIND {
+    SYMBOL_KIND_LUA,
+    SYMBOL_KIND_C,
+    SYMBOL_KIND_ZONE,   // zone_register 登记的区域，key 为符号自身的地址，登记时就已解析
 };
 
+// hook 中只记录函数 key，函数名推迟到 dump 时批量解析。
+// lua 函数的 source/line 在首次见到 Proto 时就拷贝下来，Proto 之后被回收也不影响符号。
 struct symbol_info {
-    char* name;
-    char* source;
-    int line;
+    uint64_t    key;
+    const void* proto;  // lua 函数为最近一次见到的 Proto，c 函数为函数指针
+    int     kind;       // define in SYMBOL_KIND enum
+    bool    resolved;
+    char*   name;
+    char*   source;
+    int     line;
+    int     lastline;
+    struct symbol_info* hash_next;  // merge_reloads 时 stable_map 中同 hash 的下一个符号
+};
+
+static struct symbol_info root_symbol = {0, NULL, SYMBOL_KIND_C, true, "root", "root", 0, 0, NULL};
+
+// Proto 地址 -> 函数 key 的缓存。Proto 被回收后地址可能被复用，所以命中时要校验
+struct proto_ident {
+    const TString* source;
+    int linedefined;
+    int lastlinedefined;
+    int sizecode;
+    uint64_t key;
+    bool filtered;      // 是否被 include/exclude 过滤，每个 Proto 只判断一次
 };
 
 static struct callpath_node*
 callpath_node_create() {
     struct callpath_node* node = (struct callpath_node*)pmalloc(sizeof(*node));
     node->parent = NULL;
-    node->source = NULL;
-    node->name = NULL;
-    node->line = 0;
+    node->sym = NULL;
     node->depth = 0;
+    node->tag = 0;
+    node->active = 0;
+    node->active_cs = NULL;
     node->last_ret_time = 0;
     node->call_count = 0;
     node->call_count_incl = 0;
@@ -406,31 +1150,97 @@ callpath_node_create() {
     node->alloc_times = 0;
     node->free_times = 0;
     node->realloc_times = 0;
+    node->heap_bytes = 0;
+    node->heap_blocks = 0;
+    node->alloc_bytes_incl = 0;
+    node->free_bytes_incl = 0;
+    node->alloc_times_incl = 0;
+    node->free_times_incl = 0;
+    node->realloc_times_incl = 0;
+    node->heap_bytes_incl = 0;
+    node->heap_blocks_incl = 0;
+    memset(node->ev, 0, sizeof(node->ev));
+    memset(node->ev_incl, 0, sizeof(node->ev_incl));
+    node->win = NULL;
+    node->ctr = NULL;
+    node->hist = NULL;
     return node;
 }
 
-struct sum_call_count_arg {
-    uint64_t sum;
-};
-
-static uint64_t compute_call_count_incl(struct icallpath_context* path);
-
-static void _sum_call_count_incl_child(uint64_t key, void* value, void* ud) {
-    (void)key;
-    struct sum_call_count_arg* arg = (struct sum_call_count_arg*)ud;
-    arg->sum += compute_call_count_incl((struct icallpath_context*)value);
+// 释放调用树，节点的窗口环、计数器和直方图单独分配
+static void callpath_free(struct icallpath_context* callpath) {
+    struct icallpath_stack st = {NULL, 0, 0};
+    icallpath_stack_push(&st, callpath);
+    while (st.size > 0) {
+        struct icallpath_context* cur = st.items[--st.size];
+        struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(cur);
+        if (node && node->win) {
+            pfree(node->win);
+            node->win = NULL;
+        }
+        if (node && node->ctr) {
+            pfree(node->ctr);
+            node->ctr = NULL;
+        }
+        if (node && node->hist) {
+            pfree(node->hist);
+            node->hist = NULL;
+        }
+        imap_dump(cur->children, _icallpath_stack_push_child, &st);
+    }
+    pfree(st.items);
+    icallpath_free(callpath);
 }
 
-static uint64_t compute_call_count_incl(struct icallpath_context* path) {
-    struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(path);
-    if (!node) return 0;
-
-    struct sum_call_count_arg arg = {0};
-    if (icallpath_children_size(path) > 0) {
-        icallpath_dump_children(path, _sum_call_count_incl_child, &arg);
+// 汇总 incl 指标：先用显式栈按先序收集所有节点，再逆序把每个节点累加到父节点，子节点一定先于父节点完成
+static void compute_inclusive(struct icallpath_context* callpath) {
+    struct icallpath_stack order = {NULL, 0, 0};
+    struct icallpath_stack st = {NULL, 0, 0};
+    icallpath_stack_push(&st, callpath);
+    while (st.size > 0) {
+        struct icallpath_context* cur = st.items[--st.size];
+        struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(cur);
+        node->call_count_incl = node->call_count;
+        node->alloc_bytes_incl = node->alloc_bytes;
+        node->free_bytes_incl = node->free_bytes;
+        node->alloc_times_incl = node->alloc_times;
+        node->free_times_incl = node->free_times;
+        node->realloc_times_incl = node->realloc_times;
+        node->heap_bytes_incl = node->heap_bytes;
+        node->heap_blocks_incl = node->heap_blocks;
+        memcpy(node->ev_incl, node->ev, sizeof(node->ev));
+        if (node->hist) {
+            memcpy(node->hist->alloc_incl, node->hist->alloc, sizeof(node->hist->alloc));
+            memcpy(node->hist->realloc_incl, node->hist->realloc, sizeof(node->hist->realloc));
+        }
+        icallpath_stack_push(&order, cur);
+        imap_dump(cur->children, _icallpath_stack_push_child, &st);
+    }
+    for (size_t i = order.size; i > 1; i--) {
+        struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(order.items[i-1]);
+        struct callpath_node* parent = node->parent;
+        parent->call_count_incl += node->call_count_incl;
+        parent->alloc_bytes_incl += node->alloc_bytes_incl;
+        parent->free_bytes_incl += node->free_bytes_incl;
+        parent->alloc_times_incl += node->alloc_times_incl;
+        parent->free_times_incl += node->free_times_incl;
+        parent->realloc_times_incl += node->realloc_times_incl;
+        parent->heap_bytes_incl += node->heap_bytes_incl;
+        parent->heap_blocks_incl += node->heap_blocks_incl;
+        for (int k = 0; k < OVH_CLASS_COUNT; k++) {
+            parent->ev_incl[k] += node->ev_incl[k];
+        }
+        if (node->hist) {
+            // 祖先自己没有分配时在这里补上直方图，只有 incl 部分非 0
+            if (!parent->hist) parent->hist = (struct size_hist*)pcalloc(1, sizeof(struct size_hist));
+            for (int k = 0; k < SIZE_CLASS_COUNT; k++) {
+                parent->hist->alloc_incl[k] += node->hist->alloc_incl[k];
+                parent->hist->realloc_incl[k] += node->hist->realloc_incl[k];
+            }
+        }
     }
-    node->call_count_incl = node->call_count + arg.sum;
-    return node->call_count_incl;
+    pfree(order.items);
+    pfree(st.items);
 }
 
 static inline bool is_root_path(struct profile_context* pcontext, struct icallpath_context* path) {
@@ -442,78 +1252,48 @@ alloc_node_create() {
     struct alloc_node* node = (struct alloc_node*)pmalloc(sizeof(*node));
     node->live_bytes = 0;
     node->path = NULL;
+    node->epoch = 0;
+    node->generation = 0;
     return node;
 }
 
-struct dump_call_path_arg {
-    struct profile_context* pcontext;
-    lua_State* L;
-    uint64_t index;
-    uint64_t alloc_bytes_sum;
-    uint64_t free_bytes_sum;
-    uint64_t alloc_times_sum;
-    uint64_t free_times_sum;
-    uint64_t realloc_times_sum;
-    double avg_profiler_cost_per_call;
+// tag 子树的汇总：tag 和父节点不同的节点是 tag 子树的根，按根节点的 incl 指标累加，嵌套的内层 tag 子树同时计入外层
+struct tag_total {
+    int tag;
+    uint64_t call_count;
+    uint64_t cpu_cost_raw;
+    uint64_t cpu_cost_real;
+    uint64_t alloc_bytes;
+    uint64_t free_bytes;
+    uint64_t alloc_times;
 };
 
-static void _init_dump_call_path_arg(struct dump_call_path_arg* arg, struct profile_context* pcontext, lua_State* L) {
-    arg->pcontext = pcontext;
-    arg->L = L;
-    arg->index = 0;
-    arg->alloc_bytes_sum = 0;
-    arg->free_bytes_sum = 0;
-    arg->alloc_times_sum = 0;
-    arg->free_times_sum = 0;
-    arg->realloc_times_sum = 0;
-    arg->avg_profiler_cost_per_call = 0;
-}
-
-static inline char*
-pstrdup(const char* s) {
-    if (!s) return NULL;
-    size_t n = strlen(s);
-    char* d = (char*)pmalloc(n + 1);
-    memcpy(d, s, n);
-    d[n] = '\0';
-    return d;
+static inline bool is_tag_root(const struct callpath_node* node) {
+    return node->tag && (!node->parent || node->parent->tag != node->tag);
 }
 
-static struct symbol_info*
-get_symbol_info(lua_State* co, lua_Debug* far, uint64_t sym_key, struct imap_context* symbol_map) {
-    struct symbol_info* si = (struct symbol_info*)imap_query(symbol_map, sym_key);
-    if (si) return si;
-
-    lua_getinfo(co, "nSl", far);
-    const char* name = far->name;
-    int line = far->linedefined;
-    const char* source = far->source;
-    char flag = far->what[0];
-    if (flag == 'C') {
-        lua_Debug ar2;
-        int i = 0;
-        int ret = 0;
-        do {
-            i++;
-            ret = lua_getstack(co, i, &ar2);
-            if (ret) {
-                lua_getinfo(co, "Sl", &ar2);
-                if (ar2.what[0] != 'C') {
-                    line = ar2.currentline;
-                    source = ar2.source;
-                    break;
-                }
-            }
-        } while (ret);
-    }
-
-    si = (struct symbol_info*)pmalloc(sizeof(struct symbol_info));
-    si->name = pstrdup(name ? name : "null");
-    si->source = pstrdup(source ? source : "null");
-    si->line = line;
-    imap_set(symbol_map, sym_key, si);
-    return si;
-}
+// 导出时需要的全局统计，swap_dump 换树时拷贝一份，工作线程不再访问 profile_context
+struct dump_snapshot {
+    int level;
+    int mem_profile_mode;
+    bool heap_snapshot;     // 节点上的 heap_bytes/heap_blocks 是否有效
+    uint64_t profiler_cpu_cost_total;
+    uint64_t cpu_call_count_total;
+    double avg_profiler_cost_per_call;
+    bool calibrated;
+    double class_cost[OVH_CLASS_COUNT];     // 扣除 hook 开销时各类事件的单次开销
+    struct dump_prune prune;
+    const char* const* tag_names;   // 指向 profile_context 的 tag_names，只追加，导出期间已有的项不会变
+    int tag_slots;                  // tag_names 的大小，没有启用 tag 时为 0
+    struct tag_total* tag_totals;   // prepare_call_path 计算，按 cpu_cost_raw 降序，由 free_dump_snapshot 释放
+    int tag_total_count;
+    const char* active_level;       // 开销调节当前所在的级别，没有启用时为 NULL
+    uint64_t level_changes;
+    int counter_count;
+    const char* counter_names[MAX_COUNTERS];    // 指向 counter_defs 的名字
+    int ipc_instructions;           // 同时打开了 instructions 和 cycles 时导出 ipc，否则为 -1
+    int ipc_cycles;
+};
 
 static struct profile_context *
 profile_create() {
@@ -521,17 +1301,81 @@ profile_create() {
     
     context->start_time = 0;
     context->is_ready = false;
+    context->paused = 0;
     context->cs_map = imap_create();
     context->alloc_map = imap_create();
+    context->leak_paths = NULL;
     context->symbol_map = imap_create();
+    context->func_map = imap_create();
+    context->proto_map = imap_create();
+    context->stable_map = imap_create();
+    context->func_seq = 0;
     context->callpath = NULL;
     context->cur_cs = NULL;
+    context->use_extraspace = false;
     context->running_in_hook = false;
     context->last_alloc_f = NULL;
     context->last_alloc_ud = NULL;
+    context->level = PROFILE_LEVEL_FULL;
+    context->hook = NULL;
     context->mem_profile_mode = PROFILE_MODE_OFF;
+    context->structure = PROFILE_STRUCTURE_TREE;
+    context->fold_recursion = false;
+    context->merge_reloads = false;
+    context->filtering = false;
+    context->skip_c_functions = false;
+    context->include.patterns = NULL;
+    context->include.count = 0;
+    context->exclude.patterns = NULL;
+    context->exclude.count = 0;
+    context->line_map = imap_create_sized(GRAPH_EDGE_SLOT_SIZE);
+    context->line_targets = 0;
+    context->tag = 0;
+    context->max_tags = 0;
+    context->tag_names = NULL;
+    context->tag_count = 0;
+    context->instrument = true;
+    context->zone_keys = NULL;
+    context->zone_count = 0;
+    context->zone_cap = 0;
     context->profiler_cpu_cost_total = 0;
     context->cpu_call_count_total = 0;
+    context->calibrated = false;
+    for (int i = 0; i < OVH_CLASS_COUNT; i++) {
+        context->overhead_cost[i] = 0;
+    }
+    context->first_visit_cost_total = 0;
+    context->first_visit_count = 0;
+    context->epoch = 0;
+    context->epoch_start_time = 0;
+    context->pause_time = 0;
+    context->paused_ns = 0;
+    context->pause_seq = 0;
+    context->unresolved_symbols = 0;
+    context->generation = 0;
+    context->windows = 0;
+    context->window_ns = 0;
+    context->window_seq = 0;
+    context->window_next_time = 0;
+    context->window_paused = NULL;
+    context->max_overhead_percent = 0;
+    context->gov_rung_count = 0;
+    context->gov_rung = 0;
+    context->gov_events = 0;
+    context->gov_interval_events = 0;
+    context->gov_interval_start = 0;
+    context->gov_cost_mark = 0;
+    context->gov_event_cost = 0;
+    context->gov_alloc_events = 0;
+    context->gov_alloc_cost = 0;
+    context->gov_alloc_event_cost = GOVERNOR_DEFAULT_EVENT_NS;
+    context->gov_phase = 0;
+    context->gov_level_changes = 0;
+    init_perf_counters(&context->counters);
+    memset(context->ctr_now, 0, sizeof(context->ctr_now));
+    memset(context->ctr_pause, 0, sizeof(context->ctr_pause));
+    memset(context->ctr_epoch, 0, sizeof(context->ctr_epoch));
+    context->dump_job = NULL;
     return context;
 }
 
@@ -561,9 +1405,47 @@ _ob_free_alloc_node(uint64_t key, void* value, void* ud) {
 }
 
 static void
-profile_free(struct profile_context* context) {
-    if (context->callpath) {
-        icallpath_free(context->callpath);
+_ob_free_edge(uint64_t key, void* value, void* ud) {
+    (void)key; (void)ud;
+    pfree(value);
+}
+
+static void
+_ob_free_proto_ident(uint64_t key, void* value, void* ud) {
+    (void)key; (void)ud;
+    pfree(value);
+}
+
+static void
+_ob_free_func_stat(uint64_t key, void* value, void* ud) {
+    (void)key; (void)ud;
+    struct func_stat* fs = (struct func_stat*)value;
+    if (fs->callees) {
+        imap_dump(fs->callees, _ob_free_edge, NULL);
+        imap_free(fs->callees);
+    }
+    pfree(fs);
+}
+
+static void
+_ob_free_line_stat(uint64_t key, void* value, void* ud) {
+    (void)key; (void)ud;
+    pfree(value);
+}
+
+static void
+_ob_free_line_table(uint64_t key, void* value, void* ud) {
+    (void)key; (void)ud;
+    struct line_table* lt = (struct line_table*)value;
+    imap_dump(lt->lines, _ob_free_line_stat, NULL);
+    imap_free(lt->lines);
+    pfree(lt);
+}
+
+static void
+profile_free(struct profile_context* context) {
+    if (context->callpath) {
+        callpath_free(context->callpath);
         context->callpath = NULL;
     }
 
@@ -573,9 +1455,115 @@ profile_free(struct profile_context* context) {
     imap_free(context->symbol_map);
     imap_dump(context->alloc_map, _ob_free_alloc_node, NULL);
     imap_free(context->alloc_map);
+    if (context->leak_paths) {
+        callpath_free(context->leak_paths);
+        context->leak_paths = NULL;
+    }
+    imap_dump(context->func_map, _ob_free_func_stat, NULL);
+    imap_free(context->func_map);
+    imap_dump(context->proto_map, _ob_free_proto_ident, NULL);
+    imap_free(context->proto_map);
+    imap_free(context->stable_map);
+    free_source_filter(&context->include);
+    free_source_filter(&context->exclude);
+    imap_dump(context->line_map, _ob_free_line_table, NULL);
+    imap_free(context->line_map);
+    if (context->tag_names) {
+        for (int i = 0; i < context->max_tags + 2; i++) {
+            pfree(context->tag_names[i]);
+        }
+        pfree(context->tag_names);
+    }
+    pfree(context->zone_keys);
+    pfree(context->window_paused);
+    close_perf_counters(&context->counters);
     pfree(context);
 }
 
+static struct call_state*
+get_call_state(struct profile_context* context, lua_State* co) {
+    uint64_t key = (uint64_t)((uintptr_t)co);
+    struct call_state* cs = imap_query(context->cs_map, key);
+    if (cs == NULL) {
+        cs = (struct call_state*)pmalloc(sizeof(struct call_state) + sizeof(struct call_frame)*MAX_CALL_SIZE);
+        cs->co = co;
+        cs->top = 0;
+        cs->leave_time = 0;
+        cs->epoch = context->epoch;
+        cs->pause_seq = context->pause_seq;
+        cs->tag = 0;
+        imap_set(context->cs_map, key, cs);
+    }
+    return cs;
+}
+
+#define EXTRASPACE_SLOT(co) (*(struct call_state**)lua_getextraspace(co))
+
+// 只有 start 时 extraspace = true（宿主声明不使用该区域）才占用，且主协程的槽要为空。
+// 宿主可能往里写任意值，未声明时槽里的值不能当作 call_state 指针解引用。新协程创建时会从主协程拷贝，所以取出后要校验 co
+static inline bool
+extraspace_available(lua_State* L, bool requested) {
+    if (!requested) return false;
+    if (LUA_EXTRASPACE < sizeof(struct call_state*)) return false;
+    return EXTRASPACE_SLOT(L->l_G->mainthread) == NULL;
+}
+
+// 协程切换时取 call_state：优先读协程的 extra space，没有时查 cs_map 并写回
+static inline struct call_state*
+lookup_call_state(struct profile_context* context, lua_State* co) {
+    if (context->use_extraspace) {
+        struct call_state* cs = EXTRASPACE_SLOT(co);
+        if (cs && cs->co == co) return cs;
+        cs = get_call_state(context, co);
+        EXTRASPACE_SLOT(co) = cs;
+        return cs;
+    }
+    return get_call_state(context, co);
+}
+
+/*
+遍历所有存活的协程：主协程加上 allgc 链表中的线程（协程没有 __gc，不会在 finobj 等链表上）。
+不设上限，也不分配内存；回调中不能分配 lua 对象，否则可能触发 gc 改动链表。
+*/
+static size_t
+foreach_thread(lua_State* L, void (*fn)(lua_State* co, void* ud), void* ud) {
+    global_State* g = L->l_G;
+    fn(g->mainthread, ud);
+    size_t n = 1;
+    for (GCObject* obj = g->allgc; obj; obj = obj->next) {
+        if (obj->tt == LUA_TTHREAD) {
+            fn(gco2th(obj), ud);
+            n++;
+        }
+    }
+    return n;
+}
+
+static void
+_ob_collect_cs_ptr(uint64_t key, void* value, void* ud) {
+    (void)key;
+    imap_set((struct imap_context*)ud, (uint64_t)(uintptr_t)value, value);
+}
+
+static void
+_clear_extraspace(lua_State* co, void* ud) {
+    if (imap_query((struct imap_context*)ud, (uint64_t)(uintptr_t)EXTRASPACE_SLOT(co))) {
+        EXTRASPACE_SLOT(co) = NULL;
+    }
+}
+
+// 释放 context 前清掉写进 extra space 的 call_state 指针。新协程会从主协程拷贝指针，所以按值判断，
+// 遍历所有存活的协程（不设上限），已经回收的协程不会再被访问
+static void
+release_extraspace(lua_State* L, struct profile_context* context) {
+    if (!context->use_extraspace) return;
+    struct imap_context* owned = imap_create();
+    imap_dump(context->cs_map, _ob_collect_cs_ptr, owned);
+    foreach_thread(L, _clear_extraspace, owned);
+    imap_free(owned);
+    context->use_extraspace = false;
+}
+
 static inline struct call_frame *
 push_callframe(struct call_state* cs) {
     if(cs->top >= MAX_CALL_SIZE) {
@@ -602,15 +1590,194 @@ cur_callframe(struct call_state* cs) {
     return &cs->call_list[idx];
 }
 
+static struct line_stat*
+_get_line_stat(struct line_table* lt, int line) {
+    struct line_stat* ls = (struct line_stat*)imap_query(lt->lines, (uint64_t)line);
+    if (!ls) {
+        ls = (struct line_stat*)pmalloc(sizeof(*ls));
+        ls->count = 0;
+        ls->cpu_cost = 0;
+        imap_set(lt->lines, (uint64_t)line, ls);
+    }
+    return ls;
+}
+
+// 把当前行到 now 的耗时（扣除 co yield）记到当前行上
 static inline void
-settle_frame_on_return(struct call_frame* frame, uint64_t ret_time) {
-    if (!frame || !frame->path) return;
-    struct callpath_node* cur_path = (struct callpath_node*)icallpath_getvalue(frame->path);
-    if (!cur_path) return;
+line_frame_settle(struct call_frame* frame, uint64_t now) {
+    if (frame->line <= 0) return;
+    struct line_stat* ls = _get_line_stat(frame->lines, frame->line);
+    uint64_t cost = safe_u64_minus(now, frame->line_time);
+    ls->cpu_cost += safe_u64_minus(cost, safe_u64_minus(frame->co_cost, frame->line_co_cost));
+    frame->line = 0;
+}
+
+// line 事件：结算上一行，开始新的一行
+static inline void
+line_frame_advance(struct call_frame* frame, int line, uint64_t now) {
+    line_frame_settle(frame, now);
+    _get_line_stat(frame->lines, line)->count++;
+    frame->line = line;
+    frame->line_time = now;
+    frame->line_co_cost = frame->co_cost;
+}
+
+// 只在栈顶帧是 profile_lines 选中的函数时开启 line hook，其他代码只付出 call/ret hook 的开销
+static inline void
+update_line_hook(lua_State* L, struct call_state* cs) {
+    struct call_frame* top = cur_callframe(cs);
+    bool want = top && top->lines && top->lines->enabled;
+    int mask = lua_gethookmask(L);
+    if (want != ((mask & LUA_MASKLINE) != 0)) {
+        mask = want ? (mask | LUA_MASKLINE) : (mask & ~LUA_MASKLINE);
+        lua_sethook(L, lua_gethook(L), mask, lua_gethookcount(L));
+    }
+}
+
+// 到点时推进窗口序号，O(1)：旧窗口的槽在下次写入时按 seq 判断清零，不需要遍历节点
+static inline void
+window_tick(struct profile_context* context, uint64_t now) {
+    if (now < context->window_next_time) return;
+    uint64_t skip = (now - context->window_next_time) / context->window_ns + 1;
+    context->window_seq += skip;
+    context->window_next_time += skip * context->window_ns;
+}
+
+// 取节点在当前窗口的槽，调用方需要保证启用了时间窗口
+static inline struct window_slot*
+window_slot(struct profile_context* context, struct callpath_node* node) {
+    if (!node->win) {
+        node->win = (struct window_slot*)pcalloc(context->windows, sizeof(struct window_slot));
+    }
+    struct window_slot* slot = &node->win[context->window_seq % (uint64_t)context->windows];
+    if (slot->seq != context->window_seq) {
+        memset(slot, 0, sizeof(*slot));
+        slot->seq = context->window_seq;
+    }
+    return slot;
+}
+
+// 把 [begin, end) 的 pause 时长按窗口边界拆到各个窗口，只记最近 windows 个窗口
+static void
+window_add_paused(struct profile_context* context, uint64_t begin, uint64_t end) {
+    if (!context->windows || end <= begin) return;
+    uint64_t last = (end - 1 - context->start_time) / context->window_ns + 1;
+    if (last > (uint64_t)context->windows) {
+        uint64_t oldest = context->start_time + (last - context->windows) * context->window_ns;
+        if (begin < oldest) begin = oldest;
+    }
+    while (begin < end) {
+        uint64_t seq = (begin - context->start_time) / context->window_ns + 1;
+        uint64_t bound = context->start_time + seq * context->window_ns;
+        uint64_t piece_end = end < bound ? end : bound;
+        struct window_pause* wp = &context->window_paused[seq % (uint64_t)context->windows];
+        if (wp->seq != seq) {
+            wp->seq = seq;
+            wp->paused_ns = 0;
+        }
+        wp->paused_ns += piece_end - begin;
+        begin = piece_end;
+    }
+}
+
+static inline void
+node_add_call(struct profile_context* context, struct callpath_node* node) {
+    ++node->call_count;
+    if (context->windows) window_slot(context, node)->call_count++;
+}
+
+// 启用 counters 时读一次计数器到 ctr_now
+static inline void
+counters_sample(struct profile_context* context) {
+    if (context->counters.count > 0) read_perf_counters(&context->counters, context->ctr_now);
+}
+
+// 帧开始计数，base 为开始时的读数，和 call_time 一起设置
+static inline void
+frame_counters_begin(struct profile_context* context, struct call_frame* frame, const uint64_t* base) {
+    if (context->counters.count == 0) return;
+    memcpy(frame->ctr_call, base, sizeof(frame->ctr_call));
+    memset(frame->ctr_co, 0, sizeof(frame->ctr_co));
+}
+
+// 结算返回的帧，返回本帧扣除 co yield 后的实际耗时，由调用方累加到父帧的 child_cost。
+// ret_ctr 为返回时的计数器读数，NULL 表示没有读数（count 级别），不累计计数器
+static inline uint64_t
+settle_frame_on_return(struct profile_context* context, struct call_frame* frame, uint64_t ret_time, const uint64_t* ret_ctr) {
+    if (!frame) return 0;
     uint64_t total_cpu_cost = safe_u64_minus(ret_time, frame->call_time);
     uint64_t actual_cpu_cost = safe_u64_minus(total_cpu_cost, frame->co_cost);
-    cur_path->last_ret_time = ret_time;
-    cur_path->cpu_cost_raw += actual_cpu_cost;
+    // 被过滤函数的耗时算作调用者的 self，不计入调用者的 child_cost
+    if (frame->filtered) return 0;
+    if (frame->lines) line_frame_settle(frame, ret_time);
+    if (frame->func) {
+        struct func_stat* fs = frame->func;
+        fs->cpu_cost_self += safe_u64_minus(actual_cpu_cost, frame->child_cost);
+        // 其他协程持有计数时本帧是它所在协程里的最外层
+        if (!frame->holds_func || --fs->active == 0) {
+            fs->cpu_cost_incl += actual_cpu_cost;
+            if (frame->edge) frame->edge->cpu_cost += actual_cpu_cost;
+        }
+    }
+    if (frame->path) {
+        struct callpath_node* cur_path = (struct callpath_node*)icallpath_getvalue(frame->path);
+        if (cur_path) {
+            cur_path->last_ret_time = ret_time;
+            if (!frame->skip_cost) {
+                cur_path->cpu_cost_raw += actual_cpu_cost;
+                if (context->windows) window_slot(context, cur_path)->cpu_cost_raw += actual_cpu_cost;
+                if (ret_ctr && context->counters.count > 0) {
+                    if (!cur_path->ctr) cur_path->ctr = (uint64_t*)pcalloc(MAX_COUNTERS, sizeof(uint64_t));
+                    for (int k = 0; k < context->counters.count; k++) {
+                        cur_path->ctr[k] += safe_u64_minus(safe_u64_minus(ret_ctr[k], frame->ctr_call[k]), frame->ctr_co[k]);
+                    }
+                }
+            }
+            if (frame->holds_active) cur_path->active--;
+        }
+    }
+    return actual_cpu_cost;
+}
+
+// 暂停统计，reason 为 PAUSE_USER 或 PAUSE_GOVERNOR，两者都解除后才恢复
+static void
+profile_pause(struct profile_context* context, uint8_t reason, uint64_t now) {
+    if (!context->paused) {
+        context->pause_time = now;
+        counters_sample(context);
+        memcpy(context->ctr_pause, context->ctr_now, sizeof(context->ctr_pause));
+    }
+    context->paused |= reason;
+}
+
+static void
+profile_resume(struct profile_context* context, uint8_t reason, uint64_t now) {
+    if (!(context->paused & reason)) return;
+    context->paused &= (uint8_t)~reason;
+    if (context->paused) return;
+    uint64_t from = context->pause_time > context->epoch_start_time ? context->pause_time : context->epoch_start_time;
+    context->paused_ns += safe_u64_minus(now, from);
+    window_add_paused(context, from, now);
+    // pause 时正在运行的协程按在 pause 时刻挂起处理，pause 的时长和它再次运行前的时间都计入 co_cost
+    if (context->cur_cs) {
+        if (context->cur_cs->leave_time == 0) {
+            context->cur_cs->leave_time = context->pause_time;
+            memcpy(context->cur_cs->leave_ctr, context->ctr_pause, sizeof(context->ctr_pause));
+        }
+        context->cur_cs = NULL;
+    }
+    context->pause_seq++;
+}
+
+// 统计周期内实际统计的时长，扣除 pause 的时间
+static inline uint64_t
+epoch_active_ns(struct profile_context* context, uint64_t now) {
+    uint64_t paused = context->paused_ns;
+    if (context->paused) {
+        uint64_t from = context->pause_time > context->epoch_start_time ? context->pause_time : context->epoch_start_time;
+        paused += safe_u64_minus(now, from);
+    }
+    return safe_u64_minus(safe_u64_minus(now, context->epoch_start_time), paused);
 }
 
 static inline struct profile_context *
@@ -623,633 +1790,3976 @@ get_profile_context(lua_State* L) {
     return ctx;
 }
 
+/*
+hook 里不查注册表：每个线程缓存最近一次用到的 (global_State, context)，命中时只需比较两次。
+set/unset 时全局版本号加 1，其他线程的缓存随之失效，stop 之后不会再用到已释放的 context。
+*/
+static uint32_t profile_context_version = 1;
+
+struct hook_context_cache {
+    const global_State* g;
+    struct profile_context* ctx;
+    uint32_t version;
+};
+
+static __thread struct hook_context_cache hook_ctx_cache;
+
+static inline struct profile_context *
+get_hook_context(lua_State* L) {
+    uint32_t version = __atomic_load_n(&profile_context_version, __ATOMIC_ACQUIRE);
+    if (hook_ctx_cache.g == L->l_G && hook_ctx_cache.version == version) {
+        return hook_ctx_cache.ctx;
+    }
+    struct profile_context* ctx = get_profile_context(L);
+    hook_ctx_cache.g = L->l_G;
+    hook_ctx_cache.ctx = ctx;
+    hook_ctx_cache.version = version;
+    return ctx;
+}
+
 static void set_profile_context(lua_State* L, struct profile_context* ctx) {
     lua_pushlightuserdata(L, &profile_context_key);
     lua_pushlightuserdata(L, (void*)ctx);
     lua_rawset(L, LUA_REGISTRYINDEX);
+    __atomic_add_fetch(&profile_context_version, 1, __ATOMIC_RELEASE);
 }
 
 static void unset_profile_context(lua_State* L) {
     lua_pushlightuserdata(L, &profile_context_key);
     lua_pushnil(L);
     lua_rawset(L, LUA_REGISTRYINDEX);
+    __atomic_add_fetch(&profile_context_version, 1, __ATOMIC_RELEASE);
 }
 
-static struct icallpath_context*
-get_frame_path(struct profile_context* context, lua_State* co, lua_Debug* far, struct icallpath_context* pre_path, struct call_frame* frame) {
-    if (!context->callpath) {
-        struct callpath_node* node = callpath_node_create();
-        node->name = "root";
-        node->source = "root";
-        node->call_count = 1;
-        context->callpath = icallpath_create(0, node);
-    }
-    if (!pre_path) {
-        pre_path = context->callpath;
-    }
+static struct symbol_info*
+_new_symbol(struct profile_context* context, uint64_t key, const void* proto, int kind) {
+    struct symbol_info* si = (struct symbol_info*)pmalloc(sizeof(struct symbol_info));
+    si->key = key;
+    si->proto = proto;
+    si->kind = kind;
+    si->resolved = false;
+    si->name = NULL;
+    si->source = NULL;
+    si->line = 0;
+    si->lastline = 0;
+    si->hash_next = NULL;
+    imap_set(context->symbol_map, key, si);
+    context->unresolved_symbols++;
+    return si;
+}
 
-    struct call_frame* cur_cf = frame;
-    uint64_t k = (uint64_t)((uintptr_t)cur_cf->prototype);
-    struct icallpath_context* cur_path = icallpath_get_child(pre_path, k);
-    if (!cur_path) {
-        struct callpath_node* path_parent = (struct callpath_node*)icallpath_getvalue(pre_path);
-        struct callpath_node* node = callpath_node_create();
+// 节点创建时取符号，lua 函数在分配 key 时已登记，这里只会为 c 函数新建符号
+static struct symbol_info*
+get_symbol(struct profile_context* context, uint64_t key) {
+    struct symbol_info* si = (struct symbol_info*)imap_query(context->symbol_map, key);
+    if (si) return si;
+    return _new_symbol(context, key, (const void*)(uintptr_t)key, SYMBOL_KIND_C);
+}
 
-        node->parent = path_parent;
-        node->depth = path_parent->depth + 1;
-        node->last_ret_time = 0;
-        node->cpu_cost_raw = 0;
-        node->call_count = 0;
-        cur_path = icallpath_add_child(pre_path, k, node);
-    }
+static inline const char*
+_proto_source(const Proto* p) {
+    return p->source ? getstr(p->source) : "=?";
+}
 
-    struct callpath_node* cur_node = (struct callpath_node*)icallpath_getvalue(cur_path);
-    if (cur_node->name == NULL) {
-        uint64_t sym_key = (uint64_t)((uintptr_t)cur_cf->prototype);
-        struct symbol_info* si = get_symbol_info(co, far, sym_key, context->symbol_map);
-        cur_node->name = si->name;
-        cur_node->source = si->source;
-        cur_node->line = si->line;
-    }
-    
-    return cur_path;
+static inline bool
+_symbol_match_proto(const struct symbol_info* si, const Proto* p) {
+    return si->line == p->linedefined && si->lastline == p->lastlinedefined
+        && strcmp(si->source, _proto_source(p)) == 0;
 }
 
-// 按路径更新节点（仅更新当前节点的 self 计数，父链累计推迟到 dump 聚合）
-static inline void _mem_update_on_path(struct callpath_node* node,
-    size_t alloc_bytes, uint64_t alloc_times, size_t free_bytes, uint64_t free_times, uint64_t realloc_times) {
-    if (!node) return;
-    if (alloc_bytes) node->alloc_bytes += alloc_bytes;
-    if (alloc_times) node->alloc_times += alloc_times;
-    if (free_bytes) node->free_bytes += free_bytes;
-    if (free_times) node->free_times += free_times;
-    if (realloc_times) node->realloc_times += realloc_times;
+static inline bool
+_proto_ident_match(const struct proto_ident* pi, const Proto* p) {
+    return pi->source == p->source && pi->linedefined == p->linedefined
+        && pi->lastlinedefined == p->lastlinedefined && pi->sizecode == p->sizecode;
 }
 
-// 取当前栈的叶子节点
-static inline struct callpath_node* _current_leaf_node(struct profile_context* context) {
-    struct call_state* cs = context->cur_cs;
-    if (!cs) return NULL;
-    struct call_frame* leaf = cur_callframe(cs);
-    if (!leaf || !leaf->path) return NULL;
-    return (struct callpath_node*)icallpath_getvalue(leaf->path);
+static uint64_t
+_hash_stable_ident(const char* source, int line, int lastline) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char* c = (const unsigned char*)source; *c; c++) {
+        h ^= *c;
+        h *= 1099511628211ULL;
+    }
+    h ^= (uint64_t)(uint32_t)line;
+    h *= 1099511628211ULL;
+    h ^= (uint64_t)(uint32_t)lastline;
+    h *= 1099511628211ULL;
+    return h;
 }
 
 /*
-获取各种类型函数的 prototype，包括 LUA_VLCL、LUA_VCCL、LUA_VLCF。   
-如果没有正确获取 prototype，那么像 tonumber 和 print 这类 LUA_VLCF 使用栈上的函数指针来充当 prototype,
-会导致同一层的这类函数被合并为同一个节点，比如下面的代码，最终 print 会错误的合并到 tonumber 的节点中，显示为
-2 次 tonumber 调用。 
-
-local function test1()
-    tonumber("123")    
-    print("111")
-end
+首次见到一个 lua 函数时登记符号：直接从 Proto 拷贝 source/linedefined/lastlinedefined，不调用 lua_getinfo 也不回溯栈，
+Proto 之后被回收也不影响符号。merge_reloads 时以 (source, linedefined, lastlinedefined) 作为稳定标识，
+热更新重新加载的同一个函数会复用之前的 key，从而合并到同一批节点上。
 */
-static const void* _get_prototype(lua_State* L, lua_Debug* ar) {
-    const void* proto = NULL;
-
-    if (ar->i_ci && ar->i_ci->func.p) {
-        const TValue* tv = s2v(ar->i_ci->func.p);
-        if (ttislcf(tv)) {
-            proto = (const void*)fvalue(tv);   // LUA_VLCF：轻量 C 函数，直接取 c 函数指针
-        } else if (ttisclosure(tv)) {
-            const Closure* cl = clvalue(tv);
-            if (cl->c.tt == LUA_VLCL) {
-                proto = (const void*)cl->l.p;  // LUA_VLCL：Lua 闭包
-            } else if (cl->c.tt == LUA_VCCL) {
-                proto = (const void*)cl->c.f;  // LUA_VCCL：C 闭包
+static struct symbol_info*
+_new_lua_symbol(struct profile_context* context, const Proto* p) {
+    const char* source = _proto_source(p);
+    uint64_t hash = 0;
+    struct symbol_info* head = NULL;
+    if (context->merge_reloads) {
+        hash = _hash_stable_ident(source, p->linedefined, p->lastlinedefined);
+        head = (struct symbol_info*)imap_query(context->stable_map, hash);
+        for (struct symbol_info* si = head; si; si = si->hash_next) {
+            if (_symbol_match_proto(si, p)) {
+                si->proto = p;
+                return si;
             }
         }
     }
 
-    if (!proto) {
-        printf("ERROR: get prototype fail.\n");
+    uint64_t key = LUA_FUNC_KEY_BIT | (++context->func_seq);
+    struct symbol_info* si = _new_symbol(context, key, p, SYMBOL_KIND_LUA);
+    si->source = pstrdup(source);
+    si->line = p->linedefined;
+    si->lastline = p->lastlinedefined;
+    if (context->merge_reloads) {
+        si->hash_next = head;
+        imap_set(context->stable_map, hash, si);
     }
-
-    return proto;
+    return si;
 }
 
-// hook alloc/free/realloc 事件
-static void*
-_hook_alloc(void *ud, void *ptr, size_t _osize, size_t _nsize) {   
-    struct profile_context* context = (struct profile_context*)ud;
-    void* alloc_ret = context->last_alloc_f(context->last_alloc_ud, ptr, _osize, _nsize);
-    if (context->running_in_hook || !context->is_ready) {
-        return alloc_ret;
+// 把栈顶的闭包弱引用到注册表并弹出，dump 时据此判断 Proto 是否仍然存活，存活才去读它的字节码推断函数名
+static void
+_anchor_closure(lua_State* co, const void* proto) {
+    lua_pushlightuserdata(co, &profile_anchor_key);
+    lua_rawget(co, LUA_REGISTRYINDEX);
+    if (lua_istable(co, -1)) {
+        lua_rotate(co, -2, 1);
+        lua_rawsetp(co, -2, proto);
+        lua_pop(co, 1);
+    } else {
+        lua_pop(co, 2);
     }
+}
 
-    size_t oldsize = (ptr == NULL) ? 0 : _osize;
-    size_t newsize = _nsize;
-
-    if (oldsize == 0 && newsize > 0) {
-        // 1、alloc
-
-        struct callpath_node* leaf = _current_leaf_node(context);
-        // 更新节点
-        if (leaf) {
-            _mem_update_on_path(leaf, newsize, 1, 0, 0, 0);
+// 在 parent 的活跃局部变量中找到第 reg+1 个，对应寄存器 reg（同 luaF_getlocalname）
+static const char*
+_proto_local_name(const Proto* p, int reg, int pc) {
+    int n = reg + 1;
+    for (int i = 0; i < p->sizelocvars && p->locvars[i].startpc <= pc; i++) {
+        if (pc < p->locvars[i].endpc) {
+            n--;
+            if (n == 0) return getstr(p->locvars[i].varname);
         }
-        // 创建映射
-        struct alloc_node* an = (struct alloc_node*)imap_query(context->alloc_map, (uint64_t)(uintptr_t)alloc_ret);
-        if (an == NULL) an = alloc_node_create();
-        an->live_bytes = newsize;
-        an->path = leaf;
-        imap_set(context->alloc_map, (uint64_t)(uintptr_t)alloc_ret, an);
+    }
+    return NULL;
+}
 
-    } else if (oldsize > 0 && newsize == 0) {
-        // 2、free
-        
-        struct alloc_node* an = (struct alloc_node*)imap_remove(context->alloc_map, (uint64_t)(uintptr_t)ptr);
-        if (an) {
-            // 更新节点
-            if (an->path && an->live_bytes > 0) {
-                _mem_update_on_path(an->path, 0, 0, an->live_bytes, 1, 0);
+// 根据父函数中创建闭包的 OP_CLOSURE 指令推断子函数名字，
+// 支持 local function f、local f = function、function M.f、function f 这几种写法
+static const char*
+_proto_closure_name(const Proto* parent, int idx) {
+    for (int pc = 0; pc < parent->sizecode; pc++) {
+        Instruction i = parent->code[pc];
+        if (GET_OPCODE(i) != OP_CLOSURE || GETARG_Bx(i) != idx) continue;
+        int reg = GETARG_A(i);
+        const char* name = _proto_local_name(parent, reg, pc + 1);
+        if (name) return name;
+        if (pc + 1 < parent->sizecode) {
+            Instruction ni = parent->code[pc + 1];
+            OpCode op = GET_OPCODE(ni);
+            if ((op == OP_SETFIELD || op == OP_SETTABUP) && !GETARG_k(ni) && GETARG_C(ni) == reg) {
+                const TValue* kv = &parent->k[GETARG_B(ni)];
+                if (ttisstring(kv)) return getstr(tsvalue(kv));
             }
-            pfree(an);
-            an = NULL;
         }
+        return NULL;
+    }
+    return NULL;
+}
 
-    } else if (oldsize > 0 && newsize > 0) {
-        // 3、realloc
-        
-        // 参照 gperftools 的逻辑，realloc 拆分为 free 和 alloc 两个事件，但此处为了反映 gc 的压力，不增加 alloc_times 和 free_times。
-        // (旧 node 和新 node 可能是同一个 node)
-        // 1、旧 node，free_bytes 加上 oldsize；
-        // 2、新 node，alloc_bytes 加上 newsize，realloc_times 加 1；
+// parent 必须是存活的 Proto，它引用的子 Proto 也一定存活
+static void
+_name_children_of_proto(struct profile_context* context, const Proto* parent) {
+    for (int i = 0; i < parent->sizep; i++) {
+        const Proto* child = parent->p[i];
+        struct proto_ident* pi = (struct proto_ident*)imap_query(context->proto_map, (uint64_t)((uintptr_t)child));
+        if (!pi || !_proto_ident_match(pi, child)) continue;
+        struct symbol_info* si = (struct symbol_info*)imap_query(context->symbol_map, pi->key);
+        if (!si || si->resolved || si->name) continue;
+        const char* name = _proto_closure_name(parent, i);
+        if (name) si->name = pstrdup(name);
+    }
+}
 
-        // realloc 失败（返回 NULL）时，旧指针仍然有效，不能更新统计或映射
-        if (alloc_ret == NULL) {
-            return alloc_ret;
+// 锚定表里还能找到闭包，且闭包的 Proto 和符号记录的一致，才认为 Proto 存活
+static const Proto*
+_alive_proto(lua_State* L, int anchor_idx, const struct symbol_info* si) {
+    const Proto* p = NULL;
+    lua_rawgetp(L, anchor_idx, si->proto);
+    if (lua_isfunction(L, -1) && !lua_iscfunction(L, -1)) {
+        const LClosure* cl = (const LClosure*)lua_topointer(L, -1);
+        if ((const void*)cl->p == si->proto && _symbol_match_proto(si, cl->p)) {
+            p = cl->p;
         }
+    }
+    lua_pop(L, 1);
+    return p;
+}
 
-        // 旧路径
-        struct alloc_node* old_an = (struct alloc_node*)imap_query(context->alloc_map, (uint64_t)(uintptr_t)ptr);
-        if (old_an && old_an->path) {
-            _mem_update_on_path(old_an->path, 0, 0, oldsize, 0, 0);
-        }
+struct name_symbol_arg {
+    struct profile_context* context;
+    lua_State* L;
+    int anchor_idx;
+};
 
-        // 新路径
-        struct callpath_node* leaf = _current_leaf_node(context);
-        // 更新节点
-        if (leaf) {
-            _mem_update_on_path(leaf, newsize, 0, 0, 0, 1);
-        }
-        // 更新映射
-        if (alloc_ret != ptr) {
-            // 搬移
-            struct alloc_node* an = (struct alloc_node*)imap_remove(context->alloc_map, (uint64_t)(uintptr_t)ptr);
-            if (!an) an = alloc_node_create();
-            an->live_bytes = newsize;
-            an->path = leaf;
-            imap_set(context->alloc_map, (uint64_t)(uintptr_t)alloc_ret, an);
-        } else {
-            // 原地
-            struct alloc_node* an = (struct alloc_node*)imap_query(context->alloc_map, (uint64_t)(uintptr_t)ptr);
-            bool exists = (an != NULL);
-            if (!exists) an = alloc_node_create();
-            an->live_bytes = newsize;
-            an->path = leaf;
-            if (!exists) imap_set(context->alloc_map, (uint64_t)(uintptr_t)ptr, an);
+static void
+_ob_name_children(uint64_t key, void* value, void* ud) {
+    (void)key;
+    struct name_symbol_arg* arg = (struct name_symbol_arg*)ud;
+    struct symbol_info* si = (struct symbol_info*)value;
+    if (si->kind != SYMBOL_KIND_LUA) return;
+    const Proto* p = _alive_proto(arg->L, arg->anchor_idx, si);
+    if (p) {
+        _name_children_of_proto(arg->context, p);
+    }
+}
+
+struct resolve_symbol_arg {
+    lua_State* L;
+    struct imap_context* cfunc_names;   // 第一次遇到 dladdr 拿不到名字的 c 函数时才扫描 package.loaded
+};
+
+static struct imap_context* _collect_cfunc_names(lua_State* L);
+
+static void
+_ob_resolve_symbol(uint64_t key, void* value, void* ud) {
+    (void)key;
+    struct resolve_symbol_arg* arg = (struct resolve_symbol_arg*)ud;
+    struct symbol_info* si = (struct symbol_info*)value;
+    if (si->resolved) return;
+
+    if (si->kind == SYMBOL_KIND_C) {
+        Dl_info info;
+        if (!si->name && dladdr(si->proto, &info) && info.dli_saddr == si->proto && info.dli_sname) {
+            si->name = pstrdup(info.dli_sname);
+        }
+        if (!si->name && !arg->cfunc_names) {
+            arg->cfunc_names = _collect_cfunc_names(arg->L);
         }
+        if (!si->name) {
+            const char* name = (const char*)imap_query(arg->cfunc_names, (uint64_t)((uintptr_t)si->proto));
+            if (name) si->name = pstrdup(name);
+        }
+        si->source = pstrdup("[C]");
+        si->line = 0;
     }
+    if (!si->name) si->name = pstrdup("null");
+    si->resolved = true;
+}
 
-    return alloc_ret;
+static void
+_ob_free_cfunc_name(uint64_t key, void* value, void* ud) {
+    (void)key; (void)ud;
+    pfree(value);
+}
+
+// 扫描 package.loaded，收集 c 函数指针到 "module.field" 的映射，用于 dladdr 拿不到符号的静态函数
+static struct imap_context*
+_collect_cfunc_names(lua_State* L) {
+    struct imap_context* names = imap_create();
+    lua_checkstack(L, 6);
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return names;
+    }
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        if (lua_type(L, -2) == LUA_TSTRING && lua_istable(L, -1)) {
+            const char* modname = lua_tostring(L, -2);
+            lua_pushnil(L);
+            while (lua_next(L, -2)) {
+                if (lua_type(L, -2) == LUA_TSTRING && lua_iscfunction(L, -1)) {
+                    uint64_t key = (uint64_t)((uintptr_t)lua_tocfunction(L, -1));
+                    if (key && !imap_query(names, key)) {
+                        const char* field = lua_tostring(L, -2);
+                        char buf[256] = {0};
+                        if (strcmp(modname, "_G") == 0) {
+                            snprintf(buf, sizeof(buf)-1, "%s", field);
+                        } else {
+                            snprintf(buf, sizeof(buf)-1, "%s.%s", modname, field);
+                        }
+                        imap_set(names, key, pstrdup(buf));
+                    }
+                }
+                lua_pop(L, 1);
+            }
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    return names;
 }
 
-// hook call/ret 事件
+// dump 时批量解析所有尚未解析的符号
 static void
-_hook_call(lua_State* L, lua_Debug* far) {
-    uint64_t begin_time = get_mono_ns();
+resolve_symbols(struct profile_context* context, lua_State* L) {
+    // lua 函数名：从父函数的字节码推断，父函数可能是已登记且仍存活的函数，也可能是当前栈上的函数（比如主 chunk）
+    lua_checkstack(L, 4);
+    lua_pushlightuserdata(L, &profile_anchor_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_istable(L, -1)) {
+        struct name_symbol_arg name_arg;
+        name_arg.context = context;
+        name_arg.L = L;
+        name_arg.anchor_idx = lua_gettop(L);
+        imap_dump(context->symbol_map, _ob_name_children, &name_arg);
+    }
+    lua_pop(L, 1);
 
-    struct profile_context* context = get_profile_context(L);
-    if (context == NULL) {
-        printf("resolve hook fail, profile not started\n");
-        return;
+    lua_Debug ar;
+    for (int level = 0; lua_getstack(L, level, &ar); level++) {
+        lua_getinfo(L, "f", &ar);
+        if (lua_isfunction(L, -1) && !lua_iscfunction(L, -1)) {
+            const LClosure* cl = (const LClosure*)lua_topointer(L, -1);
+            _name_children_of_proto(context, cl->p);
+        }
+        lua_pop(L, 1);
+    }
+
+    struct resolve_symbol_arg arg;
+    arg.L = L;
+    arg.cfunc_names = NULL;
+    imap_dump(context->symbol_map, _ob_resolve_symbol, &arg);
+    if (arg.cfunc_names) {
+        imap_dump(arg.cfunc_names, _ob_free_cfunc_name, NULL);
+        imap_free(arg.cfunc_names);
     }
-    if(!context->is_ready) {
+    context->unresolved_symbols = 0;
+}
+
+static struct func_stat*
+get_func_stat(struct profile_context* context, uint64_t key) {
+    struct func_stat* fs = (struct func_stat*)imap_query(context->func_map, key);
+    if (fs) return fs;
+
+    fs = (struct func_stat*)pmalloc(sizeof(*fs));
+    fs->key = key;
+    fs->sym = get_symbol(context, key);
+    fs->call_count = 0;
+    fs->cpu_cost_self = 0;
+    fs->cpu_cost_incl = 0;
+    fs->active = 0;
+    fs->active_cs = NULL;
+    fs->id = 0;
+    fs->callees = NULL;
+    imap_set(context->func_map, key, fs);
+    return fs;
+}
+
+static struct graph_edge*
+graph_get_edge(struct func_stat* caller, struct func_stat* callee) {
+    if (!caller->callees) {
+        caller->callees = imap_create_sized(GRAPH_EDGE_SLOT_SIZE);
+    }
+    struct graph_edge* edge = (struct graph_edge*)imap_query(caller->callees, callee->key);
+    if (edge) return edge;
+
+    edge = (struct graph_edge*)pmalloc(sizeof(*edge));
+    edge->caller = caller;
+    edge->callee = callee;
+    edge->call_count = 0;
+    edge->cpu_cost = 0;
+    imap_set(caller->callees, callee->key, edge);
+    return edge;
+}
+
+// 和 fold_enter_frame 一样按协程计递归层数：协程出错或被丢弃后留下的层数不会影响其他协程
+static inline void
+func_enter_frame(struct call_state* cs, struct call_frame* frame) {
+    struct func_stat* fs = frame->func;
+    frame->holds_func = false;
+    if (fs->active == 0) {
+        fs->active_cs = cs;
+    } else if (fs->active_cs != cs) {
         return;
     }
+    fs->active++;
+    frame->holds_func = true;
+}
 
-    context->running_in_hook = true;
+// graph 模式下进入新帧：函数和边各计一次调用
+static void
+graph_enter_frame(struct profile_context* context, struct call_state* cs, struct call_frame* pre_frame, struct call_frame* frame) {
+    struct func_stat* fs = get_func_stat(context, frame->key);
+    frame->func = fs;
+    frame->edge = NULL;
+    frame->path = NULL;
+    ++fs->call_count;
+    func_enter_frame(cs, frame);
+    if (pre_frame && pre_frame->func) {
+        frame->edge = graph_get_edge(pre_frame->func, fs);
+        ++frame->edge->call_count;
+    }
+}
 
-    int event = far->event;
+// 递归折叠时，同一节点可能在本协程的栈上出现多次，只有最外层的帧累计耗时，避免 incl 耗时重复计算
+static inline void
+fold_enter_frame(struct call_state* cs, struct call_frame* frame) {
+    struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(frame->path);
+    if (node->active > 0 && node->active_cs == cs) {
+        node->active++;
+        frame->skip_cost = true;
+        frame->holds_active = true;
+    } else if (node->active == 0) {
+        node->active = 1;
+        node->active_cs = cs;
+        frame->holds_active = true;
+    }
+}
 
-    struct call_state* cs = context->cur_cs;
-    if (!context->cur_cs || context->cur_cs->co != L) {
-        uint64_t key = (uint64_t)((uintptr_t)L);
-        cs = imap_query(context->cs_map, key);
-        if (cs == NULL) {
-            cs = (struct call_state*)pmalloc(sizeof(struct call_state) + sizeof(struct call_frame)*MAX_CALL_SIZE);
-            cs->co = L; 
-            cs->top = 0;
-            cs->leave_time = 0;
-            imap_set(context->cs_map, key, cs);
-        }
+static struct icallpath_context*
+get_root_path(struct profile_context* context) {
+    if (!context->callpath) {
+        struct callpath_node* node = callpath_node_create();
+        node->sym = &root_symbol;
+        node->call_count = 1;
+        context->callpath = icallpath_create(0, node);
+    }
+    return context->callpath;
+}
 
-        if (context->cur_cs) {
-            context->cur_cs->leave_time = begin_time;
+static struct icallpath_context*
+get_frame_path(struct profile_context* context, struct icallpath_context* pre_path, struct call_frame* frame) {
+    get_root_path(context);
+    if (!pre_path) {
+        pre_path = context->callpath;
+    }
+
+    struct call_frame* cur_cf = frame;
+    // 不同 tag 的同一函数是不同的子节点，tag 同时混进低位，避免它们在 children 中落到同一个槽
+    uint64_t k = cur_cf->key;
+    if (cur_cf->tag) k ^= ((uint64_t)cur_cf->tag << TAG_KEY_SHIFT) | (uint64_t)cur_cf->tag;
+    struct icallpath_context* cur_path = icallpath_get_child(pre_path, k);
+    if (!cur_path && context->fold_recursion) {
+        // 递归折叠：函数已出现在当前路径上，回到该祖先节点而不是新建子节点
+        struct icallpath_context* p = pre_path;
+        while (p && !is_root_path(context, p)) {
+            if (p->key == k) {
+                cur_path = p;
+                break;
+            }
+            p = p->parent;
         }
-        context->cur_cs = cs;
     }
-    if (cs->leave_time > 0) {
-        assert(begin_time >= cs->leave_time);
-        uint64_t co_cost = begin_time - cs->leave_time;
+    if (!cur_path) {
+        struct callpath_node* path_parent = (struct callpath_node*)icallpath_getvalue(pre_path);
+        struct callpath_node* node = callpath_node_create();
 
-        for (int i = 0; i < cs->top; i++) {
-            cs->call_list[i].co_cost += co_cost;
+        node->parent = path_parent;
+        node->depth = path_parent->depth + 1;
+        node->last_ret_time = 0;
+        node->cpu_cost_raw = 0;
+        node->call_count = 0;
+        node->sym = get_symbol(context, cur_cf->key);
+        node->tag = cur_cf->tag;
+        cur_path = icallpath_add_child(pre_path, k, node);
+    }
+
+    return cur_path;
+}
+
+// swap_dump 换树之后，协程栈上的帧还指向旧树，再次遇到该协程时把它们重新挂到新树上。
+// 帧的起始时间截断到换树时刻，之前的耗时已经在换树时结算到旧树（见 _ob_settle_live_frames）。
+static void
+sync_call_state(struct profile_context* context, struct call_state* cs) {
+    uint64_t epoch_start = context->epoch_start_time;
+    struct icallpath_context* pre_path = NULL;
+    for (int i = 0; i < cs->top; i++) {
+        struct call_frame* frame = &cs->call_list[i];
+        if (frame->call_time < epoch_start) {
+            frame->call_time = epoch_start;
+            frame->co_cost = 0;
+            frame->child_cost = 0;
+            frame->line_co_cost = 0;
+            frame_counters_begin(context, frame, context->ctr_epoch);
+        }
+        if (frame->filtered) {
+            frame->path = pre_path;
+        } else if (frame->path) {
+            frame->path = get_frame_path(context, pre_path, frame);
+            frame->skip_cost = false;
+            frame->holds_active = false;
+            if (context->fold_recursion) fold_enter_frame(cs, frame);
+            pre_path = frame->path;
         }
-        cs->leave_time = 0;
     }
-    assert(cs->co == L);
+    if (cs->leave_time > 0 && cs->leave_time < epoch_start) {
+        cs->leave_time = epoch_start;
+        memcpy(cs->leave_ctr, context->ctr_epoch, sizeof(cs->leave_ctr));
+    }
+    cs->epoch = context->epoch;
+}
 
-    if (event == LUA_HOOKCALL || event == LUA_HOOKTAILCALL) {
-        struct call_frame* frame = NULL;
-        struct icallpath_context* pre_callpath = NULL;
+// 按路径更新节点（仅更新当前节点的 self 计数，父链累计推迟到 dump 聚合）
+static inline void _mem_update_on_path(struct profile_context* context, struct callpath_node* node,
+    size_t alloc_bytes, uint64_t alloc_times, size_t free_bytes, uint64_t free_times, uint64_t realloc_times) {
+    if (!node) return;
+    if (alloc_bytes) node->alloc_bytes += alloc_bytes;
+    if (alloc_times) node->alloc_times += alloc_times;
+    if (free_bytes) node->free_bytes += free_bytes;
+    if (free_times) node->free_times += free_times;
+    if (realloc_times) node->realloc_times += realloc_times;
+    if (alloc_times || realloc_times) {
+        if (!node->hist) node->hist = (struct size_hist*)pcalloc(1, sizeof(struct size_hist));
+        int c = size_class(alloc_bytes);
+        if (alloc_times) node->hist->alloc[c] += alloc_times;
+        else node->hist->realloc[c] += realloc_times;
+    }
+    if (context->windows) {
+        struct window_slot* slot = window_slot(context, node);
+        slot->alloc_bytes += alloc_bytes;
+        slot->alloc_times += alloc_times;
+        slot->free_bytes += free_bytes;
+        slot->free_times += free_times;
+        slot->realloc_times += realloc_times;
+    }
+}
 
-        if (event == LUA_HOOKTAILCALL && cs->top > 0) {
-            // 尾调用语义：当前帧不会收到独立 RET。
-            // 非自尾递归：把当前帧标记为 pending，压入子调用帧；最终 RET 时级联结算。
-            // 自尾递归：仅增加调用次数，不新增帧，避免深递归撑爆 call_frame 栈。
-            struct call_frame* old_frame = cur_callframe(cs);
-            const void* new_proto = _get_prototype(L, far);
-            if (new_proto == old_frame->prototype) {
-                // 自尾递归聚合到同一节点：不改 frame 的 call_time/path，仅增加 call_count
-                context->cpu_call_count_total++;
-                if (old_frame->path) {
-                    struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(old_frame->path);
-                    if (node) ++node->call_count;
+// 取当前栈的叶子节点
+static inline struct callpath_node* _current_leaf_node(struct profile_context* context) {
+    struct call_state* cs = context->cur_cs;
+    if (!cs) return NULL;
+    if (cs->epoch != context->epoch) sync_call_state(context, cs);
+    struct call_frame* leaf = cur_callframe(cs);
+    if (!leaf || !leaf->path) return NULL;
+    return (struct callpath_node*)icallpath_getvalue(leaf->path);
+}
+
+// include 非空时只保留匹配 include 的，再去掉匹配 exclude 的
+static bool
+_is_source_filtered(struct profile_context* context, const char* source) {
+    if (context->include.count > 0 && !source_filter_match(&context->include, source)) return true;
+    return source_filter_match(&context->exclude, source);
+}
+
+// 取 lua 函数的 key，首次见到（或地址被复用）时分配新 key，is_new 为 true 时调用方需要锚定闭包
+static uint64_t
+get_proto_key(struct profile_context* context, const Proto* p, bool* filtered, bool* is_new) {
+    uint64_t pk = (uint64_t)((uintptr_t)p);
+    struct proto_ident* pi = (struct proto_ident*)imap_query(context->proto_map, pk);
+    if (pi && _proto_ident_match(pi, p)) {
+        *filtered = pi->filtered;
+        *is_new = false;
+        return pi->key;
+    }
+    if (!pi) {
+        pi = (struct proto_ident*)pmalloc(sizeof(*pi));
+        imap_set(context->proto_map, pk, pi);
+    }
+    struct symbol_info* si = _new_lua_symbol(context, p);
+    pi->source = p->source;
+    pi->linedefined = p->linedefined;
+    pi->lastlinedefined = p->lastlinedefined;
+    pi->sizecode = p->sizecode;
+    pi->key = si->key;
+    pi->filtered = _is_source_filtered(context, si->source);
+    *filtered = pi->filtered;
+    *is_new = true;
+    return pi->key;
+}
+
+/*
+获取各种类型函数的 key，包括 LUA_VLCL、LUA_VCCL、LUA_VLCF。   
+如果没有正确获取 prototype，那么像 tonumber 和 print 这类 LUA_VLCF 使用栈上的函数指针来充当 prototype,
+会导致同一层的这类函数被合并为同一个节点，比如下面的代码，最终 print 会错误的合并到 tonumber 的节点中，显示为
+2 次 tonumber 调用。 
+
+local function test1()
+    tonumber("123")    
+    print("111")
+end
+
+c 函数直接用函数指针作为 key。lua 函数不直接用 Proto 地址：Proto 被回收后地址可能被新函数复用，
+新函数会继承旧节点和旧名字。这里通过 proto_map 把 Proto 地址映射到分配的 key，命中时校验
+source/linedefined/lastlinedefined/sizecode，不一致说明地址被复用了，重新分配 key。
+filtered 返回该函数是否被过滤，lua 函数的结果和 key 一起缓存在 proto_ident 中。
+*/
+static uint64_t
+get_function_key(struct profile_context* context, lua_State* L, lua_Debug* ar, bool* filtered) {
+    uint64_t key = 0;
+    *filtered = false;
+
+    if (ar->i_ci && ar->i_ci->func.p) {
+        const TValue* tv = s2v(ar->i_ci->func.p);
+        if (ttislcf(tv)) {
+            key = (uint64_t)((uintptr_t)fvalue(tv));   // LUA_VLCF：轻量 C 函数，直接取 c 函数指针
+            *filtered = context->skip_c_functions;
+        } else if (ttisclosure(tv)) {
+            const Closure* cl = clvalue(tv);
+            if (cl->c.tt == LUA_VLCL) {
+                // LUA_VLCL：Lua 闭包
+                bool is_new = false;
+                key = get_proto_key(context, cl->l.p, filtered, &is_new);
+                if (is_new) {
+                    lua_getinfo(L, "f", ar);
+                    _anchor_closure(L, cl->l.p);
                 }
-                context->profiler_cpu_cost_total += safe_u64_minus(get_mono_ns(), begin_time);
-                context->running_in_hook = false;
-                return;
+            } else if (cl->c.tt == LUA_VCCL) {
+                key = (uint64_t)((uintptr_t)cl->c.f);  // LUA_VCCL：C 闭包
+                *filtered = context->skip_c_functions;
             }
+        }
+    }
 
-            old_frame->tail_pending = true;
-            pre_callpath = old_frame->path;
-            frame = push_callframe(cs);
-            frame->prototype = new_proto;
+    if (!key) {
+        printf("ERROR: get prototype fail.\n");
+    }
+
+    return key;
+}
+
+// 结算 keep 之上不会再收到 RET 的帧：错误跳过的帧、出错结束的协程上的帧、pause 期间已经返回的帧
+static void
+unwind_call_state(struct profile_context* context, struct call_state* cs, int keep, uint64_t end_time, const uint64_t* end_ctr) {
+    while (cs->top > keep) {
+        struct call_frame* frame = pop_callframe(cs);
+        uint64_t cost = settle_frame_on_return(context, frame, end_time, end_ctr);
+        if (cs->top > 0) cur_callframe(cs)->child_cost += cost;
+    }
+}
+
+struct live_level {
+    const CallInfo* ci;
+    uint64_t key;
+    bool filtered;
+};
+
+/*
+pause 期间 hook 看不到 call/ret，resume 后第一次遇到协程时把栈上的帧和真实的 CallInfo 链对齐：
+从外向内保留 CallInfo 还在链上、函数也没变的帧（CallInfo 会被复用，所以两者都要比较）；
+其余的帧在 pause 期间已经返回，按 pause 开始（协程在那之前已挂起时按挂起）的时刻结算；
+pause 期间进入、现在还在执行的函数补压帧，从 now 开始计时，不计调用次数（instrument 为 false 时只保留 zone 帧，不补压）。
+skip_top 为 true 时不含 level 0，即 call 事件的被调函数，由事件本身压帧。
+*/
+static void
+resync_call_state(struct profile_context* context, struct call_state* cs, lua_State* L, bool skip_top, uint64_t now, bool timed) {
+    cs->pause_seq = context->pause_seq;
+    if (cs->top <= 0) return;   // 没有跨越 pause 的帧，和中途 mark 一样从空栈开始
+
+    CallInfo* top_ci = L->ci;
+    if (skip_top && top_ci != &L->base_ci) top_ci = top_ci->previous;
+    int n = 0;
+    for (CallInfo* ci = top_ci; ci && ci != &L->base_ci; ci = ci->previous) n++;
+
+    // 外层在前
+    struct live_level* live = (struct live_level*)pmalloc(sizeof(struct live_level) * (n > 0 ? n : 1));
+    lua_Debug ar;
+    CallInfo* ci = top_ci;
+    for (int i = n - 1; i >= 0; i--, ci = ci->previous) {
+        ar.i_ci = ci;
+        live[i].ci = ci;
+        live[i].filtered = false;
+        // 不装 hook 时只对齐 zone 帧，不需要函数 key，也不登记符号
+        live[i].key = context->instrument ? get_function_key(context, L, &ar, &live[i].filtered) : 0;
+    }
+
+    int keep = 0;
+    int next = 0;
+    for (int f = 0; f < cs->top; f++) {
+        struct call_frame* frame = &cs->call_list[f];
+        if (frame->zone) {
+            // zone 帧和打开它的函数在同一层，只比较 CallInfo
+            int m = (next > 0 && live[next - 1].ci == frame->ci) ? next - 1 : next;
+            while (m < n && live[m].ci != frame->ci) m++;
+            if (m >= n) break;
+            keep = f + 1;
+            next = m + 1;
+            continue;
+        }
+        // 尾调用链上的帧共用一个 CallInfo，只有最后一个对应 CallInfo 上现在的函数
+        bool shares_ci = f + 1 < cs->top && cs->call_list[f + 1].ci == frame->ci && !cs->call_list[f + 1].zone;
+        int m = next;
+        if (frame->recursion > 0) {
+            // 折叠的直接递归：按现在链上连续的同一函数重算层数
+            while (m < n && live[m].key != frame->key) m++;
+            if (m >= n) break;
+            int last = m;
+            while (last + 1 < n && live[last + 1].key == frame->key) last++;
+            frame->recursion = (uint32_t)(last - m);
+            frame->ci = live[last].ci;
+            m = last;
         } else {
-            struct call_frame* pre_frame = cur_callframe(cs);
-            if (pre_frame) {
-                pre_callpath = pre_frame->path;
-            }
-            frame = push_callframe(cs);
-            frame->prototype = _get_prototype(L, far);
+            while (m < n && live[m].ci != frame->ci) m++;
+            if (m >= n) break;
+            if (!shares_ci && live[m].key != frame->key) break;
         }
+        keep = f + 1;
+        next = shares_ci ? m : m + 1;
+    }
 
-        frame->call_time = begin_time;
+    uint64_t end_time = 0;
+    const uint64_t* end_ctr = NULL;
+    if (timed) {
+        end_time = context->pause_time;
+        end_ctr = context->ctr_pause;
+        if (cs->leave_time > 0 && cs->leave_time < end_time) {
+            end_time = cs->leave_time;
+            end_ctr = cs->leave_ctr;
+        }
+    }
+    unwind_call_state(context, cs, keep, end_time, end_ctr);
+    if (!context->instrument) {
+        // 不装 hook 时栈上只有 zone 帧，不为函数补压帧
+        pfree(live);
+        return;
+    }
+
+    for (int m = next; m < n && cs->top < MAX_CALL_SIZE; m++) {
+        if (live[m].filtered || !live[m].key) continue;
+        struct call_frame* pre_frame = cur_callframe(cs);
+        if (context->fold_recursion && pre_frame && pre_frame->path && live[m].key == pre_frame->key) {
+            ++pre_frame->recursion;
+            pre_frame->ci = live[m].ci;
+            continue;
+        }
+        struct call_frame* frame = push_callframe(cs);
+        frame->key = live[m].key;
+        frame->call_time = now;
         frame->tail_pending = false;
+        frame->skip_cost = false;
+        frame->holds_active = false;
+        frame->filtered = false;
+        frame->zone = false;
+        frame->recursion = 0;
+        frame->tag = cs->tag ? cs->tag : context->tag;
+        frame->ci = live[m].ci;
         frame->co_cost = 0;
-        context->cpu_call_count_total++;
-        frame->path = get_frame_path(context, L, far, pre_callpath, frame);
-        if (frame->path) {
-            struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(frame->path);
-            ++node->call_count;
+        frame->child_cost = 0;
+        if (timed) frame_counters_begin(context, frame, context->ctr_now);
+        frame->lines = NULL;
+        frame->line = 0;
+        if (context->line_targets > 0) {
+            frame->lines = (struct line_table*)imap_query(context->line_map, frame->key);
         }
+        frame->func = get_func_stat(context, frame->key);
+        func_enter_frame(cs, frame);
+        frame->edge = NULL;
+        frame->path = NULL;
+        if (PROFILE_STRUCTURE_GRAPH == context->structure) {
+            if (pre_frame && pre_frame->func) frame->edge = graph_get_edge(pre_frame->func, frame->func);
+        } else {
+            frame->path = get_frame_path(context, pre_frame ? pre_frame->path : NULL, frame);
+            if (frame->path && context->fold_recursion) fold_enter_frame(cs, frame);
+        }
+    }
+    pfree(live);
+}
 
-    } else if (event == LUA_HOOKRET) {
-        if (cs->top <= 0) {
-            context->profiler_cpu_cost_total += safe_u64_minus(get_mono_ns(), begin_time);
-            context->running_in_hook = false;
-            return;
+static inline int active_level(const struct profile_context* context);
+
+// 记录一次 alloc/free/realloc 事件，alloc_ret 为底层分配器的返回值
+static inline void
+_alloc_track(struct profile_context* context, void *ptr, size_t _osize, size_t _nsize, void* alloc_ret) {
+    if (context->paused || active_level(context) < PROFILE_LEVEL_TIME_MEM) {
+        // 暂停期间（以及开销调节降到不统计内存的级别时）不记新的分配，
+        // 但已记录的块被释放（或 realloc 走）时要移除映射并记一次 free，否则存活统计会包含已释放的块
+        if (ptr != NULL && _osize > 0 && (_nsize == 0 || alloc_ret != NULL)) {
+            struct alloc_node* an = (struct alloc_node*)imap_remove(context->alloc_map, (uint64_t)(uintptr_t)ptr);
+            if (an) {
+                if (an->path && an->live_bytes > 0 && an->epoch == context->epoch) {
+                    _mem_update_on_path(context, an->path, 0, 0, an->live_bytes, 1, 0);
+                }
+                pfree(an);
+            }
         }
-        struct call_frame* cur_frame = pop_callframe(cs);
-        settle_frame_on_return(cur_frame, begin_time);
-        while (cs->top > 0) {
-            struct call_frame* pre_frame = cur_callframe(cs);
-            if (!pre_frame->tail_pending) break;
-            cur_frame = pop_callframe(cs);
-            settle_frame_on_return(cur_frame, begin_time);
+        return;
+    }
+
+    size_t oldsize = (ptr == NULL) ? 0 : _osize;
+    size_t newsize = _nsize;
+
+    if (oldsize == 0 && newsize > 0) {
+        // 1、alloc
+
+        struct callpath_node* leaf = _current_leaf_node(context);
+        // 更新节点
+        if (leaf) {
+            _mem_update_on_path(context, leaf, newsize, 1, 0, 0, 0);
+        }
+        // 创建映射
+        struct alloc_node* an = (struct alloc_node*)imap_query(context->alloc_map, (uint64_t)(uintptr_t)alloc_ret);
+        if (an == NULL) an = alloc_node_create();
+        an->live_bytes = newsize;
+        an->path = leaf;
+        an->epoch = context->epoch;
+        an->generation = context->generation;
+        imap_set(context->alloc_map, (uint64_t)(uintptr_t)alloc_ret, an);
+
+    } else if (oldsize > 0 && newsize == 0) {
+        // 2、free
+        
+        struct alloc_node* an = (struct alloc_node*)imap_remove(context->alloc_map, (uint64_t)(uintptr_t)ptr);
+        if (an) {
+            // 更新节点
+            if (an->path && an->live_bytes > 0 && an->epoch == context->epoch) {
+                _mem_update_on_path(context, an->path, 0, 0, an->live_bytes, 1, 0);
+            }
+            pfree(an);
+            an = NULL;
+        }
+
+    } else if (oldsize > 0 && newsize > 0) {
+        // 3、realloc
+        
+        // 参照 gperftools 的逻辑，realloc 拆分为 free 和 alloc 两个事件，但此处为了反映 gc 的压力，不增加 alloc_times 和 free_times。
+        // (旧 node 和新 node 可能是同一个 node)
+        // 1、旧 node，free_bytes 加上 oldsize；
+        // 2、新 node，alloc_bytes 加上 newsize，realloc_times 加 1；
+
+        // realloc 失败（返回 NULL）时，旧指针仍然有效，不能更新统计或映射
+        if (alloc_ret == NULL) {
+            return;
+        }
+
+        // 旧路径
+        struct alloc_node* old_an = (struct alloc_node*)imap_query(context->alloc_map, (uint64_t)(uintptr_t)ptr);
+        if (old_an && old_an->path && old_an->epoch == context->epoch) {
+            _mem_update_on_path(context, old_an->path, 0, 0, oldsize, 0, 0);
+        }
+
+        // 新路径
+        struct callpath_node* leaf = _current_leaf_node(context);
+        // 更新节点
+        if (leaf) {
+            _mem_update_on_path(context, leaf, newsize, 0, 0, 0, 1);
+        }
+        // 更新映射
+        if (alloc_ret != ptr) {
+            // 搬移
+            struct alloc_node* an = (struct alloc_node*)imap_remove(context->alloc_map, (uint64_t)(uintptr_t)ptr);
+            if (!an) {
+                an = alloc_node_create();
+                an->generation = context->generation;
+            }
+            an->live_bytes = newsize;
+            an->path = leaf;
+            an->epoch = context->epoch;
+            imap_set(context->alloc_map, (uint64_t)(uintptr_t)alloc_ret, an);
+        } else {
+            // 原地
+            struct alloc_node* an = (struct alloc_node*)imap_query(context->alloc_map, (uint64_t)(uintptr_t)ptr);
+            bool exists = (an != NULL);
+            if (!exists) {
+                an = alloc_node_create();
+                an->generation = context->generation;
+            }
+            an->live_bytes = newsize;
+            an->path = leaf;
+            an->epoch = context->epoch;
+            if (!exists) imap_set(context->alloc_map, (uint64_t)(uintptr_t)ptr, an);
+        }
+    }
+}
+
+// hook alloc/free/realloc 事件
+static void*
+_hook_alloc(void *ud, void *ptr, size_t _osize, size_t _nsize) {
+    struct profile_context* context = (struct profile_context*)ud;
+    void* alloc_ret = context->last_alloc_f(context->last_alloc_ud, ptr, _osize, _nsize);
+    if (context->running_in_hook || !context->is_ready) {
+        return alloc_ret;
+    }
+    // 开销调节时抽样计时，alloc hook 的开销和 call/ret hook 一起计入开销占比
+    if (context->max_overhead_percent > 0 && ++context->gov_alloc_events % GOVERNOR_ALLOC_SAMPLE == 0) {
+        uint64_t begin_time = get_mono_ns();
+        _alloc_track(context, ptr, _osize, _nsize, alloc_ret);
+        context->gov_alloc_cost += safe_u64_minus(get_mono_ns(), begin_time) * GOVERNOR_ALLOC_SAMPLE;
+        return alloc_ret;
+    }
+    _alloc_track(context, ptr, _osize, _nsize, alloc_ret);
+    return alloc_ret;
+}
+
+// 把一次 hook 事件记到帧所在的节点上，dump 时按事件构成扣除 hook 开销
+static inline void
+charge_event(struct call_frame* frame, int ev_class, bool first_visit) {
+    if (!frame || !frame->path) return;
+    struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(frame->path);
+    node->ev[ev_class]++;
+    if (first_visit) node->ev[OVH_FIRST_VISIT]++;
+}
+
+// hook 模板中的 timed/events 都是编译期常量，强制内联才能让关掉的分支被整段去掉
+#define HOOK_INLINE static inline __attribute__((always_inline))
+
+static void governor_poll(struct profile_context* context, lua_State* L);
+
+// hook 出口：累计 hook 自身耗时；协程切换的处理开销落在切换后协程的栈顶帧里
+HOOK_INLINE void
+hook_leave(struct profile_context* context, struct call_state* cs, uint64_t begin_time, bool co_switched, bool first_visit,
+    const bool timed, const bool events) {
+    if (timed) {
+        uint64_t hook_cost = safe_u64_minus(get_mono_ns(), begin_time);
+        context->profiler_cpu_cost_total += hook_cost;
+        if (events && first_visit) {
+            context->first_visit_cost_total += hook_cost;
+            context->first_visit_count++;
+        }
+    }
+    if (events && co_switched) {
+        charge_event(cur_callframe(cs), OVH_CO_SWITCH, false);
+    }
+    // 在事件处理完之后调节：升到计时级别时本次压的帧也会被重新计时
+    if (context->max_overhead_percent > 0 && ++context->gov_events >= GOVERNOR_CHECK_EVENTS) {
+        governor_poll(context, cs->co);
+    }
+    context->running_in_hook = false;
+}
+
+#define HOOK_LEAVE() hook_leave(context, cs, begin_time, co_switched, first_visit, timed, events)
+
+/*
+取 L 的 call_state 并设为当前协程：发现协程切换时记下旧协程的挂起时间，换树、resume 后先对齐栈，再把挂起的时间计入栈上各帧的 co_cost。
+hook 和 zone_begin/zone_end 共用。skip_top 见 resync_call_state。
+*/
+HOOK_INLINE struct call_state*
+enter_call_state(struct profile_context* context, lua_State* L, uint64_t begin_time, bool skip_top,
+    bool* co_switched, bool* resynced, const bool timed) {
+    struct call_state* cs = context->cur_cs;
+    if (!context->cur_cs || context->cur_cs->co != L) {
+        cs = lookup_call_state(context, L);
+        if (context->cur_cs) {
+            if (timed) {
+                context->cur_cs->leave_time = begin_time;
+                memcpy(context->cur_cs->leave_ctr, context->ctr_now, sizeof(context->ctr_now));
+            }
+            *co_switched = true;
+            // 出错结束的协程不会再有 RET，栈上的帧在切走时结算，否则会一直占着函数和节点的递归计数
+            struct call_state* dead_cs = context->cur_cs;
+            if (dead_cs->top > 0 && lua_status(dead_cs->co) > LUA_YIELD) {
+                if (dead_cs->epoch != context->epoch) sync_call_state(context, dead_cs);
+                unwind_call_state(context, dead_cs, 0, begin_time, timed ? context->ctr_now : NULL);
+            }
+        }
+        context->cur_cs = cs;
+    }
+    if (cs->epoch != context->epoch) {
+        sync_call_state(context, cs);
+    }
+    if (cs->pause_seq != context->pause_seq) {
+        resync_call_state(context, cs, L, skip_top, begin_time, timed);
+        *resynced = true;
+    }
+    if (timed && cs->leave_time > 0) {
+        assert(begin_time >= cs->leave_time);
+        uint64_t co_cost = begin_time - cs->leave_time;
+
+        for (int i = 0; i < cs->top; i++) {
+            cs->call_list[i].co_cost += co_cost;
+        }
+        for (int k = 0; k < context->counters.count; k++) {
+            uint64_t co_ctr = safe_u64_minus(context->ctr_now[k], cs->leave_ctr[k]);
+            for (int i = 0; i < cs->top; i++) {
+                cs->call_list[i].ctr_co[k] += co_ctr;
+            }
+        }
+        cs->leave_time = 0;
+    }
+    assert(cs->co == L);
+    return cs;
+}
+
+/*
+hook call/ret/line 事件的模板，由 DEFINE_HOOK_CALL 按 level 生成特化版本：
+timed 为 false 时不读时钟、不统计协程挂起时间和 hook 自身开销，只维护调用栈和调用次数；
+events 为 false 时不按事件分类记账，也不处理逐行统计。
+*/
+HOOK_INLINE void
+_hook_call_impl(lua_State* L, lua_Debug* far, const bool timed, const bool events) {
+    uint64_t begin_time = timed ? get_mono_ns() : 0;
+
+    struct profile_context* context = get_hook_context(L);
+    if (context == NULL) {
+        printf("resolve hook fail, profile not started\n");
+        return;
+    }
+    if(!context->is_ready || context->paused) {
+        // 时间片采样的空闲区间里仍然要数事件，到点时由 governor_poll 恢复
+        if (context->is_ready && context->paused == PAUSE_GOVERNOR && ++context->gov_events >= GOVERNOR_CHECK_EVENTS) {
+            governor_poll(context, L);
+        }
+        return;
+    }
+
+    context->running_in_hook = true;
+    if (timed && context->windows) window_tick(context, begin_time);
+    if (timed) counters_sample(context);
+    const uint64_t* now_ctr = timed ? context->ctr_now : NULL;
+
+    int event = far->event;
+    bool co_switched = false;
+    bool first_visit = false;
+    bool resynced = false;
+
+    struct call_state* cs = enter_call_state(context, L, begin_time, event == LUA_HOOKCALL || event == LUA_HOOKTAILCALL,
+        &co_switched, &resynced, timed);
+    if (resynced && event == LUA_HOOKTAILCALL) {
+        // 发起尾调用的帧的 CallInfo 已经换成被调函数，对齐时按已返回结算，这里按普通调用压帧
+        event = LUA_HOOKCALL;
+    }
+
+    if (event == LUA_HOOKCALL || event == LUA_HOOKTAILCALL) {
+        struct call_frame* frame = NULL;
+        struct call_frame* pre_frame = NULL;
+        bool filtered = false;
+        uint64_t func_seq = context->func_seq;
+        uint64_t new_key = get_function_key(context, L, far, &filtered);
+        first_visit = events && context->func_seq != func_seq;
+        int ev_class = (new_key & LUA_FUNC_KEY_BIT) ? OVH_LUA_CALL : OVH_C_CALL;
+        struct call_frame* top_frame = cur_callframe(cs);
+        // 过滤时被过滤的函数没有帧，尾调用不一定由栈顶帧发起，用 CallInfo 判断：尾调用复用发起者的 CallInfo
+        bool tail_from_top = event == LUA_HOOKTAILCALL && top_frame
+            && (!context->filtering || top_frame->ci == far->i_ci);
+
+        if (filtered && !tail_from_top) {
+            // 被过滤的函数不建帧，耗时留在最近的未过滤祖先上，hook 开销也记在祖先上
+            if (events) charge_event(top_frame, ev_class, first_visit);
+            HOOK_LEAVE();
+            return;
+        }
+
+        if (tail_from_top) {
+            // 尾调用语义：当前帧不会收到独立 RET。
+            // 非自尾递归：把当前帧标记为 pending，压入子调用帧；最终 RET 时级联结算。
+            // 自尾递归：仅增加调用次数，不新增帧，避免深递归撑爆 call_frame 栈。
+            struct call_frame* old_frame = top_frame;
+            if (new_key == old_frame->key) {
+                // 自尾递归聚合到同一节点：不改 frame 的 call_time/path，仅增加 call_count
+                if (events) charge_event(old_frame, OVH_TAIL_CALL, first_visit);
+                if (!old_frame->filtered) {
+                    context->cpu_call_count_total++;
+                    if (old_frame->path) {
+                        struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(old_frame->path);
+                        if (node) node_add_call(context, node);
+                    }
+                    if (old_frame->func) {
+                        ++old_frame->func->call_count;
+                    }
+                }
+                HOOK_LEAVE();
+                return;
+            }
+
+            if (old_frame->recursion > 0) {
+                // 折叠的直接递归中由内层发起尾调用：拆出一个内层帧承载 pending，外层帧保持不变
+                struct call_frame* outer_frame = old_frame;
+                outer_frame->recursion--;
+                outer_frame->ci = outer_frame->ci->previous;
+                old_frame = push_callframe(cs);
+                *old_frame = *outer_frame;
+                old_frame->recursion = 0;
+                old_frame->skip_cost = true;
+                if (old_frame->func) func_enter_frame(cs, old_frame);
+                old_frame->holds_active = false;
+                old_frame->ci = far->i_ci;
+                old_frame->call_time = begin_time;
+                old_frame->co_cost = 0;
+                old_frame->child_cost = 0;
+                if (timed) frame_counters_begin(context, old_frame, now_ctr);
+            }
+            old_frame->tail_pending = true;
+            pre_frame = old_frame;
+            frame = push_callframe(cs);
+            frame->key = new_key;
+        } else {
+            pre_frame = top_frame;
+            if (context->fold_recursion && pre_frame && pre_frame->path && new_key == pre_frame->key
+                && (!context->filtering || far->i_ci->previous == pre_frame->ci)) {
+                // 折叠直接递归：不压新帧，只记录层数，避免深递归撑爆 call_frame 栈
+                ++pre_frame->recursion;
+                pre_frame->ci = far->i_ci;
+                if (events) charge_event(pre_frame, ev_class, first_visit);
+                context->cpu_call_count_total++;
+                struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(pre_frame->path);
+                if (node) node_add_call(context, node);
+                if (pre_frame->func) ++pre_frame->func->call_count;
+                HOOK_LEAVE();
+                return;
+            }
+            frame = push_callframe(cs);
+            frame->key = new_key;
+        }
+
+        frame->call_time = begin_time;
+        frame->tail_pending = false;
+        frame->skip_cost = false;
+        frame->holds_active = false;
+        frame->filtered = filtered;
+        frame->zone = false;
+        frame->recursion = 0;
+        frame->tag = cs->tag ? cs->tag : context->tag;
+        frame->ci = far->i_ci;
+        frame->co_cost = 0;
+        frame->child_cost = 0;
+        if (timed) frame_counters_begin(context, frame, now_ctr);
+        frame->lines = NULL;
+        frame->line = 0;
+        if (context->line_targets > 0 && !filtered) {
+            frame->lines = (struct line_table*)imap_query(context->line_map, new_key);
+        }
+        if (filtered) {
+            // 未过滤的帧尾调用了被过滤的函数：压一个占位帧等待它的 RET，子调用仍挂在调用者的节点下
+            frame->path = pre_frame->path;
+            frame->func = pre_frame->func;
+            frame->edge = NULL;
+        } else if (PROFILE_STRUCTURE_GRAPH == context->structure) {
+            context->cpu_call_count_total++;
+            graph_enter_frame(context, cs, pre_frame, frame);
+        } else {
+            context->cpu_call_count_total++;
+            // 按函数聚合的 self/incl 随帧返回增量更新，top 不需要遍历调用树
+            frame->func = get_func_stat(context, new_key);
+            ++frame->func->call_count;
+            func_enter_frame(cs, frame);
+            frame->edge = NULL;
+            frame->path = get_frame_path(context, pre_frame ? pre_frame->path : NULL, frame);
+            if (frame->path) {
+                struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(frame->path);
+                node_add_call(context, node);
+                if (context->fold_recursion) fold_enter_frame(cs, frame);
+            }
+        }
+        // 占位帧的 path 是调用者的，开销记在调用者上
+        if (events) charge_event(frame, tail_from_top ? OVH_TAIL_CALL : ev_class, first_visit);
+
+    } else if (event == LUA_HOOKRET) {
+        if (cs->top <= 0) {
+            HOOK_LEAVE();
+            return;
+        }
+        struct call_frame* top_frame = cur_callframe(cs);
+        if (context->filtering) {
+            // 被过滤的函数返回：除非是尾调用留下的占位帧，否则栈上没有它的帧
+            bool filtered = false;
+            get_function_key(context, L, far, &filtered);
+            if (filtered && !(top_frame->filtered && top_frame->ci == far->i_ci)) {
+                HOOK_LEAVE();
+                return;
+            }
+        }
+        if (top_frame->ci != far->i_ci) {
+            // 错误被 pcall 捕获时跳过了中间各帧的 RET：返回的函数在栈的更深处，先结算它之上的帧
+            int level = cs->top - 2;
+            while (level >= 0 && cs->call_list[level].ci != far->i_ci) level--;
+            if (level >= 0) {
+                unwind_call_state(context, cs, level + 1, begin_time, now_ctr);
+                top_frame = cur_callframe(cs);
+            }
+        }
+        while (top_frame->zone && top_frame->ci == far->i_ci) {
+            // 打开 zone 的函数返回时还没有 zone_end，zone 随函数一起结束
+            struct call_frame* zone_frame = pop_callframe(cs);
+            uint64_t zone_cost = settle_frame_on_return(context, zone_frame, begin_time, now_ctr);
+            if (cs->top <= 0) {
+                HOOK_LEAVE();
+                return;
+            }
+            top_frame = cur_callframe(cs);
+            top_frame->child_cost += zone_cost;
+        }
+        if (top_frame->recursion > 0) {
+            // 折叠的直接递归返回一层，耗时由最外层帧统计
+            top_frame->recursion--;
+            top_frame->ci = top_frame->ci->previous;
+            HOOK_LEAVE();
+            return;
+        }
+        struct call_frame* cur_frame = pop_callframe(cs);
+        uint64_t cost = settle_frame_on_return(context, cur_frame, begin_time, now_ctr);
+        while (cs->top > 0) {
+            struct call_frame* pre_frame = cur_callframe(cs);
+            pre_frame->child_cost += cost;
+            if (!pre_frame->tail_pending) break;
+            cur_frame = pop_callframe(cs);
+            cost = settle_frame_on_return(context, cur_frame, begin_time, now_ctr);
+        }
+
+    } else if (events && event == LUA_HOOKLINE) {
+        // 只统计栈顶帧自己的行，被过滤（没有帧）的函数产生的 line 事件忽略
+        struct call_frame* top_frame = cur_callframe(cs);
+        if (top_frame && top_frame->lines && top_frame->ci == far->i_ci) {
+            line_frame_advance(top_frame, far->currentline, begin_time);
+        }
+    }
+
+    if (events && event != LUA_HOOKLINE && (context->line_targets > 0 || (lua_gethookmask(L) & LUA_MASKLINE))) {
+        update_line_hook(L, cs);
+    }
+
+    HOOK_LEAVE();
+}
+
+#undef HOOK_LEAVE
+
+#define DEFINE_HOOK_CALL(name, timed, events) \
+    static void name(lua_State* L, lua_Debug* far) { _hook_call_impl(L, far, timed, events); }
+
+DEFINE_HOOK_CALL(_hook_call_count, false, false)
+DEFINE_HOOK_CALL(_hook_call_time, true, false)
+DEFINE_HOOK_CALL(_hook_call_full, true, true)
+
+static lua_Hook
+level_hook(int level) {
+    switch (level) {
+    case PROFILE_LEVEL_COUNT: return _hook_call_count;
+    case PROFILE_LEVEL_TIME:
+    case PROFILE_LEVEL_TIME_MEM: return _hook_call_time;
+    default: return _hook_call_full;
+    }
+}
+
+static const char* level_names[] = {"count", "time", "time+mem", "full"};
+
+// 开销调节的最低一级是 count 加时间片采样
+static inline bool
+governor_sampling(const struct profile_context* context) {
+    return context->gov_rung == context->gov_rung_count - 1;
+}
+
+// 当前生效的统计级别，启用开销调节时为所在的级别（采样一级按 count）
+static inline int
+active_level(const struct profile_context* context) {
+    if (context->max_overhead_percent > 0) return context->gov_rungs[context->gov_rung];
+    return context->level;
+}
+
+static const char*
+governor_level_name(const struct profile_context* context) {
+    if (governor_sampling(context)) return "count+sampling";
+    return level_names[context->gov_rungs[context->gov_rung]];
+}
+
+static const char* overhead_class_names[OVH_CLASS_COUNT] = {
+    "lua_call", "c_call", "tail_call", "co_switch", "first_visit",
+};
+
+// 未校准时退化为全局平均：每次调用（含尾调用）扣除一次平均 hook 开销
+static void init_class_cost(struct profile_context* pcontext, double avg, double* class_cost) {
+    if (!pcontext->calibrated) {
+        class_cost[OVH_LUA_CALL] = avg;
+        class_cost[OVH_C_CALL] = avg;
+        class_cost[OVH_TAIL_CALL] = avg;
+        class_cost[OVH_CO_SWITCH] = 0;
+        class_cost[OVH_FIRST_VISIT] = 0;
+        return;
+    }
+    for (int i = 0; i < OVH_CLASS_COUNT; i++) {
+        class_cost[i] = pcontext->overhead_cost[i];
+    }
+    // 首次见到函数的额外开销：这类 call hook 的平均耗时减去普通 call hook（约为一对 call/ret 的一半）
+    class_cost[OVH_FIRST_VISIT] = 0;
+    if (pcontext->first_visit_count > 0) {
+        double first = (double)pcontext->first_visit_cost_total / (double)pcontext->first_visit_count;
+        first -= pcontext->overhead_cost[OVH_LUA_CALL] / 2;
+        class_cost[OVH_FIRST_VISIT] = first > 0 ? first : 0;
+    }
+}
+
+struct dump_node_values {
+    uint64_t cpu_cost_real;
+    double   percent_raw;
+    double   percent_real;
+    uint64_t inuse_bytes;
+};
+
+// incl 指标已由 compute_inclusive 汇总到节点上，这里只计算依赖父节点和全局统计的部分
+static void _calc_dump_values(struct callpath_node* node, const struct dump_snapshot* snap, struct dump_node_values* v) {
+    v->cpu_cost_real = calc_cpu_cost_real(node->cpu_cost_raw, node->ev_incl, snap->class_cost);
+    v->inuse_bytes = (node->alloc_bytes_incl >= node->free_bytes_incl ? node->alloc_bytes_incl - node->free_bytes_incl : 9999999999);
+
+    uint64_t parent_cpu_cost_raw = 0;
+    uint64_t parent_cpu_cost_real = 0;
+    if (node->parent) {
+        parent_cpu_cost_raw = node->parent->cpu_cost_raw;
+        parent_cpu_cost_real = calc_cpu_cost_real(node->parent->cpu_cost_raw, node->parent->ev_incl, snap->class_cost);
+    }
+    v->percent_raw = parent_cpu_cost_raw > 0 ? ((double)node->cpu_cost_raw / parent_cpu_cost_raw * 100.0) : 100;
+    v->percent_real = parent_cpu_cost_real > 0 ? ((double)v->cpu_cost_real / parent_cpu_cost_real * 100.0) : 100;
+}
+
+static void _format_node_name(struct callpath_node* node, char* buf, size_t sz) {
+    struct symbol_info* si = node->sym;
+    snprintf(buf, sz-1, "%s %s:%d", si && si->name ? si->name : "", si && si->source ? si->source : "", si ? si->line : 0);
+}
+
+static struct symbol_info other_symbol = {0, NULL, SYMBOL_KIND_C, true, "[other]", "", 0, 0, NULL};
+
+/*
+导出时的先序遍历，用显式栈代替递归，深树不会撑爆 C 栈和 lua 栈。
+展开子节点时按 cpu_cost_raw 降序排列，并按 dump_prune 裁剪，裁掉的兄弟节点合并成一个 [other] 节点排在最后。
+*/
+struct dump_walk_entry {
+    struct icallpath_context* path;   // NULL 表示合并出来的 [other] 节点
+    struct callpath_node* node;
+    int depth;
+    uint32_t index;     // 在父节点 children 中的序号，从 1 开始
+    bool close;         // json 导出用：子节点全部写完后闭合本节点
+    bool has_children;
+};
+
+struct dump_walker {
+    const struct dump_prune* prune;
+    struct dump_walk_entry* stack;
+    size_t top;
+    size_t cap;
+    struct callpath_node** others;      // 合并出来的 [other] 节点，遍历结束后释放
+    size_t others_size;
+    size_t others_cap;
+    struct icallpath_stack children;    // 展开子节点时的临时数组
+};
+
+static size_t _dump_walker_push(struct dump_walker* w, struct icallpath_context* path, struct callpath_node* node, int depth, uint32_t index) {
+    if (w->top >= w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 64;
+        w->stack = (struct dump_walk_entry*)prealloc(w->stack, sizeof(struct dump_walk_entry) * w->cap);
+    }
+    struct dump_walk_entry* e = &w->stack[w->top];
+    e->path = path;
+    e->node = node;
+    e->depth = depth;
+    e->index = index;
+    e->close = false;
+    e->has_children = false;
+    return w->top++;
+}
+
+static void _dump_walker_init(struct dump_walker* w, const struct dump_prune* prune, struct icallpath_context* root) {
+    memset(w, 0, sizeof(*w));
+    w->prune = prune;
+    _dump_walker_push(w, root, (struct callpath_node*)icallpath_getvalue(root), 0, 1);
+}
+
+static bool _dump_walker_pop(struct dump_walker* w, struct dump_walk_entry* out) {
+    if (w->top == 0) return false;
+    *out = w->stack[--w->top];
+    return true;
+}
+
+static void _dump_walker_free(struct dump_walker* w) {
+    for (size_t i = 0; i < w->others_size; i++) {
+        pfree(w->others[i]->ctr);
+        pfree(w->others[i]->hist);
+        pfree(w->others[i]);
+    }
+    pfree(w->others);
+    pfree(w->stack);
+    pfree(w->children.items);
+}
+
+static int _cmp_path_cost_desc(const void* a, const void* b) {
+    const struct callpath_node* na = (const struct callpath_node*)(*(struct icallpath_context* const*)a)->value;
+    const struct callpath_node* nb = (const struct callpath_node*)(*(struct icallpath_context* const*)b)->value;
+    if (na->cpu_cost_raw == nb->cpu_cost_raw) return 0;
+    return na->cpu_cost_raw > nb->cpu_cost_raw ? -1 : 1;
+}
+
+static inline bool _dump_prune_keep(const struct dump_prune* prune, const struct callpath_node* parent, const struct callpath_node* child, size_t rank) {
+    if (prune->top_children > 0 && rank >= prune->top_children) return false;
+    if (child->cpu_cost_raw < prune->min_ns) return false;
+    if (prune->min_percent > 0 && parent->cpu_cost_raw > 0
+        && (double)child->cpu_cost_raw * 100.0 / (double)parent->cpu_cost_raw < prune->min_percent) return false;
+    return true;
+}
+
+static void _merge_into_other(struct callpath_node* other, const struct callpath_node* node) {
+    other->call_count += node->call_count;
+    other->call_count_incl += node->call_count_incl;
+    other->cpu_cost_raw += node->cpu_cost_raw;
+    if (node->last_ret_time > other->last_ret_time) other->last_ret_time = node->last_ret_time;
+    other->alloc_bytes_incl += node->alloc_bytes_incl;
+    other->free_bytes_incl += node->free_bytes_incl;
+    other->alloc_times_incl += node->alloc_times_incl;
+    other->free_times_incl += node->free_times_incl;
+    other->realloc_times_incl += node->realloc_times_incl;
+    other->heap_bytes_incl += node->heap_bytes_incl;
+    other->heap_blocks_incl += node->heap_blocks_incl;
+    if (node->hist) {
+        if (!other->hist) other->hist = (struct size_hist*)pcalloc(1, sizeof(struct size_hist));
+        for (int k = 0; k < SIZE_CLASS_COUNT; k++) {
+            other->hist->alloc_incl[k] += node->hist->alloc_incl[k];
+            other->hist->realloc_incl[k] += node->hist->realloc_incl[k];
+        }
+    }
+    if (node->ctr) {
+        if (!other->ctr) other->ctr = (uint64_t*)pcalloc(MAX_COUNTERS, sizeof(uint64_t));
+        for (int k = 0; k < MAX_COUNTERS; k++) {
+            other->ctr[k] += node->ctr[k];
+        }
+    }
+    for (int k = 0; k < OVH_CLASS_COUNT; k++) {
+        other->ev_incl[k] += node->ev_incl[k];
+    }
+}
+
+// 把 parent 的子节点排序、裁剪后压栈，返回压栈的子节点数；children_cost 返回所有子节点（含被裁剪的）的 cpu_cost_raw 之和
+static uint32_t _dump_walker_expand(struct dump_walker* w, const struct dump_walk_entry* parent, uint64_t* children_cost) {
+    *children_cost = 0;
+    if (!parent->path) return 0;
+    w->children.size = 0;
+    imap_dump(parent->path->children, _icallpath_stack_push_child, &w->children);
+    size_t n = w->children.size;
+    struct icallpath_context** items = w->children.items;
+    if (w->prune->skip_idle) {
+        size_t m = 0;
+        for (size_t i = 0; i < n; i++) {
+            const struct callpath_node* c = (const struct callpath_node*)items[i]->value;
+            if (c->call_count_incl || c->cpu_cost_raw || c->alloc_times_incl || c->free_times_incl || c->realloc_times_incl) {
+                items[m++] = items[i];
+            }
+        }
+        n = m;
+    }
+    if (n == 0) return 0;
+    qsort(items, n, sizeof(struct icallpath_context*), _cmp_path_cost_desc);
+
+    size_t keep = 0;
+    while (keep < n && _dump_prune_keep(w->prune, parent->node, (struct callpath_node*)items[keep]->value, keep)) {
+        keep++;
+    }
+    struct callpath_node* other = NULL;
+    if (keep < n) {
+        other = callpath_node_create();
+        other->parent = parent->node;
+        other->sym = &other_symbol;
+        other->depth = parent->node->depth + 1;
+        for (size_t i = keep; i < n; i++) {
+            _merge_into_other(other, (struct callpath_node*)items[i]->value);
+        }
+        if (w->others_size >= w->others_cap) {
+            w->others_cap = w->others_cap ? w->others_cap * 2 : 16;
+            w->others = (struct callpath_node**)prealloc(w->others, sizeof(struct callpath_node*) * w->others_cap);
+        }
+        w->others[w->others_size++] = other;
+    }
+    for (size_t i = 0; i < n; i++) {
+        *children_cost += ((struct callpath_node*)items[i]->value)->cpu_cost_raw;
+    }
+
+    // 逆序压栈，出栈时按降序
+    uint32_t count = (uint32_t)keep + (other ? 1 : 0);
+    if (other) {
+        _dump_walker_push(w, NULL, other, parent->depth + 1, count);
+    }
+    for (size_t i = keep; i > 0; i--) {
+        _dump_walker_push(w, items[i-1], (struct callpath_node*)items[i-1]->value, parent->depth + 1, (uint32_t)i);
+    }
+    return count;
+}
+
+// 把节点的指标写到栈顶的 table
+// 直方图只导出非 0 的档，key 为 size_class_names
+static void _push_size_hist(lua_State* L, const uint64_t* hist) {
+    lua_newtable(L);
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+        if (hist[i] == 0) continue;
+        lua_pushinteger(L, (lua_Integer)hist[i]);
+        lua_setfield(L, -2, size_class_names[i]);
+    }
+}
+
+static void _push_dump_values(lua_State* L, struct callpath_node* node, const struct dump_snapshot* snap) {
+    struct dump_node_values v;
+    _calc_dump_values(node, snap, &v);
+
+    char name[512] = {0};
+    _format_node_name(node, name, sizeof(name));
+    lua_pushstring(L, name);
+    lua_setfield(L, -2, "name");
+
+    lua_pushinteger(L, node->last_ret_time);
+    lua_setfield(L, -2, "last_ret_time");
+    
+    lua_pushinteger(L, node->call_count);
+    lua_setfield(L, -2, "call_count");
+    lua_pushinteger(L, node->call_count_incl);
+    lua_setfield(L, -2, "call_count_incl");
+
+    lua_pushinteger(L, node->cpu_cost_raw);
+    lua_setfield(L, -2, "cpu_cost_raw(ns)");
+    lua_pushinteger(L, v.cpu_cost_real);
+    lua_setfield(L, -2, "cpu_cost_real(ns)");
+
+    char percent_raw_str[32] = {0};
+    snprintf(percent_raw_str, sizeof(percent_raw_str)-1, "%.2f", v.percent_raw);
+    lua_pushstring(L, percent_raw_str);
+    lua_setfield(L, -2, "cpu_cost_raw(%)");
+
+    char percent_real_str[32] = {0};
+    snprintf(percent_real_str, sizeof(percent_real_str)-1, "%.2f", v.percent_real);
+    lua_pushstring(L, percent_real_str);
+    lua_setfield(L, -2, "cpu_cost_real(%)");
+
+    if (PROFILE_MODE_ON == snap->mem_profile_mode) {
+        lua_pushinteger(L, (lua_Integer)node->alloc_bytes_incl);
+        lua_setfield(L, -2, "alloc_bytes");
+
+        lua_pushinteger(L, (lua_Integer)node->free_bytes_incl);
+        lua_setfield(L, -2, "free_bytes");
+
+        lua_pushinteger(L, (lua_Integer)node->alloc_times_incl);
+        lua_setfield(L, -2, "alloc_times");
+
+        lua_pushinteger(L, (lua_Integer)node->free_times_incl);
+        lua_setfield(L, -2, "free_times");
+
+        lua_pushinteger(L, (lua_Integer)node->realloc_times_incl);
+        lua_setfield(L, -2, "realloc_times");
+
+        lua_pushinteger(L, (lua_Integer)v.inuse_bytes);
+        lua_setfield(L, -2, "inuse_bytes");
+
+        if (node->hist) {
+            _push_size_hist(L, node->hist->alloc_incl);
+            lua_setfield(L, -2, "alloc_sizes");
+            _push_size_hist(L, node->hist->realloc_incl);
+            lua_setfield(L, -2, "realloc_sizes");
+        }
+    }
+    if (snap->counter_count > 0 && node->ctr) {
+        lua_createtable(L, 0, snap->counter_count + 1);
+        for (int i = 0; i < snap->counter_count; i++) {
+            lua_pushinteger(L, (lua_Integer)node->ctr[i]);
+            lua_setfield(L, -2, snap->counter_names[i]);
+        }
+        if (snap->ipc_instructions >= 0 && snap->ipc_cycles >= 0 && node->ctr[snap->ipc_cycles] > 0) {
+            lua_pushnumber(L, (double)node->ctr[snap->ipc_instructions] / (double)node->ctr[snap->ipc_cycles]);
+            lua_setfield(L, -2, "ipc");
+        }
+        lua_setfield(L, -2, "counters");
+    }
+    if (is_tag_root(node) && node->tag < snap->tag_slots) {
+        lua_pushstring(L, snap->tag_names[node->tag]);
+        lua_setfield(L, -2, "tag");
+    }
+    if (!node->parent) {
+        lua_pushstring(L, level_names[snap->level]);
+        lua_setfield(L, -2, "level");
+        if (snap->active_level) {
+            lua_pushstring(L, snap->active_level);
+            lua_setfield(L, -2, "active_level");
+            lua_pushinteger(L, (lua_Integer)snap->level_changes);
+            lua_setfield(L, -2, "level_changes");
+        }
+        lua_pushinteger(L, snap->profiler_cpu_cost_total);
+        lua_setfield(L, -2, "profiler_cpu_cost_total(ns)");
+        lua_pushinteger(L, snap->cpu_call_count_total);
+        lua_setfield(L, -2, "cpu_call_count_total");
+        lua_pushnumber(L, snap->avg_profiler_cost_per_call);
+        lua_setfield(L, -2, "avg_profiler_cost_per_call(ns)");
+        lua_createtable(L, 0, OVH_CLASS_COUNT + 1);
+        lua_pushboolean(L, snap->calibrated);
+        lua_setfield(L, -2, "calibrated");
+        for (int i = 0; i < OVH_CLASS_COUNT; i++) {
+            lua_pushnumber(L, snap->class_cost[i]);
+            lua_setfield(L, -2, overhead_class_names[i]);
+        }
+        lua_setfield(L, -2, "overhead_per_event(ns)");
+        if (snap->tag_total_count > 0) {
+            lua_createtable(L, snap->tag_total_count, 0);
+            for (int i = 0; i < snap->tag_total_count; i++) {
+                const struct tag_total* t = &snap->tag_totals[i];
+                lua_createtable(L, 0, 7);
+                lua_pushstring(L, snap->tag_names[t->tag]);
+                lua_setfield(L, -2, "tag");
+                lua_pushinteger(L, (lua_Integer)t->call_count);
+                lua_setfield(L, -2, "call_count");
+                lua_pushinteger(L, (lua_Integer)t->cpu_cost_raw);
+                lua_setfield(L, -2, "cpu_cost_raw(ns)");
+                lua_pushinteger(L, (lua_Integer)t->cpu_cost_real);
+                lua_setfield(L, -2, "cpu_cost_real(ns)");
+                if (PROFILE_MODE_ON == snap->mem_profile_mode) {
+                    lua_pushinteger(L, (lua_Integer)t->alloc_bytes);
+                    lua_setfield(L, -2, "alloc_bytes");
+                    lua_pushinteger(L, (lua_Integer)t->free_bytes);
+                    lua_setfield(L, -2, "free_bytes");
+                    lua_pushinteger(L, (lua_Integer)t->alloc_times);
+                    lua_setfield(L, -2, "alloc_times");
+                }
+                lua_rawseti(L, -2, i + 1);
+            }
+            lua_setfield(L, -2, "tags");
+        }
+    }
+}
+
+static void _init_dump_snapshot(struct dump_snapshot* snap, struct profile_context* pcontext, const struct dump_prune* prune) {
+    if (pcontext->counters.count > 0 && !pcontext->counters.multiplex_warned) {
+        double ratio = perf_counters_running_ratio(&pcontext->counters);
+        if (ratio < 1.0) {
+            printf("WARNING: counters were only counting %.1f%% of the time (multiplexed by the kernel), counter values are undercounted\n", ratio * 100.0);
+            pcontext->counters.multiplex_warned = true;
+        }
+    }
+    snap->level = pcontext->level;
+    snap->mem_profile_mode = pcontext->mem_profile_mode;
+    snap->heap_snapshot = false;
+    snap->profiler_cpu_cost_total = pcontext->profiler_cpu_cost_total;
+    snap->cpu_call_count_total = pcontext->cpu_call_count_total;
+    snap->avg_profiler_cost_per_call = 0;
+    if (pcontext->cpu_call_count_total > 0) {
+        snap->avg_profiler_cost_per_call =
+            (double)pcontext->profiler_cpu_cost_total / (double)pcontext->cpu_call_count_total;
+    }
+    init_class_cost(pcontext, snap->avg_profiler_cost_per_call, snap->class_cost);
+    snap->calibrated = pcontext->calibrated;
+    snap->tag_names = (const char* const*)pcontext->tag_names;
+    snap->tag_slots = pcontext->tag_names ? pcontext->max_tags + 2 : 0;
+    snap->tag_totals = NULL;
+    snap->tag_total_count = 0;
+    snap->active_level = pcontext->max_overhead_percent > 0 ? governor_level_name(pcontext) : NULL;
+    snap->level_changes = pcontext->gov_level_changes;
+    snap->counter_count = pcontext->counters.count;
+    snap->ipc_instructions = -1;
+    snap->ipc_cycles = -1;
+    for (int i = 0; i < snap->counter_count; i++) {
+        snap->counter_names[i] = pcontext->counters.names[i];
+        if (strcmp(snap->counter_names[i], "instructions") == 0) snap->ipc_instructions = i;
+        if (strcmp(snap->counter_names[i], "cycles") == 0) snap->ipc_cycles = i;
+    }
+    if (prune) {
+        snap->prune = *prune;
+    } else {
+        init_dump_prune(&snap->prune);
+    }
+}
+
+static void free_dump_snapshot(struct dump_snapshot* snap) {
+    pfree(snap->tag_totals);
+    snap->tag_totals = NULL;
+    snap->tag_total_count = 0;
+}
+
+static int _cmp_tag_total_desc(const void* a, const void* b) {
+    const struct tag_total* ta = (const struct tag_total*)a;
+    const struct tag_total* tb = (const struct tag_total*)b;
+    if (ta->cpu_cost_raw != tb->cpu_cost_raw) return ta->cpu_cost_raw > tb->cpu_cost_raw ? -1 : 1;
+    return ta->tag - tb->tag;
+}
+
+// 路径上更外层已经有同一 tag（A -> B -> A），该节点的耗时已经包含在外层的 tag 根节点里
+static inline bool has_tag_ancestor(const struct callpath_node* node) {
+    for (const struct callpath_node* p = node->parent; p; p = p->parent) {
+        if (p->tag == node->tag) return true;
+    }
+    return false;
+}
+
+// 需要在 compute_inclusive 之后调用
+static void compute_tag_totals(struct icallpath_context* callpath, struct dump_snapshot* snap) {
+    if (snap->tag_slots == 0) return;
+    struct tag_total* totals = (struct tag_total*)pcalloc(snap->tag_slots, sizeof(*totals));
+    struct icallpath_stack st = {NULL, 0, 0};
+    icallpath_stack_push(&st, callpath);
+    while (st.size > 0) {
+        struct icallpath_context* cur = st.items[--st.size];
+        struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(cur);
+        if (is_tag_root(node) && node->tag < snap->tag_slots && !has_tag_ancestor(node)) {
+            struct tag_total* t = &totals[node->tag];
+            t->call_count += node->call_count;
+            t->cpu_cost_raw += node->cpu_cost_raw;
+            t->cpu_cost_real += calc_cpu_cost_real(node->cpu_cost_raw, node->ev_incl, snap->class_cost);
+            t->alloc_bytes += node->alloc_bytes_incl;
+            t->free_bytes += node->free_bytes_incl;
+            t->alloc_times += node->alloc_times_incl;
+        }
+        imap_dump(cur->children, _icallpath_stack_push_child, &st);
+    }
+    pfree(st.items);
+
+    int n = 0;
+    for (int i = 1; i < snap->tag_slots; i++) {
+        if (totals[i].call_count == 0) continue;
+        totals[n] = totals[i];
+        totals[n].tag = i;
+        n++;
+    }
+    qsort(totals, n, sizeof(*totals), _cmp_tag_total_desc);
+    snap->tag_totals = totals;
+    snap->tag_total_count = n;
+}
+
+// 调用前需要保证符号已解析，root 节点的 cpu_cost_raw 已更新
+static void prepare_call_path(struct icallpath_context* callpath, struct dump_snapshot* snap) {
+    compute_inclusive(callpath);
+    struct callpath_node* root_node = (struct callpath_node*)icallpath_getvalue(callpath);
+    if (root_node) {
+        root_node->call_count_incl = snap->cpu_call_count_total;
+    }
+    compute_tag_totals(callpath, snap);
+}
+
+// 导出为 lua table。用一个 work 表记录每层当前的 children 表（work[d] 为深度 d 的节点要放入的表），lua 栈的占用和树的深度无关
+static void dump_call_path(struct profile_context* pcontext, lua_State* L, const struct dump_prune* prune) {
+    struct dump_snapshot snap;
+    _init_dump_snapshot(&snap, pcontext, prune);
+    prepare_call_path(pcontext->callpath, &snap);
+
+    lua_checkstack(L, 6);
+    lua_newtable(L);
+    int work = lua_gettop(L);
+    struct dump_walker w;
+    _dump_walker_init(&w, &snap.prune, pcontext->callpath);
+    struct dump_walk_entry e;
+    uint64_t children_cost = 0;
+    while (_dump_walker_pop(&w, &e)) {
+        lua_newtable(L);
+        _push_dump_values(L, e.node, &snap);
+        uint32_t n = _dump_walker_expand(&w, &e, &children_cost);
+        if (n > 0) {
+            lua_createtable(L, (int)n, 0);
+            lua_pushvalue(L, -1);
+            lua_setfield(L, -3, "children");
+            lua_rawseti(L, work, e.depth + 1);
+        }
+        if (e.depth == 0) {
+            lua_rawseti(L, work, 0);
+        } else {
+            lua_rawgeti(L, work, e.depth);
+            lua_insert(L, -2);
+            lua_rawseti(L, -2, e.index);
+            lua_pop(L, 1);
+        }
+    }
+    _dump_walker_free(&w);
+    free_dump_snapshot(&snap);
+    lua_rawgeti(L, work, 0);
+    lua_remove(L, work);
+}
+
+static void _write_json_string(FILE* fp, const char* s) {
+    fputc('"', fp);
+    for (const unsigned char* c = (const unsigned char*)s; *c; c++) {
+        switch (*c) {
+        case '"':  fputs("\\\"", fp); break;
+        case '\\': fputs("\\\\", fp); break;
+        case '\n': fputs("\\n", fp); break;
+        case '\r': fputs("\\r", fp); break;
+        case '\t': fputs("\\t", fp); break;
+        default:
+            if (*c < 0x20) fprintf(fp, "\\u%04x", *c);
+            else fputc(*c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static void _write_json_size_hist(FILE* fp, const uint64_t* hist) {
+    fputc('{', fp);
+    bool first = true;
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+        if (hist[i] == 0) continue;
+        fprintf(fp, "%s\"%s\":%" PRIu64, first ? "" : ",", size_class_names[i], hist[i]);
+        first = false;
+    }
+    fputc('}', fp);
+}
+
+// 写出节点的开头和指标，与 _push_dump_values 的字段相同，name 和 tag 写在最前面，流式读取时读到这里就能确定节点；children 和结尾由调用方写
+static void _write_json_node(FILE* fp, struct callpath_node* node, const struct dump_snapshot* snap) {
+    struct dump_node_values v;
+    _calc_dump_values(node, snap, &v);
+    char name[512] = {0};
+    _format_node_name(node, name, sizeof(name));
+    fputs("{\"name\":", fp);
+    _write_json_string(fp, name);
+    if (is_tag_root(node) && node->tag < snap->tag_slots) {
+        fputs(",\"tag\":", fp);
+        _write_json_string(fp, snap->tag_names[node->tag]);
+    }
+
+    fprintf(fp, ",\"last_ret_time\":%" PRIu64 ",\"call_count\":%" PRIu64 ",\"call_count_incl\":%" PRIu64,
+        node->last_ret_time, node->call_count, node->call_count_incl);
+    fprintf(fp, ",\"cpu_cost_raw(ns)\":%" PRIu64 ",\"cpu_cost_real(ns)\":%" PRIu64 ",\"cpu_cost_raw(%%)\":\"%.2f\",\"cpu_cost_real(%%)\":\"%.2f\"",
+        node->cpu_cost_raw, v.cpu_cost_real, v.percent_raw, v.percent_real);
+    if (PROFILE_MODE_ON == snap->mem_profile_mode) {
+        fprintf(fp, ",\"alloc_bytes\":%" PRIu64 ",\"free_bytes\":%" PRIu64 ",\"alloc_times\":%" PRIu64
+            ",\"free_times\":%" PRIu64 ",\"realloc_times\":%" PRIu64 ",\"inuse_bytes\":%" PRIu64,
+            node->alloc_bytes_incl, node->free_bytes_incl, node->alloc_times_incl, node->free_times_incl,
+            node->realloc_times_incl, v.inuse_bytes);
+        if (node->hist) {
+            fputs(",\"alloc_sizes\":", fp);
+            _write_json_size_hist(fp, node->hist->alloc_incl);
+            fputs(",\"realloc_sizes\":", fp);
+            _write_json_size_hist(fp, node->hist->realloc_incl);
+        }
+    }
+    if (snap->heap_snapshot) {
+        fprintf(fp, ",\"heap_bytes\":%" PRIu64 ",\"heap_blocks\":%" PRIu64, node->heap_bytes_incl, node->heap_blocks_incl);
+    }
+    if (snap->counter_count > 0 && node->ctr) {
+        for (int i = 0; i < snap->counter_count; i++) {
+            fprintf(fp, "%s\"%s\":%" PRIu64, i > 0 ? "," : ",\"counters\":{", snap->counter_names[i], node->ctr[i]);
+        }
+        if (snap->ipc_instructions >= 0 && snap->ipc_cycles >= 0 && node->ctr[snap->ipc_cycles] > 0) {
+            fprintf(fp, ",\"ipc\":%.17g", (double)node->ctr[snap->ipc_instructions] / (double)node->ctr[snap->ipc_cycles]);
+        }
+        fputc('}', fp);
+    }
+    if (!node->parent) {
+        fprintf(fp, ",\"level\":\"%s\"", level_names[snap->level]);
+        if (snap->active_level) {
+            fprintf(fp, ",\"active_level\":\"%s\",\"level_changes\":%" PRIu64, snap->active_level, snap->level_changes);
+        }
+        fprintf(fp, ",\"profiler_cpu_cost_total(ns)\":%" PRIu64 ",\"cpu_call_count_total\":%" PRIu64 ",\"avg_profiler_cost_per_call(ns)\":%.17g",
+            snap->profiler_cpu_cost_total, snap->cpu_call_count_total, snap->avg_profiler_cost_per_call);
+        fprintf(fp, ",\"overhead_per_event(ns)\":{\"calibrated\":%s", snap->calibrated ? "true" : "false");
+        for (int i = 0; i < OVH_CLASS_COUNT; i++) {
+            fprintf(fp, ",\"%s\":%.17g", overhead_class_names[i], snap->class_cost[i]);
+        }
+        fputc('}', fp);
+        if (snap->tag_total_count > 0) {
+            fputs(",\"tags\":[", fp);
+            for (int i = 0; i < snap->tag_total_count; i++) {
+                const struct tag_total* t = &snap->tag_totals[i];
+                fputs(i > 0 ? ",{\"tag\":" : "{\"tag\":", fp);
+                _write_json_string(fp, snap->tag_names[t->tag]);
+                fprintf(fp, ",\"call_count\":%" PRIu64 ",\"cpu_cost_raw(ns)\":%" PRIu64 ",\"cpu_cost_real(ns)\":%" PRIu64,
+                    t->call_count, t->cpu_cost_raw, t->cpu_cost_real);
+                if (PROFILE_MODE_ON == snap->mem_profile_mode) {
+                    fprintf(fp, ",\"alloc_bytes\":%" PRIu64 ",\"free_bytes\":%" PRIu64 ",\"alloc_times\":%" PRIu64,
+                        t->alloc_bytes, t->free_bytes, t->alloc_times);
+                }
+                fputc('}', fp);
+            }
+            fputc(']', fp);
+        }
+    }
+}
+
+static void _write_json_tree(FILE* fp, struct icallpath_context* callpath, const struct dump_snapshot* snap) {
+    struct dump_walker w;
+    _dump_walker_init(&w, &snap->prune, callpath);
+    struct dump_walk_entry e;
+    uint64_t children_cost = 0;
+    while (_dump_walker_pop(&w, &e)) {
+        if (e.close) {
+            fputs(e.has_children ? "]}" : "}", fp);
+            continue;
+        }
+        if (e.index > 1) fputc(',', fp);
+        _write_json_node(fp, e.node, snap);
+        // 先压闭合标记，子节点出栈写完后才轮到它
+        size_t close_at = _dump_walker_push(&w, e.path, e.node, e.depth, e.index);
+        w.stack[close_at].close = true;
+        if (_dump_walker_expand(&w, &e, &children_cost) > 0) {
+            w.stack[close_at].has_children = true;
+            fputs(",\"children\":[", fp);
+        }
+    }
+    _dump_walker_free(&w);
+}
+
+// folded stacks 格式（flamegraph.pl / speedscope 可直接读取）：每个节点一行 "root;f1;f2 self_ns"
+static void _write_folded_tree(FILE* fp, struct icallpath_context* callpath, const struct dump_snapshot* snap) {
+    char* stack = NULL;     // 当前路径 "root;f1;f2"
+    size_t cap = 0;
+    size_t* prefix = NULL;  // prefix[d] 为深度 d 的节点的父路径长度
+    size_t prefix_cap = 0;
+
+    struct dump_walker w;
+    _dump_walker_init(&w, &snap->prune, callpath);
+    struct dump_walk_entry e;
+    uint64_t children_cost = 0;
+    while (_dump_walker_pop(&w, &e)) {
+        if ((size_t)e.depth + 2 > prefix_cap) {
+            prefix_cap = prefix_cap ? prefix_cap * 2 : 64;
+            while (prefix_cap < (size_t)e.depth + 2) prefix_cap *= 2;
+            prefix = (size_t*)prealloc(prefix, sizeof(size_t) * prefix_cap);
+        }
+        char name[512] = {0};
+        _format_node_name(e.node, name, sizeof(name));
+        for (char* c = name; *c; c++) {
+            if (*c == ';') *c = ',';
+        }
+        size_t start = e.depth > 0 ? prefix[e.depth] : 0;
+        size_t name_len = strlen(name);
+        size_t len = start + (e.depth > 0 ? 1 : 0) + name_len;
+        if (len + 1 > cap) {
+            while (cap < len + 1) cap = cap ? cap * 2 : 1024;
+            stack = (char*)prealloc(stack, cap);
+        }
+        if (e.depth > 0) stack[start++] = ';';
+        memcpy(stack + start, name, name_len);
+        stack[len] = '\0';
+        prefix[e.depth + 1] = len;
+
+        _dump_walker_expand(&w, &e, &children_cost);
+        uint64_t self_cost = safe_u64_minus(e.node->cpu_cost_raw, children_cost);
+        if (self_cost > 0) {
+            fprintf(fp, "%s %" PRIu64 "\n", stack, self_cost);
+        }
+    }
+    _dump_walker_free(&w);
+    pfree(prefix);
+    pfree(stack);
+}
+
+enum DUMP_FORMAT {
+    DUMP_FORMAT_JSON,       // 与 dump 返回的 table 同样的节点格式：{ start_time, duration_seconds, nodes }
+    DUMP_FORMAT_FOLDED,     // folded stacks，每行 "root;f1;f2 self_ns"
+};
+
+static bool parse_dump_format(const char* s, int* out_fmt) {
+    if (strcmp(s, "json") == 0) *out_fmt = DUMP_FORMAT_JSON;
+    else if (strcmp(s, "folded") == 0) *out_fmt = DUMP_FORMAT_FOLDED;
+    else return false;
+    return true;
+}
+
+// 把已经准备好（见 prepare_call_path）的调用树写到文件，不访问 lua_State 和 profile_context，可以在其他线程执行
+static bool write_profile_file(FILE* fp, int fmt, struct icallpath_context* callpath, const struct dump_snapshot* snap,
+    const char* start_time, double duration) {
+    if (DUMP_FORMAT_FOLDED == fmt) {
+        _write_folded_tree(fp, callpath, snap);
+    } else {
+        fputs("{\"start_time\":", fp);
+        _write_json_string(fp, start_time);
+        fprintf(fp, ",\"duration_seconds\":%.17g,\"nodes\":", duration);
+        _write_json_tree(fp, callpath, snap);
+        fputs("}\n", fp);
+    }
+    return ferror(fp) == 0;
+}
+
+// 把 mono 时间点换算成本地时间字符串 "YYYY-MM-DD HH:MM:SS"
+static void format_mono_time(uint64_t mono_ns, char* buf, size_t sz) {
+    time_t now = time(NULL);
+    time_t t = now - (time_t)(safe_u64_minus(get_mono_ns(), mono_ns) / NANOSEC);
+    struct tm tm_buf;
+    localtime_r(&t, &tm_buf);
+    strftime(buf, sz, "%Y-%m-%d %H:%M:%S", &tm_buf);
+}
+
+/*
+swap_dump 的后台任务：VM 线程上只做 O(1) 的树交换，增量计算和写文件都在工作线程完成。
+工作线程只访问被换下来的旧树和已经解析好的符号，写完后释放旧树。
+*/
+struct dump_job {
+    pthread_t   thread;
+    bool        threaded;
+    int         finished;   // 工作线程结束后置 1，原子访问
+    bool        ok;
+    int         fmt;
+    FILE*       fp;
+    struct icallpath_context* callpath;
+    struct dump_snapshot snap;
+    char        start_time[32];
+    double      duration;
+};
+
+static void* _dump_job_main(void* ud) {
+    struct dump_job* job = (struct dump_job*)ud;
+    prepare_call_path(job->callpath, &job->snap);
+    job->ok = write_profile_file(job->fp, job->fmt, job->callpath, &job->snap, job->start_time, job->duration);
+    if (fclose(job->fp) != 0) job->ok = false;
+    job->fp = NULL;
+    free_dump_snapshot(&job->snap);
+    callpath_free(job->callpath);
+    job->callpath = NULL;
+    __atomic_store_n(&job->finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static bool dump_job_wait(struct profile_context* context) {
+    struct dump_job* job = context->dump_job;
+    if (!job) return true;
+    if (job->threaded) {
+        pthread_join(job->thread, NULL);
+    }
+    bool ok = job->ok;
+    pfree(job);
+    context->dump_job = NULL;
+    return ok;
+}
+
+struct heap_snapshot_arg {
+    uint32_t epoch;
+};
+
+// 把 alloc_map 中当前周期仍存活的块汇总到所属节点，只在 dump_async 的子进程中调用，会改写节点
+static void
+_ob_heap_snapshot(uint64_t key, void* value, void* ud) {
+    (void)key;
+    struct heap_snapshot_arg* arg = (struct heap_snapshot_arg*)ud;
+    struct alloc_node* an = (struct alloc_node*)value;
+    if (!an->path || an->epoch != arg->epoch) return;
+    an->path->heap_bytes += an->live_bytes;
+    an->path->heap_blocks++;
+}
+
+
+struct collect_func_arg {
+    struct func_stat** list;
+    size_t count;
+};
+
+static void _collect_func(uint64_t key, void* value, void* ud) {
+    (void)key;
+    struct collect_func_arg* arg = (struct collect_func_arg*)ud;
+    arg->list[arg->count++] = (struct func_stat*)value;
+}
+
+static int _cmp_func_self_desc(const void* a, const void* b) {
+    const struct func_stat* fa = *(const struct func_stat* const*)a;
+    const struct func_stat* fb = *(const struct func_stat* const*)b;
+    if (fa->cpu_cost_self == fb->cpu_cost_self) return 0;
+    return fa->cpu_cost_self > fb->cpu_cost_self ? -1 : 1;
+}
+
+struct dump_edge_arg {
+    lua_State* L;
+    uint64_t index;
+};
+
+static void _dump_graph_edge(uint64_t key, void* value, void* ud) {
+    (void)key;
+    struct dump_edge_arg* arg = (struct dump_edge_arg*)ud;
+    struct graph_edge* edge = (struct graph_edge*)value;
+    lua_State* L = arg->L;
+    lua_newtable(L);
+    lua_pushinteger(L, edge->caller->id);
+    lua_setfield(L, -2, "caller");
+    lua_pushinteger(L, edge->callee->id);
+    lua_setfield(L, -2, "callee");
+    lua_pushinteger(L, edge->call_count);
+    lua_setfield(L, -2, "call_count");
+    lua_pushinteger(L, edge->cpu_cost);
+    lua_setfield(L, -2, "cpu_cost(ns)");
+    lua_seti(L, -2, ++arg->index);
+}
+
+// graph 模式导出：{ functions = { {id, name, ...}, ... }, edges = { {caller, callee, ...}, ... } }
+// functions 按 self 耗时降序排列，edges 中的 caller/callee 是 functions 中的 id
+static void dump_call_graph(struct profile_context* pcontext, lua_State* L) {
+    lua_checkstack(L, 6);
+    lua_newtable(L);
+
+    struct collect_func_arg arg;
+    arg.count = 0;
+    arg.list = (struct func_stat**)pmalloc(sizeof(struct func_stat*) * (imap_size(pcontext->func_map) + 1));
+    imap_dump(pcontext->func_map, _collect_func, &arg);
+    qsort(arg.list, arg.count, sizeof(struct func_stat*), _cmp_func_self_desc);
+
+    lua_createtable(L, (int)arg.count, 0);
+    for (size_t i = 0; i < arg.count; i++) {
+        struct func_stat* fs = arg.list[i];
+        struct symbol_info* si = fs->sym;
+        fs->id = (int)(i + 1);
+        lua_newtable(L);
+        lua_pushinteger(L, fs->id);
+        lua_setfield(L, -2, "id");
+        char name[512] = {0};
+        snprintf(name, sizeof(name)-1, "%s %s:%d", si && si->name ? si->name : "", si && si->source ? si->source : "", si ? si->line : 0);
+        lua_pushstring(L, name);
+        lua_setfield(L, -2, "name");
+        lua_pushinteger(L, fs->call_count);
+        lua_setfield(L, -2, "call_count");
+        lua_pushinteger(L, fs->cpu_cost_self);
+        lua_setfield(L, -2, "cpu_cost_self(ns)");
+        lua_pushinteger(L, fs->cpu_cost_incl);
+        lua_setfield(L, -2, "cpu_cost_incl(ns)");
+        lua_seti(L, -2, fs->id);
+    }
+    lua_setfield(L, -2, "functions");
+
+    struct dump_edge_arg edge_arg;
+    edge_arg.L = L;
+    edge_arg.index = 0;
+    lua_newtable(L);
+    for (size_t i = 0; i < arg.count; i++) {
+        if (arg.list[i]->callees) {
+            imap_dump(arg.list[i]->callees, _dump_graph_edge, &edge_arg);
+        }
+    }
+    lua_setfield(L, -2, "edges");
+    pfree(arg.list);
+
+    lua_pushinteger(L, pcontext->profiler_cpu_cost_total);
+    lua_setfield(L, -2, "profiler_cpu_cost_total(ns)");
+    lua_pushinteger(L, pcontext->cpu_call_count_total);
+    lua_setfield(L, -2, "cpu_call_count_total");
+}
+
+static inline bool
+is_profile_hook(lua_Hook hook) {
+    return hook == _hook_call_count || hook == _hook_call_time || hook == _hook_call_full;
+}
+
+static void
+_ob_hook_thread(lua_State* co, void* ud) {
+    lua_sethook(co, ((struct profile_context*)ud)->hook, LUA_MASKCALL | LUA_MASKRET, 0);
+}
+
+// 只摘掉本模块装上的 hook，宿主或调试器自己的 hook 保持不变
+static void
+_ob_unhook_thread(lua_State* co, void* ud) {
+    (void)ud;
+    if (is_profile_hook(lua_gethook(co))) {
+        lua_sethook(co, NULL, 0, 0);
+    }
+}
+
+// 开销调节切换级别时换掉本模块装上的 hook，unmark 过的协程和宿主自己的 hook 不动；去掉 line mask，需要时由 update_line_hook 重新打开
+static void
+_ob_switch_hook(lua_State* co, void* ud) {
+    if (is_profile_hook(lua_gethook(co))) {
+        lua_sethook(co, ((struct profile_context*)ud)->hook, LUA_MASKCALL | LUA_MASKRET, 0);
+    }
+}
+
+struct retime_arg {
+    struct profile_context* context;
+    uint64_t now;
+};
+
+// 从 count 级别升到计时级别：栈上的帧在 count 级别下没有计时，从 now 重新开始，其他协程按从 now 开始挂起处理
+static void
+_ob_retime_call_state(uint64_t key, void* value, void* ud) {
+    (void)key;
+    struct retime_arg* arg = (struct retime_arg*)ud;
+    struct call_state* cs = (struct call_state*)value;
+    for (int i = 0; i < cs->top; i++) {
+        struct call_frame* frame = &cs->call_list[i];
+        frame->call_time = arg->now;
+        frame->co_cost = 0;
+        frame->child_cost = 0;
+        frame->line = 0;
+        frame->line_co_cost = 0;
+        frame_counters_begin(arg->context, frame, arg->context->ctr_now);
+    }
+    cs->leave_time = (cs == arg->context->cur_cs) ? 0 : arg->now;
+    memcpy(cs->leave_ctr, arg->context->ctr_now, sizeof(cs->leave_ctr));
+}
+
+static void
+governor_set_rung(struct profile_context* context, lua_State* L, int rung, uint64_t now) {
+    int old_level = context->gov_rungs[context->gov_rung];
+    bool was_sampling = governor_sampling(context);
+    context->gov_rung = rung;
+    context->gov_level_changes++;
+    if (was_sampling) profile_resume(context, PAUSE_GOVERNOR, now);
+    context->gov_phase = 0;
+    int level = context->gov_rungs[rung];
+    context->hook = level_hook(level);
+    foreach_thread(L, _ob_switch_hook, context);
+    if (PROFILE_LEVEL_COUNT == old_level && PROFILE_LEVEL_COUNT != level) {
+        counters_sample(context);
+        struct retime_arg arg = {context, now};
+        imap_dump(context->cs_map, _ob_retime_call_state, &arg);
+    }
+}
+
+/*
+开销调节：每 GOVERNOR_CHECK_EVENTS 个 hook 事件读一次时钟，每 GOVERNOR_INTERVAL_NS 评估一次 hook 开销占比。
+计时级别按 profiler_cpu_cost_total 实测，并更新单次事件开销的估计；count 级别不读时钟，按事件数乘估计值推算（偏保守）。
+超过 max_overhead_percent 时降一级：配置的级别 -> time -> count -> count 加时间片采样（每 GOVERNOR_SAMPLE_PERIOD 个区间只统计一个，
+其余区间按 pause 处理）；推算的上一级开销低于上限的一半时升一级。
+开启内存 profile 时 alloc hook 每 GOVERNOR_ALLOC_SAMPLE 次计时一次，按次数放大后一起计入；time 及以下的级别不记录新的分配。
+*/
+static void
+governor_poll(struct profile_context* context, lua_State* L) {
+    context->gov_interval_events += context->gov_events;
+    context->gov_events = 0;
+    uint64_t now = get_mono_ns();
+    // count 级别和采样区间里 hook 不读时钟，借这里的读数推进时间窗口
+    if (context->windows) window_tick(context, now);
+    uint64_t elapsed = safe_u64_minus(now, context->gov_interval_start);
+    if (elapsed < GOVERNOR_INTERVAL_NS) return;
+
+    bool sampling = governor_sampling(context);
+    bool timed = !sampling && PROFILE_LEVEL_COUNT != context->gov_rungs[context->gov_rung];
+    uint64_t events = context->gov_interval_events;
+    // 计时 hook 处理全部事件的开销占比
+    double predicted = (double)events * context->gov_event_cost * 100.0 / (double)elapsed;
+    double current = sampling ? predicted / GOVERNOR_SAMPLE_PERIOD : predicted;
+    if (timed) {
+        uint64_t hook_ns = safe_u64_minus(context->profiler_cpu_cost_total, context->gov_cost_mark);
+        current = (double)hook_ns * 100.0 / (double)elapsed;
+        if (events > 0) {
+            context->gov_event_cost = (context->gov_event_cost + (double)hook_ns / (double)events) / 2;
+        }
+    }
+    // alloc hook 的开销按抽样实测计入；不统计内存的级别下 alloc hook 只处理释放，升到统计内存的级别时按单次估计推算
+    uint64_t alloc_events = context->gov_alloc_events;
+    double alloc_current = (double)context->gov_alloc_cost * 100.0 / (double)elapsed;
+    if (active_level(context) >= PROFILE_LEVEL_TIME_MEM && alloc_events > 0) {
+        context->gov_alloc_event_cost = (context->gov_alloc_event_cost + (double)context->gov_alloc_cost / (double)alloc_events) / 2;
+    }
+    current += alloc_current;
+
+    int rung = context->gov_rung;
+    if (rung > 0) {
+        bool up_tracks_mem = context->gov_rungs[rung - 1] >= PROFILE_LEVEL_TIME_MEM;
+        predicted += up_tracks_mem ? (double)alloc_events * context->gov_alloc_event_cost * 100.0 / (double)elapsed : alloc_current;
+    }
+    if (current > context->max_overhead_percent && rung + 1 < context->gov_rung_count) {
+        governor_set_rung(context, L, rung + 1, now);
+    } else if (rung > 0 && predicted < context->max_overhead_percent / 2) {
+        governor_set_rung(context, L, rung - 1, now);
+    } else if (sampling) {
+        context->gov_phase++;
+        if (context->gov_phase % GOVERNOR_SAMPLE_PERIOD == 0) {
+            profile_resume(context, PAUSE_GOVERNOR, now);
+        } else {
+            profile_pause(context, PAUSE_GOVERNOR, now);
+        }
+    }
+    context->gov_interval_start = now;
+    context->gov_interval_events = 0;
+    context->gov_cost_mark = context->profiler_cpu_cost_total;
+    context->gov_alloc_events = 0;
+    context->gov_alloc_cost = 0;
+}
+
+static int _stop_gc_if_need(lua_State* L) {
+    // stop gc before set hook
+    int gc_was_running = lua_gc(L, LUA_GCISRUNNING, 0);
+    if (gc_was_running) { lua_gc(L, LUA_GCSTOP, 0); }
+    return gc_was_running;
+}
+
+static void _restart_gc_if_need(lua_State* L, int gc_was_running) {
+    if (gc_was_running) { lua_gc(L, LUA_GCRESTART, 0); }
+}
+
+
+static const char* calibrate_chunk =
+    "local mode, n, cfunc = ...\n"
+    "local function empty() end\n"
+    "local function tail() return empty() end\n"
+    "if mode == 1 then for i = 1, n do empty() end\n"
+    "elseif mode == 2 then for i = 1, n do cfunc() end\n"
+    "elseif mode == 3 then for i = 1, n do tail() end\n"
+    "else\n"
+    "    local co = coroutine.wrap(function() while true do coroutine.yield() end end)\n"
+    "    for i = 1, n do co() end\n"
+    "end\n";
+
+static int _calibrate_cfunc(lua_State* L) {
+    (void)L;
+    return 0;
+}
+
+// 在 co 上跑 CALIBRATE_REPEAT 次微基准，返回最短耗时，出错返回 0
+static uint64_t
+_calibrate_run(lua_State* co, int mode, bool hooked) {
+    uint64_t best = 0;
+    for (int r = 0; r < CALIBRATE_REPEAT; r++) {
+        lua_sethook(co, hooked ? _hook_call_full : NULL, hooked ? (LUA_MASKCALL | LUA_MASKRET) : 0, 0);
+        lua_pushvalue(co, 1);
+        lua_pushinteger(co, mode);
+        lua_pushinteger(co, CALIBRATE_LOOPS);
+        lua_pushcfunction(co, _calibrate_cfunc);
+        uint64_t t0 = get_mono_ns();
+        int ret = lua_pcall(co, 3, 0, 0);
+        uint64_t cost = get_mono_ns() - t0;
+        lua_sethook(co, NULL, 0, 0);
+        if (ret != LUA_OK) {
+            lua_pop(co, 1);
+            return 0;
+        }
+        if (best == 0 || cost < best) best = cost;
+    }
+    return best;
+}
+
+/*
+启动时校准 hook 开销：在临时 context 下分别跑有无 hook 的微基准（空 lua 函数、空 c 函数、尾调用、协程 resume/yield），
+差值除以循环次数即每类事件引入的开销。每次协程 resume/yield 包含两次 c 函数调用和两次协程切换。
+*/
+static bool
+calibrate_overhead(lua_State* L, double* cost, bool extraspace, const struct perf_counters* counters) {
+    struct profile_context* tmp = profile_create();
+    // 和正式统计一样在每次事件中读计数器，读计数器的开销（没有 rdpmc 时是一次 read 系统调用）计入各类事件的开销
+    tmp->counters = *counters;
+    tmp->start_time = get_mono_ns();
+    tmp->epoch_start_time = tmp->start_time;
+    tmp->is_ready = true;
+    tmp->use_extraspace = extraspace_available(L, extraspace);
+    int gc_was_running = _stop_gc_if_need(L);
+    set_profile_context(L, tmp);
+
+    lua_State* co = lua_newthread(L);
+    bool ok = luaL_loadstring(co, calibrate_chunk) == LUA_OK;
+    double per_loop[4] = {0};
+    for (int mode = 1; ok && mode <= 4; mode++) {
+        uint64_t base = _calibrate_run(co, mode, false);
+        uint64_t hooked = _calibrate_run(co, mode, true);
+        if (base == 0 || hooked == 0) {
+            // 没有 coroutine 库时只跳过协程一项
+            if (mode < 4) ok = false;
+            continue;
+        }
+        per_loop[mode - 1] = (double)safe_u64_minus(hooked, base) / CALIBRATE_LOOPS;
+    }
+    lua_pop(L, 1);
+
+    release_extraspace(L, tmp);
+    unset_profile_context(L);
+    init_perf_counters(&tmp->counters);     // 计数器留给正式的 context，这里不关闭
+    profile_free(tmp);
+    _restart_gc_if_need(L, gc_was_running);
+    if (!ok) return false;
+
+    cost[OVH_LUA_CALL] = per_loop[0];
+    cost[OVH_C_CALL] = per_loop[1];
+    cost[OVH_TAIL_CALL] = per_loop[2] > per_loop[0] ? per_loop[2] - per_loop[0] : 0;
+    cost[OVH_CO_SWITCH] = per_loop[3] > 2 * per_loop[1] ? (per_loop[3] - 2 * per_loop[1]) / 2 : 0;
+    cost[OVH_FIRST_VISIT] = 0;
+    return true;
+}
+
+static int
+lstart(lua_State* L) {
+    struct profile_context* context = get_profile_context(L);
+    if (context != NULL) {
+        printf("ERROR: start fail, profile already started\n");
+        return 0;
+    }
+
+    // parse options: start([opts]), opts is a table like: { level = "count|time|time+mem|full", mem_profile = "off|on", structure = "tree|graph", fold_recursion = false, merge_reloads = false,
+    //                                                       include = {...}, exclude = {...}, skip_c_functions = false, calibrate = true }
+    // level 为统计级别（默认 full，此时是否统计内存仍由 mem_profile 决定），指定时覆盖 mem_profile：count 只统计调用次数，time 加上 cpu 耗时，time+mem 再加上内存 profile，
+    // full 再加上分类校准的开销扣除和逐行统计；每个级别安装各自特化的 hook
+    // mem_profile 为 off 表示不需要内存 profile，为 on 表示需要内存 profile
+    // structure 为 tree 表示完整调用树，为 graph 表示按函数聚合的调用图（graph 模式不支持内存 profile）
+    // fold_recursion 为 true 时，tree 模式下直接和间接递归都折叠回路径上已有的祖先节点
+    // merge_reloads 为 true 时，热更新重新加载的同一函数（source/linedefined/lastlinedefined 相同）合并到同一节点
+    // include/exclude 为 source 子串列表，skip_c_functions 为 true 时过滤所有 c 函数；被过滤的函数不建帧，耗时计入最近的未过滤祖先
+    // calibrate 为 true（默认）时启动前校准各类 hook 事件的开销，cpu_cost_real 按节点的事件构成扣除
+    // max_tags 为 set_tag 可用的最多 tag 数（默认 256），超出后新的 tag 都归到 [other]
+    // max_overhead_percent 大于 0 时，hook 开销占比超过该值就自动降低统计级别，直到 count 加时间片采样，负载降下来后再逐级恢复，见 governor_poll
+    // instrument 为 false 时 mark/mark_all 不装 call/ret hook，只统计 zone_begin/zone_end 标出的区域，也不做开销校准
+    // extraspace 为 true 表示宿主不使用 lua_getextraspace，协程切换时直接从中取 call_state，省去一次 cs_map 查询（默认 false）
+    // windows 大于 0 时，节点额外保留最近 windows 个、每个 window_seconds 秒（默认 60）的统计，供 window_dump 查询（tree 结构，level 不低于 time）
+    // counters 为 perf 计数器名字列表（最多 MAX_COUNTERS 个，见 counter_defs），按调用路径累计 incl 增量，扣除 co yield 期间的部分（tree 结构，level 不低于 time）
+    struct profile_options opts;
+    init_profile_options(&opts);
+    bool read_ok = read_arg(L, &opts);
+    if (!read_ok) {
+        free_profile_options(&opts);
+        printf("ERROR: start fail, invalid options\n");
+        return 0;
+    }
+    if (PROFILE_STRUCTURE_GRAPH == opts.structure && PROFILE_MODE_ON == opts.mem_profile_mode) {
+        printf("WARNING: mem_profile is not supported in graph structure, ignored\n");
+        opts.mem_profile_mode = PROFILE_MODE_OFF;
+    }
+    int mem_profile_mode = opts.mem_profile_mode;
+
+    // full gc before start, make mem profile more accurate
+    if (PROFILE_MODE_ON == mem_profile_mode) {
+        lua_gc(L, LUA_GCCOLLECT, 0);  
+    }
+
+    // 计数器在校准前打开，校准出的事件开销包含读计数器的开销
+    struct perf_counters counters;
+    init_perf_counters(&counters);
+    if (opts.counter_count > 0) {
+        if (PROFILE_STRUCTURE_GRAPH == opts.structure || PROFILE_LEVEL_COUNT == opts.level) {
+            printf("WARNING: counters need tree structure and a timed level, ignored\n");
+        } else {
+            open_perf_counters(&counters, opts.counters, opts.counter_count);
+        }
+    }
+
+    double overhead_cost[OVH_CLASS_COUNT] = {0};
+    bool calibrate = opts.calibrate && opts.instrument && PROFILE_LEVEL_FULL == opts.level;
+    bool calibrated = calibrate && calibrate_overhead(L, overhead_cost, opts.extraspace, &counters);
+    if (calibrate && !calibrated) {
+        printf("WARNING: overhead calibration fail, fall back to average overhead per call\n");
+    }
+
+    context = profile_create();
+    context->running_in_hook = true;
+    context->level = opts.level;
+    context->hook = level_hook(opts.level);
+    context->calibrated = calibrated;
+    memcpy(context->overhead_cost, overhead_cost, sizeof(overhead_cost));
+    context->start_time = get_mono_ns();
+    context->epoch_start_time = context->start_time;
+    context->is_ready = true;
+    context->mem_profile_mode = mem_profile_mode;
+    context->structure = opts.structure;
+    context->fold_recursion = opts.fold_recursion;
+    context->merge_reloads = opts.merge_reloads;
+    context->skip_c_functions = opts.skip_c_functions;
+    context->include = opts.include;
+    context->exclude = opts.exclude;
+    context->filtering = opts.skip_c_functions || opts.include.count > 0 || opts.exclude.count > 0;
+    context->max_tags = opts.max_tags;
+    context->instrument = opts.instrument;
+    if (opts.windows > 0) {
+        if (PROFILE_STRUCTURE_GRAPH == opts.structure || PROFILE_LEVEL_COUNT == opts.level) {
+            printf("WARNING: windows need tree structure and a timed level, ignored\n");
+        } else {
+            context->windows = opts.windows;
+            context->window_ns = (uint64_t)opts.window_seconds * NANOSEC;
+            context->window_seq = 1;
+            context->window_next_time = context->start_time + context->window_ns;
+            context->window_paused = (struct window_pause*)pcalloc(context->windows, sizeof(struct window_pause));
+        }
+    }
+    context->counters = counters;
+    if (context->counters.count > 0) {
+        read_perf_counters(&context->counters, context->ctr_now);
+        memcpy(context->ctr_epoch, context->ctr_now, sizeof(context->ctr_epoch));
+    }
+    if (opts.max_overhead_percent > 0) {
+        // 可用的级别从高到低，hook 相同、也都不统计内存的级别只留一个；time 及以下的级别不统计内存
+        context->max_overhead_percent = opts.max_overhead_percent;
+        int n = 0;
+        context->gov_rungs[n++] = opts.level;
+        if (opts.level > PROFILE_LEVEL_TIME
+            && (level_hook(opts.level) != level_hook(PROFILE_LEVEL_TIME) || PROFILE_MODE_ON == mem_profile_mode)) {
+            context->gov_rungs[n++] = PROFILE_LEVEL_TIME;
+        }
+        if (opts.level > PROFILE_LEVEL_COUNT) {
+            context->gov_rungs[n++] = PROFILE_LEVEL_COUNT;
+        }
+        context->gov_rungs[n++] = PROFILE_LEVEL_COUNT;
+        context->gov_rung_count = n;
+        context->gov_interval_start = context->start_time;
+        context->gov_event_cost = calibrated ? overhead_cost[OVH_LUA_CALL] / 2 : GOVERNOR_DEFAULT_EVENT_NS;
+    }
+    context->use_extraspace = extraspace_available(L, opts.extraspace);
+    if (opts.extraspace && !context->use_extraspace) {
+        printf("WARNING: lua extra space is in use or too small, extraspace ignored\n");
+    }
+    context->last_alloc_f = lua_getallocf(L, &context->last_alloc_ud);
+    if (PROFILE_MODE_ON == mem_profile_mode) {
+        lua_setallocf(L, _hook_alloc, context);
+    }
+    set_profile_context(L, context);
+    // 弱值表：只用来判断 dump 时 Proto 是否还存活，不阻止热更新后旧函数被回收
+    lua_pushlightuserdata(L, &profile_anchor_key);
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushstring(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    lua_pushlightuserdata(L, &profile_tag_key);
+    lua_newtable(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    lua_pushlightuserdata(L, &profile_zone_key);
+    lua_newtable(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    context->running_in_hook = false;
+    
+    printf("luaprofile started, level = %d, mem_profile_mode = %d, last_alloc_ud = %p\n", context->level, context->mem_profile_mode, context->last_alloc_ud);    
+    return 0;
+}
+
+static int
+lstop(lua_State* L) {
+    struct profile_context* context = get_profile_context(L);
+    if (context == NULL) {
+        printf("stop fail, profile not started\n");
+        return 0;
+    }
+
+    context->running_in_hook = true;
+    context->is_ready = false;
+    lua_setallocf(L, context->last_alloc_f, context->last_alloc_ud);
+    unset_profile_context(L);
+    lua_pushlightuserdata(L, &profile_anchor_key);
+    lua_pushnil(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    lua_pushlightuserdata(L, &profile_tag_key);
+    lua_pushnil(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    lua_pushlightuserdata(L, &profile_zone_key);
+    lua_pushnil(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    release_extraspace(L, context);
+    dump_job_wait(context);
+    profile_free(context);
+    context = NULL;
+    printf("luaprofile stopped\n");
+    return 0;
+}
+
+static int
+lmark(lua_State* L) {
+    struct profile_context* context = get_profile_context(L);
+    if (context == NULL) {
+        printf("mark fail, profile not started\n");
+        return 0;
+    }
+    lua_State* co = lua_tothread(L, 1);
+    if(co == NULL) {
+        co = L;
+    }
+    bool hooked = context->is_ready && context->instrument;
+    if (hooked) {
+        lua_sethook(co, context->hook, LUA_MASKCALL | LUA_MASKRET, 0);
+    }
+    lua_pushboolean(L, hooked);
+    return 1;
+}
+
+static int
+lunmark(lua_State* L) {
+    struct profile_context* context = get_profile_context(L);
+    if (context == NULL) {
+        printf("unmark fail, profile not started\n");
+        return 0;
+    }
+    lua_State* co = lua_tothread(L, 1);
+    if(co == NULL) {
+        co = L;
+    }
+    _ob_unhook_thread(co, NULL);
+    return 0;
+}
+
+static int
+lmark_all(lua_State* L) {
+    struct profile_context* ctx = get_profile_context(L);
+    if (!ctx) {
+        printf("mark all co fail, profile not started\n");
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "profile not started");
+        return 2;
+    }
+    // 只用 zone 统计时不装 hook
+    if (!ctx->instrument) {
+        lua_pushboolean(L, true);
+        lua_pushinteger(L, 0);
+        return 2;
+    }
+    // 已有的协程在这里一次装上 hook；之后新建的协程由 lua_newthread 从创建它的协程继承 hook，不需要 lua 侧包装
+    size_t n = foreach_thread(L, _ob_hook_thread, ctx);
+    lua_pushboolean(L, true);
+    lua_pushinteger(L, (lua_Integer)n);
+    return 2;
+}
+
+static int 
+lunmark_all(lua_State* L) {
+    struct profile_context* ctx = get_profile_context(L);
+    if (!ctx) {
+        printf("unhook all co fail, profile not started\n");
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "profile not started");
+        return 2;
+    }
+    size_t n = foreach_thread(L, _ob_unhook_thread, NULL);
+    lua_pushboolean(L, true);
+    lua_pushinteger(L, (lua_Integer)n);
+    return 2;
+}
+
+// pause()：暂停统计，调用树、符号、alloc_map 和协程栈都保留。hook 不卸载，只检查 paused 标记就返回；
+// 内存 hook 不记新的分配，只处理已记录块的释放
+static int
+lpause(lua_State* L) {
+    struct profile_context* context = get_profile_context(L);
+    if (!context) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "profile not started");
+        return 2;
+    }
+    if (context->paused & PAUSE_USER) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "already paused");
+        return 2;
+    }
+    profile_pause(context, PAUSE_USER, get_mono_ns());
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+// resume()：恢复统计。pause 的时长不计入 duration 和跨越 pause 的帧的耗时，
+// 协程栈在各自下次触发 hook 时通过 resync_call_state 对齐
+static int
+lresume(lua_State* L) {
+    struct profile_context* context = get_profile_context(L);
+    if (!context) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "profile not started");
+        return 2;
+    }
+    if (!(context->paused & PAUSE_USER)) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "not paused");
+        return 2;
+    }
+    profile_resume(context, PAUSE_USER, get_mono_ns());
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+// dump([opts])：opts 为导出参数 { min_percent = 1.0, min_ns = 1000000, top_children = 20 }，见 dump_prune
+static int
+ldump(lua_State* L) {
+    struct profile_context* context = get_profile_context(L);
+    if (context) {
+        struct dump_prune prune;
+        if (!read_dump_prune(L, 1, &prune)) {
+            printf("ERROR: dump fail, invalid options\n");
+            return 0;
+        }
+
+        // update root cpu cost
+        if (context->callpath) {
+            struct callpath_node* root = (struct callpath_node*)icallpath_getvalue(context->callpath);
+            root->cpu_cost_raw = epoch_active_ns(context, get_mono_ns());
+        }
+
+        // full gc to free objects, make mem profile more accurate
+        if (PROFILE_MODE_ON ==context->mem_profile_mode) {
+            lua_gc(L, LUA_GCCOLLECT, 0);
+        }
+
+        // stop gc before dump
+        int gc_was_running = _stop_gc_if_need(L); 
+        context->running_in_hook = true;
+
+        uint64_t cur_time = get_mono_ns();
+        double profile_duration = epoch_active_ns(context, cur_time)*1.0/NANOSEC;
+        lua_pushnumber(L, profile_duration);
+
+        // dump
+        if (PROFILE_STRUCTURE_GRAPH == context->structure) {
+            resolve_symbols(context, L);
+            dump_call_graph(context, L);
+        } else if (context->callpath) {
+            resolve_symbols(context, L);
+            dump_call_path(context, L, &prune);
+        } else {
+            lua_newtable(L);
+        }
+
+        context->running_in_hook = false;
+        _restart_gc_if_need(L, gc_was_running);
+        return 2;
+    }
+    return 0;
+}
+
+#define DUMP_JSON_BUFFER_SIZE (256*1024)
+
+/*
+dump_json(target [, opts])：把调用树按 dump 的节点格式（{ start_time, duration_seconds, nodes }）直接从 C 写成 json，
+不构造 lua table。target 可以是文件路径、文件描述符或 io 打开的文件句柄；路径由这里打开和关闭，
+描述符会先 dup，句柄只 flush 不关闭。写出经过一个大的 stdio 缓冲，opts 与 dump 相同。只支持 tree 结构。
+*/
+static int
+ldump_json(lua_State* L) {
+    struct profile_context* context = get_profile_context(L);
+    if (!context) {
+        printf("dump json fail, profile not started\n");
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "profile not started");
+        return 2;
+    }
+    struct dump_prune prune;
+    if (!read_dump_prune(L, 2, &prune)) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "invalid dump options");
+        return 2;
+    }
+    if (PROFILE_STRUCTURE_TREE != context->structure) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "dump_json only supports tree structure");
+        return 2;
+    }
+
+    FILE* fp = NULL;
+    bool owned = true;
+    luaL_Stream* stream = (luaL_Stream*)luaL_testudata(L, 1, LUA_FILEHANDLE);
+    if (stream) {
+        if (!stream->closef || !stream->f) {
+            lua_pushboolean(L, false);
+            lua_pushstring(L, "attempt to use a closed file");
+            return 2;
+        }
+        fp = stream->f;
+        owned = false;
+    } else if (lua_type(L, 1) == LUA_TNUMBER) {
+        int fd = (int)luaL_checkinteger(L, 1);
+        int dup_fd = dup(fd);
+        if (dup_fd < 0 || !(fp = fdopen(dup_fd, "w"))) {
+            if (dup_fd >= 0) close(dup_fd);
+            lua_pushboolean(L, false);
+            lua_pushfstring(L, "open fd %d fail: %s", fd, strerror(errno));
+            return 2;
+        }
+    } else {
+        const char* path = luaL_checkstring(L, 1);
+        fp = fopen(path, "w");
+        if (!fp) {
+            lua_pushboolean(L, false);
+            lua_pushfstring(L, "open %s fail: %s", path, strerror(errno));
+            return 2;
+        }
+    }
+    // 自己打开的文件换成大缓冲，外部句柄已经可能有缓冲的数据，不能再 setvbuf
+    char* buffer = NULL;
+    if (owned) {
+        buffer = (char*)pmalloc(DUMP_JSON_BUFFER_SIZE);
+        setvbuf(fp, buffer, _IOFBF, DUMP_JSON_BUFFER_SIZE);
+    }
+
+    // full gc to free objects, make mem profile more accurate
+    if (PROFILE_MODE_ON == context->mem_profile_mode) {
+        lua_gc(L, LUA_GCCOLLECT, 0);
+    }
+    int gc_was_running = _stop_gc_if_need(L);
+    context->running_in_hook = true;
+
+    uint64_t now = get_mono_ns();
+    struct icallpath_context* callpath = get_root_path(context);
+    struct callpath_node* root = (struct callpath_node*)icallpath_getvalue(callpath);
+    root->cpu_cost_raw = epoch_active_ns(context, now);
+    resolve_symbols(context, L);
+    struct dump_snapshot snap;
+    _init_dump_snapshot(&snap, context, &prune);
+    char start_time[32] = {0};
+    format_mono_time(context->epoch_start_time, start_time, sizeof(start_time));
+    prepare_call_path(callpath, &snap);
+    bool ok = write_profile_file(fp, DUMP_FORMAT_JSON, callpath, &snap, start_time, epoch_active_ns(context, now)*1.0/NANOSEC);
+    free_dump_snapshot(&snap);
+    if (owned) {
+        if (fclose(fp) != 0) ok = false;
+        pfree(buffer);
+    } else if (fflush(fp) != 0) {
+        ok = false;
+    }
+
+    context->running_in_hook = false;
+    _restart_gc_if_need(L, gc_was_running);
+    if (!ok) {
+        lua_pushboolean(L, false);
+        lua_pushfstring(L, "write fail: %s", strerror(errno));
+        return 2;
+    }
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+// window_dump 期间节点上被换掉的累计值，导出后恢复
+struct window_saved {
+    struct callpath_node* node;
+    uint64_t call_count;
+    uint64_t cpu_cost_raw;
+    uint64_t alloc_bytes;
+    uint64_t free_bytes;
+    uint64_t alloc_times;
+    uint64_t free_times;
+    uint64_t realloc_times;
+    uint64_t ev[OVH_CLASS_COUNT];
+    uint64_t* ctr;
+    struct size_hist* hist;
+};
+
+// 把节点的累计值换成 [first, last] 窗口内的合计，返回窗口内的调用次数
+static uint64_t
+_window_swap_in(struct profile_context* context, struct callpath_node* node, struct window_saved* sv, uint64_t first, uint64_t last) {
+    sv->node = node;
+    sv->call_count = node->call_count;
+    sv->cpu_cost_raw = node->cpu_cost_raw;
+    sv->alloc_bytes = node->alloc_bytes;
+    sv->free_bytes = node->free_bytes;
+    sv->alloc_times = node->alloc_times;
+    sv->free_times = node->free_times;
+    sv->realloc_times = node->realloc_times;
+    memcpy(sv->ev, node->ev, sizeof(node->ev));
+    // 计数器和分配大小直方图不按窗口保留，窗口导出里不带
+    sv->ctr = node->ctr;
+    node->ctr = NULL;
+    sv->hist = node->hist;
+    node->hist = NULL;
+
+    struct window_slot sum;
+    memset(&sum, 0, sizeof(sum));
+    for (int i = 0; node->win && i < context->windows; i++) {
+        const struct window_slot* slot = &node->win[i];
+        if (slot->seq < first || slot->seq > last) continue;
+        sum.call_count += slot->call_count;
+        sum.cpu_cost_raw += slot->cpu_cost_raw;
+        sum.alloc_bytes += slot->alloc_bytes;
+        sum.free_bytes += slot->free_bytes;
+        sum.alloc_times += slot->alloc_times;
+        sum.free_times += slot->free_times;
+        sum.realloc_times += slot->realloc_times;
+    }
+    node->call_count = sum.call_count;
+    node->cpu_cost_raw = sum.cpu_cost_raw;
+    node->alloc_bytes = sum.alloc_bytes;
+    node->free_bytes = sum.free_bytes;
+    node->alloc_times = sum.alloc_times;
+    node->free_times = sum.free_times;
+    node->realloc_times = sum.realloc_times;
+    // 窗口内没有单独记录 hook 事件数，按调用次数的比例估算
+    for (int k = 0; k < OVH_CLASS_COUNT; k++) {
+        node->ev[k] = sv->call_count > 0 ? (uint64_t)((double)sv->ev[k] * sum.call_count / sv->call_count) : 0;
+    }
+    return sum.call_count;
+}
+
+static void
+_window_restore(const struct window_saved* sv) {
+    struct callpath_node* node = sv->node;
+    node->call_count = sv->call_count;
+    node->cpu_cost_raw = sv->cpu_cost_raw;
+    node->alloc_bytes = sv->alloc_bytes;
+    node->free_bytes = sv->free_bytes;
+    node->alloc_times = sv->alloc_times;
+    node->free_times = sv->free_times;
+    node->realloc_times = sv->realloc_times;
+    memcpy(node->ev, sv->ev, sizeof(node->ev));
+    node->ctr = sv->ctr;
+    node->hist = sv->hist;
+}
+
+/*
+window_dump([n [, opts]])：导出最近 n 个时间窗口（默认全部，含当前还没结束的窗口）合并后的调用树，
+返回扣除 pause 后实际统计的秒数、调用树和覆盖的秒数，格式同 dump。需要以 windows 启动。导出时把节点的累计值临时换成窗口内的合计，复用 dump 的导出流程后再换回；窗口内没有活动的子节点不导出。
+swap_dump 换树后，之前的窗口随旧树导出，window_dump 只包含换树之后的部分。opts 同 dump。
+*/
+static int
+lwindow_dump(lua_State* L) {
+    struct profile_context* context = get_profile_context(L);
+    if (!context) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "profile not started");
+        return 2;
+    }
+    if (!context->windows) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "windows not enabled");
+        return 2;
+    }
+    lua_Integer n = luaL_optinteger(L, 1, context->windows);
+    if (n < 1) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "invalid window count");
+        return 2;
+    }
+    if (n > context->windows) n = context->windows;
+    struct dump_prune prune;
+    if (!read_dump_prune(L, 2, &prune)) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "invalid options");
+        return 2;
+    }
+    prune.skip_idle = true;
+
+    int gc_was_running = _stop_gc_if_need(L);
+    context->running_in_hook = true;
+    uint64_t now = get_mono_ns();
+    window_tick(context, now);
+    uint64_t last = context->window_seq;
+    uint64_t first = last > (uint64_t)n ? last - (uint64_t)n + 1 : 1;
+    uint64_t from = context->start_time + (first - 1) * context->window_ns;
+    if (from < context->epoch_start_time) from = context->epoch_start_time;
+
+    struct icallpath_context* callpath = get_root_path(context);
+    struct window_saved* saved = NULL;
+    size_t saved_size = 0;
+    size_t saved_cap = 0;
+    uint64_t window_calls = 0;
+    struct icallpath_stack st = {NULL, 0, 0};
+    icallpath_stack_push(&st, callpath);
+    while (st.size > 0) {
+        struct icallpath_context* cur = st.items[--st.size];
+        if (saved_size >= saved_cap) {
+            saved_cap = saved_cap ? saved_cap * 2 : 256;
+            saved = (struct window_saved*)prealloc(saved, sizeof(struct window_saved) * saved_cap);
+        }
+        struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(cur);
+        window_calls += _window_swap_in(context, node, &saved[saved_size++], first, last);
+        imap_dump(cur->children, _icallpath_stack_push_child, &st);
+    }
+    pfree(st.items);
+    // 扣除覆盖范围内 pause 的时长，同 epoch_active_ns
+    uint64_t paused = 0;
+    for (uint64_t seq = first; seq <= last; seq++) {
+        const struct window_pause* wp = &context->window_paused[seq % (uint64_t)context->windows];
+        if (wp->seq == seq) paused += wp->paused_ns;
+    }
+    if (context->paused) {
+        uint64_t pause_from = context->pause_time > from ? context->pause_time : from;
+        paused += safe_u64_minus(now, pause_from);
+    }
+    uint64_t active = safe_u64_minus(safe_u64_minus(now, from), paused);
+    struct callpath_node* root = (struct callpath_node*)icallpath_getvalue(callpath);
+    root->call_count = saved[0].call_count;
+    root->cpu_cost_raw = active;
+
+    // hook 开销按窗口内的调用次数等比例折算，平均每次调用的开销不变
+    uint64_t call_total = context->cpu_call_count_total;
+    uint64_t profiler_total = context->profiler_cpu_cost_total;
+    if (call_total > 0) {
+        context->profiler_cpu_cost_total = (uint64_t)((double)profiler_total * window_calls / call_total);
+    }
+    context->cpu_call_count_total = window_calls;
+
+    lua_pushnumber(L, active*1.0/NANOSEC);
+    resolve_symbols(context, L);
+    dump_call_path(context, L, &prune);
+    lua_pushnumber(L, safe_u64_minus(now, from)*1.0/NANOSEC);
+
+    context->cpu_call_count_total = call_total;
+    context->profiler_cpu_cost_total = profiler_total;
+    for (size_t i = 0; i < saved_size; i++) {
+        _window_restore(&saved[i]);
+    }
+    pfree(saved);
+    context->running_in_hook = false;
+    _restart_gc_if_need(L, gc_was_running);
+    return 3;
+}
+
+// 换树前把协程栈上还没返回的帧到现在为止的耗时结算到旧树，换树后 sync_call_state 从换树时刻重新计时
+static void
+_ob_settle_live_frames(uint64_t key, void* value, void* ud) {
+    (void)key;
+    struct retime_arg* arg = (struct retime_arg*)ud;
+    struct profile_context* context = arg->context;
+    struct call_state* cs = (struct call_state*)value;
+    if (cs->epoch != context->epoch) {
+        // 整个统计周期都挂起的协程没有耗时；正在运行的协程先挂到当前树上
+        if (cs != context->cur_cs) return;
+        sync_call_state(context, cs);
+    }
+    uint64_t end_time = arg->now;
+    const uint64_t* end_ctr = context->ctr_now;
+    if (context->paused) {
+        end_time = context->pause_time;
+        end_ctr = context->ctr_pause;
+    }
+    if (cs->leave_time > 0 && cs->leave_time < end_time) {
+        end_time = cs->leave_time;
+        end_ctr = cs->leave_ctr;
+    }
+    for (int i = 0; i < cs->top; i++) {
+        struct call_frame* frame = &cs->call_list[i];
+        if (frame->filtered || frame->skip_cost || !frame->path) continue;
+        struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(frame->path);
+        if (!node) continue;
+        node->cpu_cost_raw += safe_u64_minus(safe_u64_minus(end_time, frame->call_time), frame->co_cost);
+        if (context->counters.count > 0) {
+            if (!node->ctr) node->ctr = (uint64_t*)pcalloc(MAX_COUNTERS, sizeof(uint64_t));
+            for (int k = 0; k < context->counters.count; k++) {
+                node->ctr[k] += safe_u64_minus(safe_u64_minus(end_ctr[k], frame->ctr_call[k]), frame->ctr_co[k]);
+            }
+        }
+    }
+}
+
+struct freeze_leak_arg {
+    struct profile_context* context;
+    struct imap_context* frozen;    // 旧树节点地址 -> leak_paths 中对应的路径
+};
+
+// 旧树节点在 leak_paths 中对应的路径，按 (符号, tag) 逐层查找或新建，之前换下的树上的同名路径共用节点
+static struct icallpath_context*
+freeze_leak_path(struct freeze_leak_arg* arg, struct callpath_node* node) {
+    struct profile_context* context = arg->context;
+    if (!context->leak_paths) {
+        struct callpath_node* root = callpath_node_create();
+        root->sym = &root_symbol;
+        context->leak_paths = icallpath_create(0, root);
+    }
+    if (!node->parent) return context->leak_paths;
+    struct icallpath_context* path = (struct icallpath_context*)imap_query(arg->frozen, (uint64_t)(uintptr_t)node);
+    if (path) return path;
+
+    struct icallpath_context* pre_path = freeze_leak_path(arg, node->parent);
+    uint64_t k = (uint64_t)(uintptr_t)node->sym;
+    if (node->tag) k ^= ((uint64_t)node->tag << TAG_KEY_SHIFT) | (uint64_t)node->tag;
+    path = icallpath_get_child(pre_path, k);
+    if (!path) {
+        struct callpath_node* parent = (struct callpath_node*)icallpath_getvalue(pre_path);
+        struct callpath_node* frozen = callpath_node_create();
+        frozen->parent = parent;
+        frozen->depth = parent->depth + 1;
+        frozen->sym = node->sym;
+        frozen->tag = node->tag;
+        path = icallpath_add_child(pre_path, k, frozen);
+    }
+    imap_set(arg->frozen, (uint64_t)(uintptr_t)node, path);
+    return path;
+}
+
+static void
+_ob_freeze_alloc_path(uint64_t key, void* value, void* ud) {
+    (void)key;
+    struct freeze_leak_arg* arg = (struct freeze_leak_arg*)ud;
+    struct alloc_node* an = (struct alloc_node*)value;
+    if (!an->path || an->epoch != arg->context->epoch) return;
+    an->path = (struct callpath_node*)icallpath_getvalue(freeze_leak_path(arg, an->path));
+}
+
+/*
+swap_dump(path [, fmt [, opts]])：把当前调用树换下来交给工作线程导出到文件，VM 线程上换入一棵新树后立即返回。
+fmt 为 "json"（默认）或 "folded"，opts 为导出参数，同 dump。只支持 tree 结构。之后的 dump/swap_dump 只统计换树之后的部分。
+增量计算和写文件都在工作线程完成。VM 线程上要做的：结算各协程栈上未返回的帧（和协程数、栈深成正比），
+有新符号时解析符号（要访问 lua 的对象，不能放到工作线程）——遍历全部符号和存活的父函数给新函数取名，
+有 dladdr 取不到名字的 c 函数时还要扫描一遍 package.loaded；开启内存 profile 时还要遍历一遍 alloc_map，
+把存活块的路径换到只有符号的 leak_paths 上（和存活块数成正比），换下的树释放后 leak_report 仍能给出它们的路径。
+*/
+static int
+lswap_dump(lua_State* L) {
+    struct profile_context* context = get_profile_context(L);
+    if (!context) {
+        printf("swap dump fail, profile not started\n");
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "profile not started");
+        return 2;
+    }
+    const char* path = luaL_checkstring(L, 1);
+    const char* fmt_str = luaL_optstring(L, 2, "json");
+    int fmt = DUMP_FORMAT_JSON;
+    if (!parse_dump_format(fmt_str, &fmt)) {
+        lua_pushboolean(L, false);
+        lua_pushfstring(L, "invalid format: %s", fmt_str);
+        return 2;
+    }
+    struct dump_prune prune;
+    if (!read_dump_prune(L, 3, &prune)) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "invalid dump options");
+        return 2;
+    }
+    if (PROFILE_STRUCTURE_TREE != context->structure) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "swap_dump only supports tree structure");
+        return 2;
+    }
+    if (context->dump_job) {
+        if (!__atomic_load_n(&context->dump_job->finished, __ATOMIC_ACQUIRE)) {
+            lua_pushboolean(L, false);
+            lua_pushstring(L, "previous dump is still running");
+            return 2;
+        }
+        dump_job_wait(context);
+    }
+    FILE* fp = fopen(path, "w");
+    if (!fp) {
+        lua_pushboolean(L, false);
+        lua_pushfstring(L, "open %s fail: %s", path, strerror(errno));
+        return 2;
+    }
+
+    context->running_in_hook = true;
+    if (context->unresolved_symbols > 0) {
+        resolve_symbols(context, L);
+    }
+
+    uint64_t now = get_mono_ns();
+    struct dump_job* job = (struct dump_job*)pcalloc(1, sizeof(*job));
+    job->fmt = fmt;
+    job->fp = fp;
+    job->callpath = get_root_path(context);
+    _init_dump_snapshot(&job->snap, context, &prune);
+    format_mono_time(context->epoch_start_time, job->start_time, sizeof(job->start_time));
+    job->duration = epoch_active_ns(context, now)*1.0/NANOSEC;
+    struct callpath_node* root = (struct callpath_node*)icallpath_getvalue(job->callpath);
+    root->cpu_cost_raw = epoch_active_ns(context, now);
+    if (PROFILE_LEVEL_COUNT != active_level(context)) {
+        counters_sample(context);
+        struct retime_arg arg = {context, now};
+        imap_dump(context->cs_map, _ob_settle_live_frames, &arg);
+    }
+    if (PROFILE_MODE_ON == context->mem_profile_mode) {
+        struct freeze_leak_arg arg = {context, imap_create()};
+        imap_dump(context->alloc_map, _ob_freeze_alloc_path, &arg);
+        imap_free(arg.frozen);
+    }
+
+    // 换入新树，协程栈上的帧在下次遇到时通过 sync_call_state 重新挂到新树
+    context->callpath = NULL;
+    context->profiler_cpu_cost_total = 0;
+    context->cpu_call_count_total = 0;
+    context->epoch++;
+    context->epoch_start_time = now;
+    context->paused_ns = 0;
+    if (context->window_paused) memset(context->window_paused, 0, sizeof(struct window_pause) * context->windows);
+    counters_sample(context);
+    memcpy(context->ctr_epoch, context->ctr_now, sizeof(context->ctr_epoch));
+
+    job->threaded = pthread_create(&job->thread, NULL, _dump_job_main, job) == 0;
+    if (!job->threaded) {
+        _dump_job_main(job);
+    }
+    context->dump_job = job;
+    context->running_in_hook = false;
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+// swap_wait()：等待上一次 swap_dump 写完，返回是否写入成功
+static int
+lswap_wait(lua_State* L) {
+    struct profile_context* context = get_profile_context(L);
+    if (!context) {
+        printf("swap wait fail, profile not started\n");
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "profile not started");
+        return 2;
+    }
+    lua_pushboolean(L, dump_job_wait(context));
+    return 1;
+}
+
+/*
+dump_async(path [, fmt [, opts]])：fork 出子进程导出调用树，父进程只付出 fork 的开销，返回子进程 pid 作为句柄。
+子进程拥有 fork 时刻内存的写时复制副本，在里面解析符号、汇总 alloc_map 得到各节点的存活内存（heap_bytes/heap_blocks），
+按 swap_dump 相同的格式写文件后退出。与 swap_dump 不同，父进程的统计不受影响。
+必须用 dump_poll 轮询到结束，否则子进程会成为僵尸进程。只支持 tree 结构。
+*/
+static int
+ldump_async(lua_State* L) {
+    struct profile_context* context = get_profile_context(L);
+    if (!context) {
+        printf("dump async fail, profile not started\n");
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "profile not started");
+        return 2;
+    }
+    const char* path = luaL_checkstring(L, 1);
+    const char* fmt_str = luaL_optstring(L, 2, "json");
+    int fmt = DUMP_FORMAT_JSON;
+    if (!parse_dump_format(fmt_str, &fmt)) {
+        lua_pushboolean(L, false);
+        lua_pushfstring(L, "invalid format: %s", fmt_str);
+        return 2;
+    }
+    struct dump_prune prune;
+    if (!read_dump_prune(L, 3, &prune)) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "invalid dump options");
+        return 2;
+    }
+    if (PROFILE_STRUCTURE_TREE != context->structure) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "dump_async only supports tree structure");
+        return 2;
+    }
+    // fork 只复制调用线程，swap_dump 的工作线程可能持有 malloc 的锁，子进程里再分配内存会死锁
+    if (context->dump_job) {
+        if (!__atomic_load_n(&context->dump_job->finished, __ATOMIC_ACQUIRE)) {
+            lua_pushboolean(L, false);
+            lua_pushstring(L, "swap dump is still running");
+            return 2;
+        }
+        dump_job_wait(context);
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        lua_pushboolean(L, false);
+        lua_pushfstring(L, "fork fail: %s", strerror(errno));
+        return 2;
+    }
+    if (pid > 0) {
+        lua_pushinteger(L, (lua_Integer)pid);
+        return 1;
+    }
+
+    // 子进程：不再回到 lua，写完直接 _exit，不刷父进程遗留的 stdio 缓冲
+    context->running_in_hook = true;
+    context->is_ready = false;
+    int exit_code = 1;
+    FILE* fp = fopen(path, "w");
+    if (fp) {
+        uint64_t now = get_mono_ns();
+        struct dump_snapshot snap;
+        struct icallpath_context* callpath = get_root_path(context);
+        struct callpath_node* root = (struct callpath_node*)icallpath_getvalue(callpath);
+        root->cpu_cost_raw = epoch_active_ns(context, now);
+        resolve_symbols(context, L);
+        _init_dump_snapshot(&snap, context, &prune);
+        if (PROFILE_MODE_ON == context->mem_profile_mode) {
+            struct heap_snapshot_arg heap_arg = {context->epoch};
+            imap_dump(context->alloc_map, _ob_heap_snapshot, &heap_arg);
+            snap.heap_snapshot = true;
+        }
+        char start_time[32] = {0};
+        format_mono_time(context->epoch_start_time, start_time, sizeof(start_time));
+        prepare_call_path(callpath, &snap);
+        bool ok = write_profile_file(fp, fmt, callpath, &snap, start_time, epoch_active_ns(context, now)*1.0/NANOSEC);
+        free_dump_snapshot(&snap);
+        if (fclose(fp) == 0 && ok) exit_code = 0;
+    }
+    _exit(exit_code);
+    return 0;
+}
+
+// dump_poll(handle)：查询 dump_async 子进程的状态，返回 "running"、"done" 或 "failed"
+static int
+ldump_poll(lua_State* L) {
+    pid_t pid = (pid_t)luaL_checkinteger(L, 1);
+    int status = 0;
+    pid_t ret = waitpid(pid, &status, WNOHANG);
+    if (ret == 0) {
+        lua_pushstring(L, "running");
+        return 1;
+    }
+    if (ret < 0) {
+        lua_pushstring(L, "failed");
+        lua_pushfstring(L, "waitpid fail: %s", strerror(errno));
+        return 2;
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        lua_pushstring(L, "done");
+        return 1;
+    }
+    lua_pushstring(L, "failed");
+    lua_pushstring(L, WIFSIGNALED(status) ? "killed by signal" : "write fail");
+    return 2;
+}
+
+static void
+_ob_disable_line_table(uint64_t key, void* value, void* ud) {
+    (void)key; (void)ud;
+    ((struct line_table*)value)->enabled = false;
+}
+
+/*
+profile_lines({ functions = { f1, f2, ... } })：对列出的 lua 函数做逐行统计，替换之前的设置，传空列表即关闭。
+只在这些函数处于协程栈顶时开启 line hook，其他代码仍然只有 call/ret hook。已经在栈上的调用从下一次调用开始统计。
+*/
+static int
+lprofile_lines(lua_State* L) {
+    struct profile_context* context = get_profile_context(L);
+    if (!context) {
+        printf("profile lines fail, profile not started\n");
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "profile not started");
+        return 2;
+    }
+    if (context->level != PROFILE_LEVEL_FULL) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "profile lines needs level full");
+        return 2;
+    }
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "functions");
+    if (!lua_istable(L, -1)) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "functions should be a list of lua functions");
+        return 2;
+    }
+    int list = lua_gettop(L);
+    int n = (int)lua_rawlen(L, list);
+    for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, list, i);
+        bool is_lua_function = lua_isfunction(L, -1) && !lua_iscfunction(L, -1);
+        lua_pop(L, 1);
+        if (!is_lua_function) {
+            lua_pushboolean(L, false);
+            lua_pushfstring(L, "functions[%d] is not a lua function", i);
+            return 2;
+        }
+    }
+
+    context->running_in_hook = true;
+    imap_dump(context->line_map, _ob_disable_line_table, NULL);
+    context->line_targets = 0;
+    for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, list, i);
+        const LClosure* cl = (const LClosure*)lua_topointer(L, -1);
+        bool filtered = false;
+        bool is_new = false;
+        uint64_t key = get_proto_key(context, cl->p, &filtered, &is_new);
+        if (is_new) {
+            lua_pushvalue(L, -1);
+            _anchor_closure(L, cl->p);
+        }
+        lua_pop(L, 1);
+        struct line_table* lt = (struct line_table*)imap_query(context->line_map, key);
+        if (!lt) {
+            lt = (struct line_table*)pmalloc(sizeof(*lt));
+            lt->key = key;
+            lt->sym = get_symbol(context, key);
+            lt->enabled = false;
+            lt->lines = imap_create_sized(GRAPH_EDGE_SLOT_SIZE);
+            imap_set(context->line_map, key, lt);
+        }
+        if (!lt->enabled) {
+            lt->enabled = true;
+            context->line_targets++;
         }
-
     }
-
-    context->profiler_cpu_cost_total += safe_u64_minus(get_mono_ns(), begin_time);
     context->running_in_hook = false;
+    lua_pushboolean(L, true);
+    return 1;
 }
 
-static void _dump_call_path(struct icallpath_context* path, struct dump_call_path_arg* arg);
+struct collect_line_arg {
+    uint64_t* lines;
+    size_t count;
+};
 
-static void _dump_call_path_child(uint64_t key, void* value, void* ud) {
-    struct dump_call_path_arg* arg = (struct dump_call_path_arg*)ud;
-    _dump_call_path((struct icallpath_context*)value, arg);
-    lua_seti(arg->L, -2, ++arg->index);
+static void
+_collect_line(uint64_t key, void* value, void* ud) {
+    (void)value;
+    struct collect_line_arg* arg = (struct collect_line_arg*)ud;
+    arg->lines[arg->count++] = key;
 }
 
-static void _dump_call_path(struct icallpath_context* path, struct dump_call_path_arg* arg) {
-    lua_checkstack(arg->L, 3);
-    lua_newtable(arg->L);
-
-    // 递归获取所有子节点的指标和
-    struct dump_call_path_arg child_arg;
-    _init_dump_call_path_arg(&child_arg, arg->pcontext, arg->L);
-    child_arg.avg_profiler_cost_per_call = arg->avg_profiler_cost_per_call;
-    if (icallpath_children_size(path) > 0) {
-        lua_newtable(arg->L);
-        icallpath_dump_children(path, _dump_call_path_child, &child_arg);
-        lua_setfield(arg->L, -2, "children");
-    }
-
-    struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(path);
-
-    // 本节点的聚合指标=本节点指标+所有子节点的指标
-    uint64_t alloc_bytes_incl = node->alloc_bytes + child_arg.alloc_bytes_sum;
-    uint64_t free_bytes_incl = node->free_bytes + child_arg.free_bytes_sum;
-    uint64_t alloc_times_incl = node->alloc_times + child_arg.alloc_times_sum;
-    uint64_t free_times_incl = node->free_times + child_arg.free_times_sum;
-    uint64_t realloc_times_incl = node->realloc_times + child_arg.realloc_times_sum;
-
-    // 本节点的其他指标
-    uint64_t cpu_cost_raw = node->cpu_cost_raw;
-    uint64_t call_count = node->call_count;
-    bool is_root = is_root_path(arg->pcontext, path);
-    uint64_t call_count_for_profile = node->call_count_incl;
-    uint64_t cpu_cost_real = calc_cpu_cost_real(cpu_cost_raw, call_count_for_profile, arg->avg_profiler_cost_per_call);
-    uint64_t inuse_bytes = (alloc_bytes_incl >= free_bytes_incl ? alloc_bytes_incl - free_bytes_incl : 9999999999);
-
-    // 累加到父节点
-    arg->alloc_bytes_sum += alloc_bytes_incl;
-    arg->free_bytes_sum += free_bytes_incl;
-    arg->alloc_times_sum += alloc_times_incl;
-    arg->free_times_sum += free_times_incl;
-    arg->realloc_times_sum += realloc_times_incl;
+static int
+_cmp_u64_asc(const void* a, const void* b) {
+    uint64_t va = *(const uint64_t*)a;
+    uint64_t vb = *(const uint64_t*)b;
+    return va < vb ? -1 : (va > vb ? 1 : 0);
+}
 
-    // 导出本节点的聚合指标
+static void
+_dump_line_table(uint64_t key, void* value, void* ud) {
+    (void)key;
+    lua_State* L = (lua_State*)ud;
+    struct line_table* lt = (struct line_table*)value;
+    struct symbol_info* si = lt->sym;
+    lua_createtable(L, 0, 2);
     char name[512] = {0};
-    snprintf(name, sizeof(name)-1, "%s %s:%d", node->name ? node->name : "", node->source ? node->source : "", node->line);
-    lua_pushstring(arg->L, name);
-    lua_setfield(arg->L, -2, "name");
-
-    lua_pushinteger(arg->L, node->last_ret_time);
-    lua_setfield(arg->L, -2, "last_ret_time");
-    
-    lua_pushinteger(arg->L, call_count);
-    lua_setfield(arg->L, -2, "call_count");
-    lua_pushinteger(arg->L, call_count_for_profile);
-    lua_setfield(arg->L, -2, "call_count_incl");
+    snprintf(name, sizeof(name)-1, "%s %s:%d", si && si->name ? si->name : "", si && si->source ? si->source : "", si ? si->line : 0);
+    lua_pushstring(L, name);
+    lua_setfield(L, -2, "name");
+
+    struct collect_line_arg arg;
+    arg.count = 0;
+    arg.lines = (uint64_t*)pmalloc(sizeof(uint64_t) * (imap_size(lt->lines) + 1));
+    imap_dump(lt->lines, _collect_line, &arg);
+    qsort(arg.lines, arg.count, sizeof(uint64_t), _cmp_u64_asc);
+    lua_createtable(L, (int)arg.count, 0);
+    for (size_t i = 0; i < arg.count; i++) {
+        struct line_stat* ls = (struct line_stat*)imap_query(lt->lines, arg.lines[i]);
+        lua_createtable(L, 0, 3);
+        lua_pushinteger(L, (lua_Integer)arg.lines[i]);
+        lua_setfield(L, -2, "line");
+        lua_pushinteger(L, ls->count);
+        lua_setfield(L, -2, "count");
+        lua_pushinteger(L, ls->cpu_cost);
+        lua_setfield(L, -2, "cpu_cost(ns)");
+        lua_rawseti(L, -2, (lua_Integer)(i + 1));
+    }
+    pfree(arg.lines);
+    lua_setfield(L, -2, "lines");
+    lua_rawseti(L, -2, (lua_Integer)lua_rawlen(L, -2) + 1);
+}
 
-    lua_pushinteger(arg->L, cpu_cost_raw);
-    lua_setfield(arg->L, -2, "cpu_cost_raw(ns)");
-    lua_pushinteger(arg->L, cpu_cost_real);
-    lua_setfield(arg->L, -2, "cpu_cost_real(ns)");
+// dump_lines()：返回 profile_lines 的逐行统计 { { name = "f source:line", lines = { { line, count, cpu_cost(ns) }, ... } }, ... }，行号升序
+static int
+ldump_lines(lua_State* L) {
+    struct profile_context* context = get_profile_context(L);
+    if (!context) {
+        printf("dump lines fail, profile not started\n");
+        return 0;
+    }
+    context->running_in_hook = true;
+    if (context->unresolved_symbols > 0) {
+        resolve_symbols(context, L);
+    }
+    lua_checkstack(L, 6);
+    lua_newtable(L);
+    imap_dump(context->line_map, _dump_line_table, L);
+    context->running_in_hook = false;
+    return 1;
+}
 
-    uint64_t parent_cpu_cost_raw = 0;
-    uint64_t parent_cpu_cost_real = 0;
-    if (node->parent) {
-        parent_cpu_cost_raw = node->parent->cpu_cost_raw;
-        parent_cpu_cost_real = calc_cpu_cost_real(node->parent->cpu_cost_raw, node->parent->call_count_incl, arg->avg_profiler_cost_per_call);
+// mark_generation([collect])：先 full gc（collect 默认 true），再开始新的一代，返回新一代的编号。
+// 之后分配的块记为新一代，配合 leak_report 找出跨越多次 full gc 仍然存活的块
+static int
+lmark_generation(lua_State* L) {
+    struct profile_context* context = get_profile_context(L);
+    if (!context) {
+        printf("mark generation fail, profile not started\n");
+        return 0;
+    }
+    bool collect = lua_isnoneornil(L, 1) ? true : lua_toboolean(L, 1);
+    if (collect) {
+        lua_gc(L, LUA_GCCOLLECT, 0);
     }
+    context->generation++;
+    lua_pushinteger(L, (lua_Integer)context->generation);
+    return 1;
+}
 
-    double percent_raw = parent_cpu_cost_raw > 0 ? ((double)cpu_cost_raw / parent_cpu_cost_raw * 100.0) : 100;
-    char percent_raw_str[32] = {0};
-    snprintf(percent_raw_str, sizeof(percent_raw_str)-1, "%.2f", percent_raw);
-    lua_pushstring(arg->L, percent_raw_str);
-    lua_setfield(arg->L, -2, "cpu_cost_raw(%)");
+// leak_report 按 (节点, 代) 汇总存活块，同一节点的各代挂成链表
+struct leak_entry {
+    struct callpath_node* node;
+    uint32_t generation;
+    uint64_t bytes;
+    uint64_t blocks;
+    struct leak_entry* next;
+};
 
-    double percent_real = parent_cpu_cost_real > 0 ? ((double)cpu_cost_real / parent_cpu_cost_real * 100.0) : 100;
-    char percent_real_str[32] = {0};
-    snprintf(percent_real_str, sizeof(percent_real_str)-1, "%.2f", percent_real);
-    lua_pushstring(arg->L, percent_real_str);
-    lua_setfield(arg->L, -2, "cpu_cost_real(%)");
+struct leak_report_arg {
+    struct imap_context* entries;   // 节点地址 -> leak_entry 链表
+    size_t count;
+    uint32_t max_generation;        // 只统计这一代及更早分配的块
+};
 
-    if (PROFILE_MODE_ON == arg->pcontext->mem_profile_mode) {
-        lua_pushinteger(arg->L, (lua_Integer)alloc_bytes_incl);
-        lua_setfield(arg->L, -2, "alloc_bytes");
+static void
+_ob_leak_collect(uint64_t key, void* value, void* ud) {
+    (void)key;
+    struct leak_report_arg* arg = (struct leak_report_arg*)ud;
+    struct alloc_node* an = (struct alloc_node*)value;
+    // 旧周期的块指向 leak_paths 上的路径，见 swap_dump
+    if (!an->path || an->generation > arg->max_generation) return;
+    uint64_t nk = (uint64_t)(uintptr_t)an->path;
+    struct leak_entry* head = (struct leak_entry*)imap_query(arg->entries, nk);
+    struct leak_entry* e = head;
+    while (e && e->generation != an->generation) e = e->next;
+    if (!e) {
+        e = (struct leak_entry*)pmalloc(sizeof(*e));
+        e->node = an->path;
+        e->generation = an->generation;
+        e->bytes = 0;
+        e->blocks = 0;
+        e->next = head;
+        imap_set(arg->entries, nk, e);
+        arg->count++;
+    }
+    e->bytes += an->live_bytes;
+    e->blocks++;
+}
 
-        lua_pushinteger(arg->L, (lua_Integer)free_bytes_incl);
-        lua_setfield(arg->L, -2, "free_bytes");
+struct leak_flatten_arg {
+    struct leak_entry** list;
+    size_t count;
+};
 
-        lua_pushinteger(arg->L, (lua_Integer)alloc_times_incl);
-        lua_setfield(arg->L, -2, "alloc_times");
+static void
+_ob_leak_flatten(uint64_t key, void* value, void* ud) {
+    (void)key;
+    struct leak_flatten_arg* arg = (struct leak_flatten_arg*)ud;
+    for (struct leak_entry* e = (struct leak_entry*)value; e; e = e->next) {
+        arg->list[arg->count++] = e;
+    }
+}
 
-        lua_pushinteger(arg->L, (lua_Integer)free_times_incl);
-        lua_setfield(arg->L, -2, "free_times");
+static int
+_cmp_leak_entry_desc(const void* a, const void* b) {
+    const struct leak_entry* ea = *(const struct leak_entry* const*)a;
+    const struct leak_entry* eb = *(const struct leak_entry* const*)b;
+    if (ea->bytes != eb->bytes) return ea->bytes > eb->bytes ? -1 : 1;
+    return ea->generation < eb->generation ? -1 : (ea->generation > eb->generation);
+}
 
-        lua_pushinteger(arg->L, (lua_Integer)realloc_times_incl);
-        lua_setfield(arg->L, -2, "realloc_times");
+// 调用路径 "f1 source:line;f2 source:line"，从 root 的子节点到 node
+static void
+_push_node_path(lua_State* L, struct callpath_node* node) {
+    char* buf = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    int depth = 0;
+    for (struct callpath_node* p = node; p && p->parent; p = p->parent) depth++;
+    struct callpath_node** chain = (struct callpath_node**)pmalloc(sizeof(struct callpath_node*) * (depth > 0 ? depth : 1));
+    int i = depth;
+    for (struct callpath_node* p = node; p && p->parent; p = p->parent) chain[--i] = p;
+    for (i = 0; i < depth; i++) {
+        char name[512] = {0};
+        _format_node_name(chain[i], name, sizeof(name));
+        size_t name_len = strlen(name);
+        if (len + name_len + 2 > cap) {
+            while (cap < len + name_len + 2) cap = cap ? cap * 2 : 256;
+            buf = (char*)prealloc(buf, cap);
+        }
+        if (len > 0) buf[len++] = ';';
+        memcpy(buf + len, name, name_len);
+        len += name_len;
+    }
+    lua_pushlstring(L, buf ? buf : "", len);
+    pfree(buf);
+    pfree(chain);
+}
 
-        lua_pushinteger(arg->L, (lua_Integer)inuse_bytes);
-        lua_setfield(arg->L, -2, "inuse_bytes");
+/*
+leak_report([opts])：opts 为 { min_age = 1, top = 50 }，需要 mem_profile 为 on。
+统计当前仍存活、且分配后至少经过了 min_age 次 mark_generation（即 min_age 次 full gc）的块，按 (调用路径, 分配的代) 汇总，
+按存活字节降序返回前 top 项：{ { path, generation, live_bytes, live_blocks }, ... }。
+长期运行的服务里，跨越多代仍在增长的路径就是泄漏嫌疑。swap_dump 之前分配的块按分配时所在的路径统计。
+*/
+static int
+lleak_report(lua_State* L) {
+    struct profile_context* context = get_profile_context(L);
+    if (!context) {
+        printf("leak report fail, profile not started\n");
+        return 0;
+    }
+    if (PROFILE_MODE_ON != context->mem_profile_mode) {
+        lua_pushnil(L);
+        lua_pushstring(L, "leak report needs mem_profile on");
+        return 2;
     }
-    if (is_root) {
-        lua_pushinteger(arg->L, arg->pcontext->profiler_cpu_cost_total);
-        lua_setfield(arg->L, -2, "profiler_cpu_cost_total(ns)");
-        lua_pushinteger(arg->L, arg->pcontext->cpu_call_count_total);
-        lua_setfield(arg->L, -2, "cpu_call_count_total");
-        lua_pushnumber(arg->L, arg->avg_profiler_cost_per_call);
-        lua_setfield(arg->L, -2, "avg_profiler_cost_per_call(ns)");
+    lua_Integer min_age = 1;
+    lua_Integer top = 50;
+    if (lua_istable(L, 1)) {
+        lua_getfield(L, 1, "min_age");
+        if (lua_isinteger(L, -1)) min_age = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        lua_getfield(L, 1, "top");
+        if (lua_isinteger(L, -1)) top = lua_tointeger(L, -1);
+        lua_pop(L, 1);
     }
-}
+    if (min_age < 0) min_age = 0;
+    if (top < 0) top = 0;
 
-static void dump_call_path(struct profile_context* pcontext, lua_State* L) {
-    struct dump_call_path_arg arg;
-    _init_dump_call_path_arg(&arg, pcontext, L);
-    if (pcontext->callpath) {
-        compute_call_count_incl(pcontext->callpath);
-        struct callpath_node* root_node = (struct callpath_node*)icallpath_getvalue(pcontext->callpath);
-        if (root_node) {
-            root_node->call_count_incl = pcontext->cpu_call_count_total;
-        }
+    context->running_in_hook = true;
+    lua_newtable(L);
+    if ((lua_Integer)context->generation < min_age) {
+        context->running_in_hook = false;
+        return 1;
     }
-    if (pcontext->cpu_call_count_total > 0) {
-        arg.avg_profiler_cost_per_call =
-            (double)pcontext->profiler_cpu_cost_total / (double)pcontext->cpu_call_count_total;
+    struct leak_report_arg arg;
+    arg.entries = imap_create();
+    arg.count = 0;
+    arg.max_generation = context->generation - (uint32_t)min_age;
+    imap_dump(context->alloc_map, _ob_leak_collect, &arg);
+
+    struct leak_flatten_arg flat;
+    flat.list = (struct leak_entry**)pmalloc(sizeof(struct leak_entry*) * (arg.count > 0 ? arg.count : 1));
+    flat.count = 0;
+    imap_dump(arg.entries, _ob_leak_flatten, &flat);
+    qsort(flat.list, flat.count, sizeof(struct leak_entry*), _cmp_leak_entry_desc);
+
+    if (flat.count > 0 && context->unresolved_symbols > 0) {
+        resolve_symbols(context, L);
+    }
+    size_t n = flat.count < (size_t)top ? flat.count : (size_t)top;
+    lua_checkstack(L, 4);
+    for (size_t i = 0; i < n; i++) {
+        struct leak_entry* e = flat.list[i];
+        lua_createtable(L, 0, 4);
+        _push_node_path(L, e->node);
+        lua_setfield(L, -2, "path");
+        lua_pushinteger(L, (lua_Integer)e->generation);
+        lua_setfield(L, -2, "generation");
+        lua_pushinteger(L, (lua_Integer)e->bytes);
+        lua_setfield(L, -2, "live_bytes");
+        lua_pushinteger(L, (lua_Integer)e->blocks);
+        lua_setfield(L, -2, "live_blocks");
+        lua_rawseti(L, -2, (lua_Integer)i + 1);
     }
-    _dump_call_path(pcontext->callpath, &arg);
+    for (size_t i = 0; i < flat.count; i++) {
+        pfree(flat.list[i]);
+    }
+    pfree(flat.list);
+    imap_free(arg.entries);
+    context->running_in_hook = false;
+    return 1;
 }
 
-static int 
-get_all_coroutines(lua_State* L, lua_State** result, int maxsize) {
-    int i = 0;
-    struct global_State* lG = L->l_G;
-    result[i++] = lG->mainthread;
+enum TOP_METRIC {
+    TOP_METRIC_SELF,
+    TOP_METRIC_INCL,
+    TOP_METRIC_CALLS,
+};
 
-    struct GCObject* obj = lG->allgc;
-    while (obj && i < maxsize) {
-        if (obj->tt == LUA_TTHREAD) {
-            result[i++] = gco2th(obj);
-        }
-        obj = obj->next;
+static inline uint64_t
+_top_metric(const struct func_stat* fs, int metric) {
+    switch (metric) {
+    case TOP_METRIC_INCL: return fs->cpu_cost_incl;
+    case TOP_METRIC_CALLS: return fs->call_count;
+    default: return fs->cpu_cost_self;
     }
-    return i;
 }
 
-static int _stop_gc_if_need(lua_State* L) {
-    // stop gc before set hook
-    int gc_was_running = lua_gc(L, LUA_GCISRUNNING, 0);
-    if (gc_was_running) { lua_gc(L, LUA_GCSTOP, 0); }
-    return gc_was_running;
-}
+// 大小为 n 的小顶堆，堆顶是当前入选的最小值
+struct top_heap {
+    struct func_stat** items;
+    int size;
+    int cap;
+    int metric;
+};
 
-static void _restart_gc_if_need(lua_State* L, int gc_was_running) {
-    if (gc_was_running) { lua_gc(L, LUA_GCRESTART, 0); }
+static void
+_top_heap_sift_down(struct top_heap* h, int i) {
+    for (;;) {
+        int l = i * 2 + 1, r = l + 1, m = i;
+        if (l < h->size && _top_metric(h->items[l], h->metric) < _top_metric(h->items[m], h->metric)) m = l;
+        if (r < h->size && _top_metric(h->items[r], h->metric) < _top_metric(h->items[m], h->metric)) m = r;
+        if (m == i) return;
+        struct func_stat* t = h->items[i];
+        h->items[i] = h->items[m];
+        h->items[m] = t;
+        i = m;
+    }
 }
 
-static void _unhook_all_coroutines(lua_State* L) {
-    lua_State* states[MAX_CO_SIZE] = {0};
-    int sz = get_all_coroutines(L, states, MAX_CO_SIZE);
-    for (int i = sz - 1; i >= 0; i--) {
-        lua_sethook(states[i], NULL, 0, 0);
+static void
+_ob_top_func(uint64_t key, void* value, void* ud) {
+    (void)key;
+    struct top_heap* h = (struct top_heap*)ud;
+    struct func_stat* fs = (struct func_stat*)value;
+    uint64_t v = _top_metric(fs, h->metric);
+    if (v == 0) return;
+    if (h->size < h->cap) {
+        int i = h->size++;
+        h->items[i] = fs;
+        while (i > 0) {
+            int parent = (i - 1) / 2;
+            if (_top_metric(h->items[parent], h->metric) <= v) break;
+            h->items[i] = h->items[parent];
+            h->items[parent] = fs;
+            i = parent;
+        }
+    } else if (v > _top_metric(h->items[0], h->metric)) {
+        h->items[0] = fs;
+        _top_heap_sift_down(h, 0);
     }
 }
 
+/*
+top([n[, metric]])：不导出调用树，直接从按函数聚合的统计中取前 n 个（默认 10），metric 为 "self"（默认）、"incl" 或 "calls"。
+函数统计在帧返回时增量更新，这里只遍历一次函数表，lua 堆上只分配返回结果。
+返回 { { name, call_count, cpu_cost_self(ns), cpu_cost_incl(ns) }, ... }，按 metric 降序；还在栈上的帧的耗时要等返回后才计入。
+*/
 static int
-lstart(lua_State* L) {
+ltop(lua_State* L) {
     struct profile_context* context = get_profile_context(L);
-    if (context != NULL) {
-        printf("ERROR: start fail, profile already started\n");
+    if (!context) {
+        printf("top fail, profile not started\n");
         return 0;
     }
-
-    // parse options: start([opts]), opts is a table like: { mem_profile = "off|on" }
-    // mem_profile 为 off 表示不需要内存 profile，为 on 表示需要内存 profile
-    int mem_profile_mode = PROFILE_MODE_OFF;
-    bool read_ok = read_arg(L, &mem_profile_mode);
-    if (!read_ok) {
-        printf("ERROR: start fail, invalid options\n");
-        return 0;
+    lua_Integer n = luaL_optinteger(L, 1, 10);
+    const char* metric_name = luaL_optstring(L, 2, "self");
+    int metric = TOP_METRIC_SELF;
+    if (strcmp(metric_name, "self") == 0) metric = TOP_METRIC_SELF;
+    else if (strcmp(metric_name, "incl") == 0) metric = TOP_METRIC_INCL;
+    else if (strcmp(metric_name, "calls") == 0) metric = TOP_METRIC_CALLS;
+    else return luaL_argerror(L, 2, "metric should be self, incl or calls");
+    if (n > (lua_Integer)imap_size(context->func_map)) n = (lua_Integer)imap_size(context->func_map);
+    if (n <= 0) {
+        lua_newtable(L);
+        return 1;
     }
 
-    // full gc before start, make mem profile more accurate
-    if (PROFILE_MODE_ON == mem_profile_mode) {
-        lua_gc(L, LUA_GCCOLLECT, 0);  
+    context->running_in_hook = true;
+    struct top_heap h;
+    h.items = (struct func_stat**)pmalloc(sizeof(struct func_stat*) * n);
+    h.size = 0;
+    h.cap = (int)n;
+    h.metric = metric;
+    imap_dump(context->func_map, _ob_top_func, &h);
+
+    // 堆中依次弹出最小值，从后往前填
+    int count = h.size;
+    for (int i = count - 1; i > 0; i--) {
+        struct func_stat* t = h.items[0];
+        h.items[0] = h.items[i];
+        h.items[i] = t;
+        h.size = i;
+        _top_heap_sift_down(&h, 0);
+    }
+    if (count > 0 && context->unresolved_symbols > 0) {
+        resolve_symbols(context, L);
     }
 
-    context = profile_create();
-    context->running_in_hook = true;
-    context->start_time = get_mono_ns();
-    context->is_ready = true;
-    context->mem_profile_mode = mem_profile_mode;
-    context->last_alloc_f = lua_getallocf(L, &context->last_alloc_ud);
-    if (PROFILE_MODE_ON == mem_profile_mode) {
-        lua_setallocf(L, _hook_alloc, context);
+    lua_createtable(L, count, 0);
+    for (int i = 0; i < count; i++) {
+        struct func_stat* fs = h.items[i];
+        struct symbol_info* si = fs->sym;
+        char name[512] = {0};
+        snprintf(name, sizeof(name)-1, "%s %s:%d", si && si->name ? si->name : "", si && si->source ? si->source : "", si ? si->line : 0);
+        lua_createtable(L, 0, 4);
+        lua_pushstring(L, name);
+        lua_setfield(L, -2, "name");
+        lua_pushinteger(L, (lua_Integer)fs->call_count);
+        lua_setfield(L, -2, "call_count");
+        lua_pushinteger(L, (lua_Integer)fs->cpu_cost_self);
+        lua_setfield(L, -2, "cpu_cost_self(ns)");
+        lua_pushinteger(L, (lua_Integer)fs->cpu_cost_incl);
+        lua_setfield(L, -2, "cpu_cost_incl(ns)");
+        lua_rawseti(L, -2, i + 1);
     }
-    set_profile_context(L, context);
+    pfree(h.items);
     context->running_in_hook = false;
-    
-    printf("luaprofile started, mem_profile_mode = %d, last_alloc_ud = %p\n", context->mem_profile_mode, context->last_alloc_ud);    
-    return 0;
+    return 1;
 }
 
+// 取 tag 名字（栈上 name_idx 处的字符串）对应的 id，没有则注册；超过 max_tags 后新的名字都归到 [other]
 static int
-lstop(lua_State* L) {
-    struct profile_context* context = get_profile_context(L);
-    if (context == NULL) {
-        printf("stop fail, profile not started\n");
-        return 0;
+_register_tag(lua_State* L, struct profile_context* context, int name_idx) {
+    name_idx = lua_absindex(L, name_idx);
+    lua_pushlightuserdata(L, &profile_tag_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, name_idx);
+    lua_rawget(L, -2);
+    if (lua_isinteger(L, -1)) {
+        int id = (int)lua_tointeger(L, -1);
+        lua_pop(L, 2);
+        return id;
     }
+    lua_pop(L, 1);
 
-    context->running_in_hook = true;
-    context->is_ready = false;
-    lua_setallocf(L, context->last_alloc_f, context->last_alloc_ud);
-    unset_profile_context(L);
-    profile_free(context);
-    context = NULL;
-    printf("luaprofile stopped\n");
-    return 0;
+    // tag_names 只分配一次、只追加，swap_dump 的工作线程可以同时读取已有的项
+    if (!context->tag_names) {
+        context->tag_names = (char**)pcalloc(context->max_tags + 2, sizeof(char*));
+    }
+    int id = 0;
+    if (context->tag_count < context->max_tags) {
+        id = ++context->tag_count;
+        context->tag_names[id] = pstrdup(lua_tostring(L, name_idx));
+    } else {
+        id = context->max_tags + 1;
+        if (!context->tag_names[id]) context->tag_names[id] = pstrdup("[other]");
+    }
+    lua_pushvalue(L, name_idx);
+    lua_pushinteger(L, id);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    return id;
 }
 
+// register_tag(name)：返回 tag id，热路径上用 id 调用 set_tag 不需要查名字
 static int
-lmark(lua_State* L) {
+lregister_tag(lua_State* L) {
     struct profile_context* context = get_profile_context(L);
-    if (context == NULL) {
-        printf("mark fail, profile not started\n");
+    if (!context) {
+        printf("register tag fail, profile not started\n");
         return 0;
     }
-    lua_State* co = lua_tothread(L, 1);
-    if(co == NULL) {
-        co = L;
+    luaL_checktype(L, 1, LUA_TSTRING);
+    lua_pushinteger(L, _register_tag(L, context, 1));
+    return 1;
+}
+
+/*
+set_tag(tag[, co])：tag 为名字、register_tag 返回的 id 或 nil（清除）。
+不传 co 时设置全局 tag；传 co 时设置该协程的 tag，协程的 tag 非 nil 时覆盖全局 tag。
+之后新压入的帧带上当前 tag，同一函数在不同 tag 下是不同的子节点，dump 时按 tag 汇总。
+*/
+static int
+lset_tag(lua_State* L) {
+    struct profile_context* context = get_profile_context(L);
+    if (!context) {
+        printf("set tag fail, profile not started\n");
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "profile not started");
+        return 2;
+    }
+    if (PROFILE_STRUCTURE_TREE != context->structure) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "tags need tree structure");
+        return 2;
+    }
+    int tag = 0;
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        tag = _register_tag(L, context, 1);
+    } else if (lua_isinteger(L, 1)) {
+        lua_Integer id = lua_tointeger(L, 1);
+        if (id < 1 || id > context->max_tags + 1 || !context->tag_names || !context->tag_names[id]) {
+            lua_pushboolean(L, false);
+            lua_pushstring(L, "invalid tag id");
+            return 2;
+        }
+        tag = (int)id;
+    } else if (!lua_isnoneornil(L, 1)) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "tag should be a string, a tag id or nil");
+        return 2;
     }
-    if(context->is_ready) {
-        lua_sethook(co, _hook_call, LUA_MASKCALL | LUA_MASKRET, 0);
+
+    if (lua_isthread(L, 2)) {
+        get_call_state(context, lua_tothread(L, 2))->tag = tag;
+    } else {
+        context->tag = tag;
     }
-    lua_pushboolean(L, context->is_ready);
+    lua_pushboolean(L, true);
     return 1;
 }
 
+// 取 zone 名字（栈上 name_idx 处的字符串）对应的 id，没有则登记。zone 的 key 是符号自身的地址，和 c 函数指针、lua 函数 key 都不会重复
 static int
-lunmark(lua_State* L) {
+_register_zone(lua_State* L, struct profile_context* context, int name_idx) {
+    name_idx = lua_absindex(L, name_idx);
+    lua_pushlightuserdata(L, &profile_zone_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, name_idx);
+    lua_rawget(L, -2);
+    if (lua_isinteger(L, -1)) {
+        int id = (int)lua_tointeger(L, -1);
+        lua_pop(L, 2);
+        return id;
+    }
+    lua_pop(L, 1);
+
+    struct symbol_info* si = (struct symbol_info*)pmalloc(sizeof(struct symbol_info));
+    si->key = (uint64_t)(uintptr_t)si;
+    si->proto = NULL;
+    si->kind = SYMBOL_KIND_ZONE;
+    si->resolved = true;
+    si->name = pstrdup(lua_tostring(L, name_idx));
+    si->source = pstrdup("[zone]");
+    si->line = 0;
+    si->lastline = 0;
+    si->hash_next = NULL;
+    imap_set(context->symbol_map, si->key, si);
+
+    if (context->zone_count >= context->zone_cap) {
+        context->zone_cap = context->zone_cap ? context->zone_cap * 2 : 16;
+        context->zone_keys = (uint64_t*)prealloc(context->zone_keys, sizeof(uint64_t) * context->zone_cap);
+    }
+    context->zone_keys[context->zone_count++] = si->key;
+    int id = context->zone_count;
+    lua_pushvalue(L, name_idx);
+    lua_pushinteger(L, id);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    return id;
+}
+
+// zone_register(name)：返回 zone id，热路径上用 id 调用 zone_begin 不需要查名字
+static int
+lzone_register(lua_State* L) {
     struct profile_context* context = get_profile_context(L);
-    if (context == NULL) {
-        printf("unmark fail, profile not started\n");
+    if (!context) {
+        printf("register zone fail, profile not started\n");
         return 0;
     }
-    lua_State* co = lua_tothread(L, 1);
-    if(co == NULL) {
-        co = L;
-    }
-    lua_sethook(co, NULL, 0, 0);
-    return 0;
+    luaL_checktype(L, 1, LUA_TSTRING);
+    lua_pushinteger(L, _register_zone(L, context, 1));
+    return 1;
 }
 
+// zone API 自己是 c 函数，装了 hook 时栈顶是它自己的帧（没有被过滤时），zone 帧要放在它下面
+static inline bool
+_zone_api_frame_on_top(struct call_state* cs, lua_State* L) {
+    struct call_frame* top = cur_callframe(cs);
+    return top && !top->zone && top->ci == L->ci;
+}
+
+/*
+zone_begin(zone)：zone 为 zone_register 返回的 id 或名字。在当前协程的调用栈上压一个 zone 帧，和 hook 压的帧共用调用栈和调用树，
+可以和函数、其他 zone 互相嵌套，协程挂起的时间同样扣除。不装 hook（start 时 instrument = false）时也可以用，
+这时协程切换只在 zone_begin/zone_end 时发现。zone 要在打开它的函数里 zone_end；装了 hook 时，函数返回时没有结束的 zone 自动结束。
+*/
 static int
-lmark_all(lua_State* L) {
-    struct profile_context* ctx = get_profile_context(L);
-    if (!ctx) {
-        printf("mark all co fail, profile not started\n");
+lzone_begin(lua_State* L) {
+    struct profile_context* context = get_hook_context(L);
+    if (!context) {
         lua_pushboolean(L, false);
         lua_pushstring(L, "profile not started");
         return 2;
     }
-    lua_State* states[MAX_CO_SIZE] = {0};
-    int i = get_all_coroutines(L, states, MAX_CO_SIZE);
-    for (i = i - 1; i >= 0; i--) {
-        lua_sethook(states[i], _hook_call, LUA_MASKCALL | LUA_MASKRET, 0);
+    uint64_t key = 0;
+    if (lua_isinteger(L, 1)) {
+        lua_Integer id = lua_tointeger(L, 1);
+        if (id < 1 || id > context->zone_count) {
+            lua_pushboolean(L, false);
+            lua_pushstring(L, "invalid zone id");
+            return 2;
+        }
+        key = context->zone_keys[id - 1];
+    } else if (lua_type(L, 1) == LUA_TSTRING) {
+        key = context->zone_keys[_register_zone(L, context, 1) - 1];
+    } else {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "zone should be a zone id or a name");
+        return 2;
+    }
+    if (!context->is_ready || context->paused) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "profile paused");
+        return 2;
     }
-    lua_pushboolean(L, true);
-    return 1;
-}
 
-static int 
-lunmark_all(lua_State* L) {
-    struct profile_context* ctx = get_profile_context(L);
-    if (!ctx) {
-        printf("unhook all co fail, profile not started\n");
+    // 同 hook：count 级别不读时钟和计数器，只统计次数
+    bool timed = PROFILE_LEVEL_COUNT != active_level(context);
+    uint64_t now = timed ? get_mono_ns() : 0;
+    context->running_in_hook = true;
+    if (timed) counters_sample(context);
+    bool co_switched = false;
+    bool resynced = false;
+    struct call_state* cs = enter_call_state(context, L, now, true, &co_switched, &resynced, timed);
+    if (cs->top >= MAX_CALL_SIZE) {
+        context->running_in_hook = false;
         lua_pushboolean(L, false);
-        lua_pushstring(L, "profile not started");
+        lua_pushstring(L, "call stack overflow");
         return 2;
     }
-    _unhook_all_coroutines(L);
+    bool api_on_top = _zone_api_frame_on_top(cs, L);
+    struct call_frame* pre_frame = cur_callframe(cs);
+    if (api_on_top) pre_frame = cs->top >= 2 ? &cs->call_list[cs->top - 2] : NULL;
+    struct call_frame* frame = push_callframe(cs);
+    if (api_on_top) {
+        *frame = cs->call_list[cs->top - 2];
+        frame = &cs->call_list[cs->top - 2];
+    }
+
+    frame->key = key;
+    frame->call_time = now;
+    frame->tail_pending = false;
+    frame->skip_cost = false;
+    frame->holds_active = false;
+    frame->filtered = false;
+    frame->zone = true;
+    frame->recursion = 0;
+    frame->tag = cs->tag ? cs->tag : context->tag;
+    frame->ci = L->ci->previous;
+    frame->co_cost = 0;
+    frame->child_cost = 0;
+    if (timed) frame_counters_begin(context, frame, context->ctr_now);
+    frame->lines = NULL;
+    frame->line = 0;
+    if (PROFILE_STRUCTURE_GRAPH == context->structure) {
+        graph_enter_frame(context, cs, pre_frame, frame);
+    } else {
+        frame->func = get_func_stat(context, key);
+        ++frame->func->call_count;
+        func_enter_frame(cs, frame);
+        frame->edge = NULL;
+        frame->path = get_frame_path(context, pre_frame ? pre_frame->path : NULL, frame);
+        node_add_call(context, (struct callpath_node*)icallpath_getvalue(frame->path));
+        if (context->fold_recursion) fold_enter_frame(cs, frame);
+    }
+    context->running_in_hook = false;
     lua_pushboolean(L, true);
     return 1;
 }
 
+// zone_end()：结束当前协程最内层的 zone，只能在打开它的函数里调用
 static int
-ldump(lua_State* L) {
-    struct profile_context* context = get_profile_context(L);
-    if (context) {
-        // update root cpu cost
-        if (context->callpath) {
-            struct callpath_node* root = (struct callpath_node*)icallpath_getvalue(context->callpath);
-            root->cpu_cost_raw = get_mono_ns() - context->start_time;
-        }
-
-        // full gc to free objects, make mem profile more accurate
-        if (PROFILE_MODE_ON ==context->mem_profile_mode) {
-            lua_gc(L, LUA_GCCOLLECT, 0);
-        }
-
-        // stop gc before dump
-        int gc_was_running = _stop_gc_if_need(L); 
-        context->running_in_hook = true;
-
-        uint64_t cur_time = get_mono_ns();
-        double profile_duration = (cur_time - context->start_time)*1.0/NANOSEC;
-        lua_pushnumber(L, profile_duration);
-
-        // dump
-        if (context->callpath) {
-            dump_call_path(context, L);
-        } else {
-            lua_newtable(L);
-        }
+lzone_end(lua_State* L) {
+    struct profile_context* context = get_hook_context(L);
+    if (!context) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "profile not started");
+        return 2;
+    }
+    if (!context->is_ready || context->paused) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "profile paused");
+        return 2;
+    }
 
+    bool timed = PROFILE_LEVEL_COUNT != active_level(context);
+    uint64_t now = timed ? get_mono_ns() : 0;
+    context->running_in_hook = true;
+    if (timed) counters_sample(context);
+    bool co_switched = false;
+    bool resynced = false;
+    struct call_state* cs = enter_call_state(context, L, now, true, &co_switched, &resynced, timed);
+    bool api_on_top = _zone_api_frame_on_top(cs, L);
+    int idx = cs->top - 1 - (api_on_top ? 1 : 0);
+    if (idx < 0 || !cs->call_list[idx].zone || cs->call_list[idx].ci != L->ci->previous) {
         context->running_in_hook = false;
-        _restart_gc_if_need(L, gc_was_running);
+        lua_pushboolean(L, false);
+        lua_pushstring(L, "no open zone in this function");
         return 2;
     }
-    return 0;
+    struct call_frame zone_frame = cs->call_list[idx];
+    if (api_on_top) cs->call_list[idx] = cs->call_list[idx + 1];
+    cs->top--;
+    uint64_t cost = settle_frame_on_return(context, &zone_frame, now, timed ? context->ctr_now : NULL);
+    if (idx > 0) cs->call_list[idx - 1].child_cost += cost;
+    context->running_in_hook = false;
+    lua_pushboolean(L, true);
+    return 1;
 }
 
 static int lget_mono_ns(lua_State* L) {
@@ -1291,7 +5801,25 @@ luaopen_luaprofilecore(lua_State* L) {
         {"unmark", lunmark},
         {"mark_all", lmark_all},
         {"unmark_all", lunmark_all},
+        {"pause", lpause},
+        {"resume", lresume},
         {"dump", ldump},
+        {"dump_json", ldump_json},
+        {"window_dump", lwindow_dump},
+        {"swap_dump", lswap_dump},
+        {"swap_wait", lswap_wait},
+        {"dump_async", ldump_async},
+        {"dump_poll", ldump_poll},
+        {"profile_lines", lprofile_lines},
+        {"dump_lines", ldump_lines},
+        {"register_tag", lregister_tag},
+        {"top", ltop},
+        {"mark_generation", lmark_generation},
+        {"leak_report", lleak_report},
+        {"set_tag", lset_tag},
+        {"zone_register", lzone_register},
+        {"zone_begin", lzone_begin},
+        {"zone_end", lzone_end},
         {"getnanosec", lget_mono_ns},
         {"sleep", lsleep},
         {NULL, NULL},
@@ -0,0 +1,1400 @@
+/*
+lpmerge：离线合并多个进程的 luaprofile dump，或者对比基线和候选两个 dump 的逐路径差异。
+
+    lpmerge merge [-o out.json] [--average] a.json b.json ...
+    lpmerge diff [-o out.jsonl] [--top n] [--per-second] baseline.json candidate.json
+
+输入为 dump_json/swap_dump/dump_async 写出的 json，节点的 name 必须是第一个字段，有 tag 时紧跟在 name 后面（这些接口都是这样写的），
+这样读到 name 和 tag 就能确定节点在合并树上的位置，之后的字段和子节点直接累加，不需要把整个节点缓存下来。
+同一个函数在不同 tag 下是不同的节点，按 (name, tag) 对齐。
+输入文件名为 "-" 时从标准输入读。编译成库使用时定义 LPMERGE_NO_MAIN，接口见 lpmerge.h。
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <math.h>
+#include <errno.h>
+#include "lpmerge.h"
+
+#define prealloc  realloc
+#define pmalloc   malloc
+#define pfree     free
+#define pcalloc   calloc
+
+#define READ_BUFFER_SIZE    (64*1024)
+#define WRITE_BUFFER_SIZE   (256*1024)
+#define MAX_NUMBER_LEN      64
+#define SIDES               2
+
+// 字段的合并方式
+enum FIELD_KIND {
+    FIELD_ADD,          // 累加
+    FIELD_MAX,          // 取最大值，如 last_ret_time
+    FIELD_DERIVED,      // 由其他字段算出来的，读入时忽略，写出时重新计算
+};
+
+// 数值字段，group 非空时是嵌套对象里的字段，如 counters.instructions
+struct field_def {
+    char*   group;
+    char*   key;
+    int     kind;       // define in FIELD_KIND enum
+    bool    real;       // 出现过小数，按 double 写出
+    uint64_t hash;
+};
+
+struct field_value {
+    int     field;
+    int64_t i;
+    double  d;
+};
+
+// 节点上的字符串字段（level/active_level），保留第一次读到的
+struct string_value {
+    int     field;
+    char*   s;
+};
+
+struct merge_node {
+    char*   name;
+    char*   tag;                    // tag 子树的根节点所属的 tag，其他节点为 NULL
+    uint64_t key_hash;              // (name, tag) 的哈希
+    struct merge_node* parent;
+    struct merge_node* first_child;
+    struct merge_node* next_sibling;
+    struct merge_node* hash_next;   // 子节点哈希表中同一个桶的下一个节点
+    struct field_value* values[SIDES];  // 稀疏存储，节点上的字段通常只有十几个
+    int     value_count[SIDES];
+    int     value_cap[SIDES];
+    struct string_value* strings;
+    int     string_count;
+};
+
+struct lpmerge {
+    struct merge_node* root;
+    struct merge_node* tags;        // 根节点 tags 数组中各 tag 的合计，按 tag 名字合并，next_sibling 串起来
+    struct merge_node** buckets;    // (parent, name, tag) -> 子节点
+    size_t  bucket_count;
+    size_t  node_count;
+    struct field_def* fields;
+    int     field_count;
+    int     field_cap;
+    int*    field_slots;            // 字段哈希表，开放寻址，存 field 下标 + 1
+    size_t  field_slot_count;
+    int     inputs[SIDES];
+    double  duration[SIDES];
+    char    start_time[SIDES][32];  // 最早的 start_time，格式为 "YYYY-MM-DD HH:MM:SS"，可以直接按字符串比较
+};
+
+static uint64_t
+hash_bytes(uint64_t h, const char* s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t
+hash_string(const char* s) {
+    return hash_bytes(14695981039346656037ULL, s, strlen(s));
+}
+
+static inline char*
+pstrdup(const char* s) {
+    size_t n = strlen(s);
+    char* d = (char*)pmalloc(n + 1);
+    memcpy(d, s, n + 1);
+    return d;
+}
+
+static uint64_t
+hash_node_key(const char* name, const char* tag) {
+    uint64_t h = hash_string(name);
+    if (tag) {
+        h = hash_bytes(h, "\0", 1);
+        h = hash_bytes(h, tag, strlen(tag));
+    }
+    return h;
+}
+
+static struct merge_node*
+merge_node_create(const char* name, const char* tag, uint64_t key_hash, struct merge_node* parent) {
+    struct merge_node* node = (struct merge_node*)pcalloc(1, sizeof(*node));
+    node->name = pstrdup(name);
+    node->tag = tag ? pstrdup(tag) : NULL;
+    node->key_hash = key_hash;
+    node->parent = parent;
+    return node;
+}
+
+struct lpmerge*
+lpmerge_create(void) {
+    struct lpmerge* m = (struct lpmerge*)pcalloc(1, sizeof(*m));
+    m->bucket_count = 1024;
+    m->buckets = (struct merge_node**)pcalloc(m->bucket_count, sizeof(struct merge_node*));
+    m->field_slot_count = 256;
+    m->field_slots = (int*)pcalloc(m->field_slot_count, sizeof(int));
+    return m;
+}
+
+static void
+merge_node_free(struct merge_node* node) {
+    for (int s = 0; s < SIDES; s++) {
+        pfree(node->values[s]);
+    }
+    for (int i = 0; i < node->string_count; i++) {
+        pfree(node->strings[i].s);
+    }
+    pfree(node->strings);
+    pfree(node->name);
+    pfree(node->tag);
+    pfree(node);
+}
+
+void
+lpmerge_free(struct lpmerge* m) {
+    if (!m) return;
+    for (size_t b = 0; b < m->bucket_count; b++) {
+        struct merge_node* node = m->buckets[b];
+        while (node) {
+            struct merge_node* next = node->hash_next;
+            merge_node_free(node);
+            node = next;
+        }
+    }
+    if (m->root) merge_node_free(m->root);
+    while (m->tags) {
+        struct merge_node* next = m->tags->next_sibling;
+        merge_node_free(m->tags);
+        m->tags = next;
+    }
+    for (int i = 0; i < m->field_count; i++) {
+        pfree(m->fields[i].group);
+        pfree(m->fields[i].key);
+    }
+    pfree(m->fields);
+    pfree(m->field_slots);
+    pfree(m->buckets);
+    pfree(m);
+}
+
+static inline size_t
+_child_bucket(const struct lpmerge* m, const struct merge_node* parent, uint64_t key_hash) {
+    uint64_t h = key_hash ^ ((uint64_t)(uintptr_t)parent * 0x9E3779B97F4A7C15ULL);
+    return (size_t)(h ^ (h >> 29)) & (m->bucket_count - 1);
+}
+
+static void
+_grow_buckets(struct lpmerge* m) {
+    size_t old_count = m->bucket_count;
+    struct merge_node** old = m->buckets;
+    m->bucket_count = old_count * 2;
+    m->buckets = (struct merge_node**)pcalloc(m->bucket_count, sizeof(struct merge_node*));
+    for (size_t b = 0; b < old_count; b++) {
+        struct merge_node* node = old[b];
+        while (node) {
+            struct merge_node* next = node->hash_next;
+            size_t idx = _child_bucket(m, node->parent, node->key_hash);
+            node->hash_next = m->buckets[idx];
+            m->buckets[idx] = node;
+            node = next;
+        }
+    }
+    pfree(old);
+}
+
+static inline bool
+_same_tag(const char* a, const char* b) {
+    if (!a || !b) return a == b;
+    return strcmp(a, b) == 0;
+}
+
+// 取 parent 下 (name, tag) 的子节点，没有时创建；tag 为 NULL 表示不是 tag 子树的根；parent 为 NULL 时取根节点
+static struct merge_node*
+get_child(struct lpmerge* m, struct merge_node* parent, const char* name, const char* tag) {
+    uint64_t key_hash = hash_node_key(name, tag);
+    if (!parent) {
+        if (!m->root) m->root = merge_node_create(name, NULL, key_hash, NULL);
+        return m->root;
+    }
+    size_t idx = _child_bucket(m, parent, key_hash);
+    for (struct merge_node* node = m->buckets[idx]; node; node = node->hash_next) {
+        if (node->parent == parent && node->key_hash == key_hash && strcmp(node->name, name) == 0 && _same_tag(node->tag, tag)) {
+            return node;
+        }
+    }
+    struct merge_node* node = merge_node_create(name, tag, key_hash, parent);
+    node->next_sibling = parent->first_child;
+    parent->first_child = node;
+    node->hash_next = m->buckets[idx];
+    m->buckets[idx] = node;
+    if (++m->node_count > m->bucket_count) _grow_buckets(m);
+    return node;
+}
+
+// 根节点 tags 数组中名为 tag 的合计，没有时追加
+static struct merge_node*
+get_tag_total(struct lpmerge* m, const char* tag) {
+    struct merge_node** link = &m->tags;
+    for (; *link; link = &(*link)->next_sibling) {
+        if (strcmp((*link)->name, tag) == 0) return *link;
+    }
+    *link = merge_node_create(tag, NULL, 0, NULL);
+    return *link;
+}
+
+static int
+_field_kind(const char* group, const char* key) {
+    if (!group) {
+        if (strcmp(key, "last_ret_time") == 0) return FIELD_MAX;
+        if (strcmp(key, "cpu_cost_raw(%)") == 0 || strcmp(key, "cpu_cost_real(%)") == 0
+            || strcmp(key, "inuse_bytes") == 0 || strcmp(key, "avg_profiler_cost_per_call(ns)") == 0) {
+            return FIELD_DERIVED;
+        }
+    } else if (strcmp(group, "counters") == 0 && strcmp(key, "ipc") == 0) {
+        return FIELD_DERIVED;
+    }
+    return FIELD_ADD;
+}
+
+static uint64_t
+_field_hash(const char* group, const char* key) {
+    uint64_t h = hash_string(group ? group : "");
+    h = hash_bytes(h, "\0", 1);
+    return hash_bytes(h, key, strlen(key));
+}
+
+static inline bool
+_field_match(const struct field_def* f, const char* group, const char* key) {
+    if ((f->group == NULL) != (group == NULL)) return false;
+    if (group && strcmp(f->group, group) != 0) return false;
+    return strcmp(f->key, key) == 0;
+}
+
+// 按 (group, key) 取字段下标，第一次见到时登记，字段在输出中按登记的顺序排列
+static int
+get_field(struct lpmerge* m, const char* group, const char* key) {
+    uint64_t h = _field_hash(group, key);
+    size_t mask = m->field_slot_count - 1;
+    size_t idx = (size_t)h & mask;
+    while (m->field_slots[idx]) {
+        struct field_def* f = &m->fields[m->field_slots[idx] - 1];
+        if (f->hash == h && _field_match(f, group, key)) return m->field_slots[idx] - 1;
+        idx = (idx + 1) & mask;
+    }
+    if (m->field_count >= m->field_cap) {
+        m->field_cap = m->field_cap ? m->field_cap * 2 : 64;
+        m->fields = (struct field_def*)prealloc(m->fields, sizeof(struct field_def) * m->field_cap);
+    }
+    int id = m->field_count++;
+    struct field_def* f = &m->fields[id];
+    f->group = group ? pstrdup(group) : NULL;
+    f->key = pstrdup(key);
+    f->kind = _field_kind(group, key);
+    f->real = false;
+    f->hash = h;
+    m->field_slots[idx] = id + 1;
+    if ((size_t)m->field_count * 2 > m->field_slot_count) {
+        // 扩容后重新放置
+        pfree(m->field_slots);
+        m->field_slot_count *= 2;
+        m->field_slots = (int*)pcalloc(m->field_slot_count, sizeof(int));
+        mask = m->field_slot_count - 1;
+        for (int i = 0; i < m->field_count; i++) {
+            size_t j = (size_t)m->fields[i].hash & mask;
+            while (m->field_slots[j]) j = (j + 1) & mask;
+            m->field_slots[j] = i + 1;
+        }
+    }
+    return id;
+}
+
+// 只在已登记时返回下标，否则返回 -1
+static int
+find_field(const struct lpmerge* m, const char* group, const char* key) {
+    uint64_t h = _field_hash(group, key);
+    size_t mask = m->field_slot_count - 1;
+    size_t idx = (size_t)h & mask;
+    while (m->field_slots[idx]) {
+        const struct field_def* f = &m->fields[m->field_slots[idx] - 1];
+        if (f->hash == h && _field_match(f, group, key)) return m->field_slots[idx] - 1;
+        idx = (idx + 1) & mask;
+    }
+    return -1;
+}
+
+static struct field_value*
+node_value(const struct merge_node* node, int side, int field) {
+    if (field < 0) return NULL;
+    for (int i = 0; i < node->value_count[side]; i++) {
+        if (node->values[side][i].field == field) return &node->values[side][i];
+    }
+    return NULL;
+}
+
+static double
+node_number(const struct lpmerge* m, const struct merge_node* node, int side, int field) {
+    const struct field_value* v = node_value(node, side, field);
+    if (!v) return 0;
+    return m->fields[field].real ? v->d : (double)v->i;
+}
+
+static void
+node_add_value(struct lpmerge* m, struct merge_node* node, int side, int field, int64_t i, double d) {
+    const struct field_def* f = &m->fields[field];
+    if (FIELD_DERIVED == f->kind) return;
+    struct field_value* v = node_value(node, side, field);
+    if (!v) {
+        if (node->value_count[side] >= node->value_cap[side]) {
+            node->value_cap[side] = node->value_cap[side] ? node->value_cap[side] * 2 : 16;
+            node->values[side] = (struct field_value*)prealloc(node->values[side],
+                sizeof(struct field_value) * node->value_cap[side]);
+        }
+        v = &node->values[side][node->value_count[side]++];
+        v->field = field;
+        v->i = i;
+        v->d = d;
+        return;
+    }
+    if (FIELD_MAX == f->kind) {
+        if (i > v->i) v->i = i;
+        if (d > v->d) v->d = d;
+    } else {
+        v->i += i;
+        v->d += d;
+    }
+}
+
+static void
+node_set_string(struct lpmerge* m, struct merge_node* node, const char* key, const char* s) {
+    int field = get_field(m, NULL, key);
+    for (int i = 0; i < node->string_count; i++) {
+        if (node->strings[i].field == field) return;
+    }
+    node->strings = (struct string_value*)prealloc(node->strings, sizeof(struct string_value) * (node->string_count + 1));
+    node->strings[node->string_count].field = field;
+    node->strings[node->string_count].s = pstrdup(s);
+    node->string_count++;
+}
+
+/*
+流式读取：按块读文件，只保留当前的字符串和数字，嵌套的节点用显式栈处理，深树不会撑爆 C 栈
+*/
+struct reader {
+    FILE*   fp;
+    const char* name;
+    char    buf[READ_BUFFER_SIZE];
+    size_t  pos;
+    size_t  len;
+    int     line;
+    char*   str;        // 最近读到的字符串
+    size_t  str_len;
+    size_t  str_cap;
+    char*   err;
+    size_t  errsz;
+    bool    failed;
+};
+
+static bool
+rd_fail(struct reader* r, const char* fmt, ...) {
+    if (r->failed) return false;
+    r->failed = true;
+    int n = snprintf(r->err, r->errsz, "%s:%d: ", r->name, r->line);
+    if (n < 0) n = 0;
+    if ((size_t)n < r->errsz) {
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(r->err + n, r->errsz - (size_t)n, fmt, ap);
+        va_end(ap);
+    }
+    return false;
+}
+
+static inline int
+rd_peek(struct reader* r) {
+    if (r->pos >= r->len) {
+        r->len = fread(r->buf, 1, sizeof(r->buf), r->fp);
+        r->pos = 0;
+        if (r->len == 0) return -1;
+    }
+    return (unsigned char)r->buf[r->pos];
+}
+
+static inline int
+rd_get(struct reader* r) {
+    int c = rd_peek(r);
+    if (c >= 0) {
+        r->pos++;
+        if (c == '\n') r->line++;
+    }
+    return c;
+}
+
+static inline void
+rd_skip_ws(struct reader* r) {
+    for (;;) {
+        int c = rd_peek(r);
+        if (c != ' ' && c != '\t' && c != '\n' && c != '\r') return;
+        rd_get(r);
+    }
+}
+
+static bool
+rd_expect(struct reader* r, char want) {
+    rd_skip_ws(r);
+    int c = rd_get(r);
+    if (c != want) {
+        if (c < 0) return rd_fail(r, "unexpected end of input, expect '%c'", want);
+        return rd_fail(r, "expect '%c' but got '%c'", want, c);
+    }
+    return true;
+}
+
+static inline void
+_str_push(struct reader* r, char c) {
+    if (r->str_len + 1 >= r->str_cap) {
+        r->str_cap = r->str_cap ? r->str_cap * 2 : 256;
+        r->str = (char*)prealloc(r->str, r->str_cap);
+    }
+    r->str[r->str_len++] = c;
+}
+
+static void
+_str_push_utf8(struct reader* r, uint32_t cp) {
+    if (cp < 0x80) {
+        _str_push(r, (char)cp);
+    } else if (cp < 0x800) {
+        _str_push(r, (char)(0xC0 | (cp >> 6)));
+        _str_push(r, (char)(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        _str_push(r, (char)(0xE0 | (cp >> 12)));
+        _str_push(r, (char)(0x80 | ((cp >> 6) & 0x3F)));
+        _str_push(r, (char)(0x80 | (cp & 0x3F)));
+    } else {
+        _str_push(r, (char)(0xF0 | (cp >> 18)));
+        _str_push(r, (char)(0x80 | ((cp >> 12) & 0x3F)));
+        _str_push(r, (char)(0x80 | ((cp >> 6) & 0x3F)));
+        _str_push(r, (char)(0x80 | (cp & 0x3F)));
+    }
+}
+
+static bool
+_rd_hex4(struct reader* r, uint32_t* out) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) {
+        int c = rd_get(r);
+        v <<= 4;
+        if (c >= '0' && c <= '9') v |= (uint32_t)(c - '0');
+        else if (c >= 'a' && c <= 'f') v |= (uint32_t)(c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F') v |= (uint32_t)(c - 'A' + 10);
+        else return rd_fail(r, "invalid \\u escape");
+    }
+    *out = v;
+    return true;
+}
+
+// 读一个字符串到 r->str
+static bool
+rd_string(struct reader* r) {
+    if (!rd_expect(r, '"')) return false;
+    r->str_len = 0;
+    for (;;) {
+        int c = rd_get(r);
+        if (c < 0) return rd_fail(r, "unterminated string");
+        if (c == '"') break;
+        if (c != '\\') {
+            _str_push(r, (char)c);
+            continue;
+        }
+        c = rd_get(r);
+        switch (c) {
+        case '"': case '\\': case '/': _str_push(r, (char)c); break;
+        case 'b': _str_push(r, '\b'); break;
+        case 'f': _str_push(r, '\f'); break;
+        case 'n': _str_push(r, '\n'); break;
+        case 'r': _str_push(r, '\r'); break;
+        case 't': _str_push(r, '\t'); break;
+        case 'u': {
+            uint32_t cp;
+            if (!_rd_hex4(r, &cp)) return false;
+            if (cp >= 0xD800 && cp < 0xDC00 && rd_peek(r) == '\\') {
+                uint32_t lo;
+                rd_get(r);
+                if (rd_get(r) != 'u' || !_rd_hex4(r, &lo)) return rd_fail(r, "invalid surrogate pair");
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+            }
+            _str_push_utf8(r, cp);
+            break;
+        }
+        default:
+            return rd_fail(r, "invalid escape");
+        }
+    }
+    _str_push(r, '\0');
+    r->str_len--;
+    return true;
+}
+
+// 读一个数字，整数精确保存在 i 里，带小数或指数的 real 为 true
+static bool
+rd_number(struct reader* r, int64_t* i, double* d, bool* real) {
+    char num[MAX_NUMBER_LEN];
+    size_t n = 0;
+    *real = false;
+    for (;;) {
+        int c = rd_peek(r);
+        if (!((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E')) break;
+        if (c == '.' || c == 'e' || c == 'E') *real = true;
+        if (n + 1 >= sizeof(num)) return rd_fail(r, "number too long");
+        num[n++] = (char)rd_get(r);
+    }
+    num[n] = '\0';
+    if (n == 0) return rd_fail(r, "expect a number");
+    char* end = NULL;
+    errno = 0;
+    *d = strtod(num, &end);
+    if (*end != '\0') return rd_fail(r, "invalid number %s", num);
+    if (*real) {
+        *i = (int64_t)llround(*d);
+    } else {
+        *i = (int64_t)strtoll(num, NULL, 10);
+        if (errno == ERANGE) {
+            *real = true;
+            *i = 0;
+        }
+    }
+    return true;
+}
+
+// 跳过一个任意的值，嵌套只计深度
+static bool
+rd_skip_value(struct reader* r) {
+    int depth = 0;
+    do {
+        rd_skip_ws(r);
+        int c = rd_peek(r);
+        if (c < 0) return rd_fail(r, "unexpected end of input");
+        if (c == '"') {
+            if (!rd_string(r)) return false;
+        } else if (c == '{' || c == '[') {
+            rd_get(r);
+            depth++;
+        } else if (c == '}' || c == ']') {
+            rd_get(r);
+            depth--;
+        } else if (c == ',' || c == ':') {
+            rd_get(r);
+        } else {
+            // 数字和 true/false/null
+            while ((c = rd_peek(r)) >= 0 && c != ',' && c != '}' && c != ']' && c != ' ' && c != '\n' && c != '\r' && c != '\t') {
+                rd_get(r);
+            }
+        }
+    } while (depth > 0);
+    return true;
+}
+
+// 读一个数值字段的值并累加到节点上，不是数字的值跳过
+static bool
+_read_field_value(struct lpmerge* m, struct reader* r, struct merge_node* node, int side, const char* group, const char* key) {
+    rd_skip_ws(r);
+    int c = rd_peek(r);
+    if (!((c >= '0' && c <= '9') || c == '-')) return rd_skip_value(r);
+    int64_t i;
+    double d;
+    bool real;
+    if (!rd_number(r, &i, &d, &real)) return false;
+    int field = get_field(m, group, key);
+    if (real) m->fields[field].real = true;
+    node_add_value(m, node, side, field, i, d);
+    return true;
+}
+
+// counters、alloc_sizes 这类只有一层的数值对象，字段名记为 group.key
+static bool
+_read_group(struct lpmerge* m, struct reader* r, struct merge_node* node, int side, const char* group) {
+    if (!rd_expect(r, '{')) return false;
+    rd_skip_ws(r);
+    if (rd_peek(r) == '}') {
+        rd_get(r);
+        return true;
+    }
+    for (;;) {
+        if (!rd_string(r)) return false;
+        char key[256];
+        snprintf(key, sizeof(key), "%s", r->str);
+        if (!rd_expect(r, ':')) return false;
+        if (!_read_field_value(m, r, node, side, group, key)) return false;
+        rd_skip_ws(r);
+        int c = rd_get(r);
+        if (c == '}') return true;
+        if (c != ',') return rd_fail(r, "expect ',' or '}' in %s", group);
+    }
+}
+
+struct parse_frame {
+    struct merge_node* parent;
+    struct merge_node* node;    // 读到 name 和 tag 之前为 NULL
+    char* name;                 // 已读到 name，还在等后面可能紧跟的 tag
+    bool first;                 // 还没有读到任何字段
+};
+
+// 读到 name 之后的第一个字段不是 tag 时，节点就是 (name, NULL)
+static void
+_resolve_frame_node(struct lpmerge* m, struct parse_frame* f, const char* tag) {
+    f->node = get_child(m, f->parent, f->name, tag);
+    pfree(f->name);
+    f->name = NULL;
+}
+
+// 根节点的 tags 数组：每项为 { tag, call_count, cpu_cost_raw(ns), ... }，tag 在最前面，按 tag 名字累加
+static bool
+_read_tags(struct lpmerge* m, struct reader* r, int side) {
+    if (!rd_expect(r, '[')) return false;
+    rd_skip_ws(r);
+    if (rd_peek(r) == ']') {
+        rd_get(r);
+        return true;
+    }
+    for (;;) {
+        rd_skip_ws(r);
+        if (rd_peek(r) != '{') {
+            // 不认识的项跳过
+            if (!rd_skip_value(r)) return false;
+            goto next;
+        }
+        rd_get(r);
+        struct merge_node* total = NULL;
+        bool first = true;
+        for (;;) {
+            rd_skip_ws(r);
+            int c = rd_peek(r);
+            if (c == '}') {
+                rd_get(r);
+                break;
+            }
+            if (!first) {
+                if (c != ',') return rd_fail(r, "expect ',' or '}' in tags");
+                rd_get(r);
+            }
+            first = false;
+            if (!rd_string(r) || !rd_expect(r, ':')) return false;
+            if (strcmp(r->str, "tag") == 0) {
+                if (!rd_string(r)) return false;
+                total = get_tag_total(m, r->str);
+                continue;
+            }
+            if (!total) return rd_fail(r, "\"tag\" should be the first key in tags");
+            char key[256];
+            snprintf(key, sizeof(key), "%s", r->str);
+            if (!_read_field_value(m, r, total, side, NULL, key)) return false;
+        }
+    next:
+        rd_skip_ws(r);
+        int c = rd_get(r);
+        if (c == ']') return true;
+        if (c != ',') return rd_fail(r, "expect ',' or ']' in tags");
+    }
+}
+
+// 读 nodes 的值：一个节点对象，children 里的子节点按同样的格式递归
+static bool
+parse_nodes(struct lpmerge* m, struct reader* r, int side) {
+    struct parse_frame* stack = NULL;
+    size_t top = 0;
+    size_t cap = 0;
+    bool ok = false;
+    char group[256];
+
+#define PUSH_FRAME(p) do { \
+        if (top >= cap) { \
+            cap = cap ? cap * 2 : 64; \
+            stack = (struct parse_frame*)prealloc(stack, sizeof(struct parse_frame) * cap); \
+        } \
+        stack[top].parent = (p); \
+        stack[top].node = NULL; \
+        stack[top].name = NULL; \
+        stack[top].first = true; \
+        top++; \
+    } while (0)
+
+    if (!rd_expect(r, '{')) goto done;
+    PUSH_FRAME(NULL);
+    while (top > 0) {
+        struct parse_frame* f = &stack[top - 1];
+        rd_skip_ws(r);
+        int c = rd_peek(r);
+        if (c == '}') {
+            rd_get(r);
+            if (f->name) _resolve_frame_node(m, f, NULL);
+            if (!f->node) {
+                rd_fail(r, "node without name");
+                goto done;
+            }
+            top--;
+            if (top == 0) break;
+            // 回到父节点的 children 数组
+            rd_skip_ws(r);
+            c = rd_get(r);
+            if (c == ',') {
+                if (!rd_expect(r, '{')) goto done;
+                struct merge_node* parent = stack[top - 1].node;
+                PUSH_FRAME(parent);
+            } else if (c != ']') {
+                rd_fail(r, "expect ',' or ']' in children");
+                goto done;
+            }
+            continue;
+        }
+        if (!f->first) {
+            if (c != ',') {
+                rd_fail(r, "expect ',' or '}' in node");
+                goto done;
+            }
+            rd_get(r);
+        }
+        if (!rd_string(r) || !rd_expect(r, ':')) goto done;
+        if (f->first && strcmp(r->str, "name") == 0) {
+            f->first = false;
+            if (!rd_string(r)) goto done;
+            f->name = pstrdup(r->str);
+            continue;
+        }
+        f->first = false;
+        if (f->name) {
+            if (strcmp(r->str, "tag") == 0) {
+                if (!rd_string(r)) goto done;
+                _resolve_frame_node(m, f, r->str);
+                continue;
+            }
+            _resolve_frame_node(m, f, NULL);
+        }
+        if (!f->node) {
+            rd_fail(r, "\"name\" should be the first key of a node, use the output of dump_json/swap_dump/dump_async");
+            goto done;
+        }
+        if (strcmp(r->str, "tag") == 0) {
+            rd_fail(r, "\"tag\" should follow \"name\", use the output of dump_json/swap_dump/dump_async");
+            goto done;
+        }
+        if (strcmp(r->str, "children") == 0) {
+            if (!rd_expect(r, '[')) goto done;
+            rd_skip_ws(r);
+            if (rd_peek(r) == ']') {
+                rd_get(r);
+                continue;
+            }
+            if (!rd_expect(r, '{')) goto done;
+            // PUSH_FRAME 可能重新分配 stack，先取出 node
+            struct merge_node* parent = f->node;
+            PUSH_FRAME(parent);
+            continue;
+        }
+        snprintf(group, sizeof(group), "%s", r->str);
+        rd_skip_ws(r);
+        c = rd_peek(r);
+        if (c == '"') {
+            if (!rd_string(r)) goto done;
+            if (strcmp(group, "level") == 0 || strcmp(group, "active_level") == 0) {
+                node_set_string(m, f->node, group, r->str);
+            }
+        } else if (c == '[' && strcmp(group, "tags") == 0) {
+            if (!_read_tags(m, r, side)) goto done;
+        } else if (c == '{') {
+            // 各进程自己校准的开销不能相加
+            bool ok_group = strcmp(group, "overhead_per_event(ns)") == 0 ? rd_skip_value(r) : _read_group(m, r, f->node, side, group);
+            if (!ok_group) goto done;
+        } else {
+            if (!_read_field_value(m, r, f->node, side, NULL, group)) goto done;
+        }
+    }
+    ok = true;
+
+#undef PUSH_FRAME
+done:
+    for (size_t i = 0; i < top; i++) {
+        pfree(stack[i].name);
+    }
+    pfree(stack);
+    return ok;
+}
+
+bool
+lpmerge_add(struct lpmerge* m, int side, FILE* fp, const char* name, char* err, size_t errsz) {
+    if (side < 0 || side >= SIDES) {
+        snprintf(err, errsz, "%s: invalid side %d", name, side);
+        return false;
+    }
+    struct reader* r = (struct reader*)pcalloc(1, sizeof(*r));
+    r->fp = fp;
+    r->name = name;
+    r->line = 1;
+    r->err = err;
+    r->errsz = errsz;
+
+    bool ok = false;
+    bool has_nodes = false;
+    if (!rd_expect(r, '{')) goto done;
+    rd_skip_ws(r);
+    if (rd_peek(r) != '}') {
+        for (;;) {
+            if (!rd_string(r) || !rd_expect(r, ':')) goto done;
+            if (strcmp(r->str, "nodes") == 0) {
+                if (!parse_nodes(m, r, side)) goto done;
+                has_nodes = true;
+            } else if (strcmp(r->str, "start_time") == 0) {
+                rd_skip_ws(r);
+                if (rd_peek(r) == '"') {
+                    if (!rd_string(r)) goto done;
+                    if (m->start_time[side][0] == '\0' || strcmp(r->str, m->start_time[side]) < 0) {
+                        snprintf(m->start_time[side], sizeof(m->start_time[side]), "%s", r->str);
+                    }
+                } else if (!rd_skip_value(r)) {
+                    goto done;
+                }
+            } else if (strcmp(r->str, "duration_seconds") == 0) {
+                int64_t i;
+                double d;
+                bool real;
+                rd_skip_ws(r);
+                if (!rd_number(r, &i, &d, &real)) goto done;
+                m->duration[side] += d;
+            } else if (!rd_skip_value(r)) {
+                goto done;
+            }
+            rd_skip_ws(r);
+            int c = rd_get(r);
+            if (c == '}') break;
+            if (c != ',') {
+                rd_fail(r, "expect ',' or '}'");
+                goto done;
+            }
+        }
+    } else {
+        rd_get(r);
+    }
+    if (!has_nodes) {
+        rd_fail(r, "no \"nodes\" in profile");
+        goto done;
+    }
+    if (ferror(fp)) {
+        rd_fail(r, "read fail: %s", strerror(errno));
+        goto done;
+    }
+    m->inputs[side]++;
+    ok = true;
+
+done:
+    pfree(r->str);
+    pfree(r);
+    return ok;
+}
+
+static void
+write_json_chars(FILE* fp, const char* s) {
+    for (const unsigned char* c = (const unsigned char*)s; *c; c++) {
+        switch (*c) {
+        case '"':  fputs("\\\"", fp); break;
+        case '\\': fputs("\\\\", fp); break;
+        case '\n': fputs("\\n", fp); break;
+        case '\r': fputs("\\r", fp); break;
+        case '\t': fputs("\\t", fp); break;
+        default:
+            if (*c < 0x20) fprintf(fp, "\\u%04x", *c);
+            else fputc(*c, fp);
+        }
+    }
+}
+
+static void
+write_json_string(FILE* fp, const char* s) {
+    fputc('"', fp);
+    write_json_chars(fp, s);
+    fputc('"', fp);
+}
+
+// 按字段的类型写出数值，scale 不为 1 时（--average）整数四舍五入
+static void
+_write_value(FILE* fp, const struct field_def* f, const struct field_value* v, double scale) {
+    if (f->real) {
+        fprintf(fp, "%.17g", f->kind == FIELD_ADD ? v->d * scale : v->d);
+    } else if (f->kind != FIELD_ADD || scale == 1.0) {
+        fprintf(fp, "%" PRId64, v->i);
+    } else {
+        fprintf(fp, "%" PRId64, (int64_t)llround((double)v->i * scale));
+    }
+}
+
+struct merge_ids {
+    int cpu_raw;
+    int cpu_real;
+    int alloc_bytes;
+    int free_bytes;
+    int profiler_cost;
+    int profiler_calls;
+    int instructions;
+    int cycles;
+};
+
+static void
+_init_merge_ids(const struct lpmerge* m, struct merge_ids* ids) {
+    ids->cpu_raw = find_field(m, NULL, "cpu_cost_raw(ns)");
+    ids->cpu_real = find_field(m, NULL, "cpu_cost_real(ns)");
+    ids->alloc_bytes = find_field(m, NULL, "alloc_bytes");
+    ids->free_bytes = find_field(m, NULL, "free_bytes");
+    ids->profiler_cost = find_field(m, NULL, "profiler_cpu_cost_total(ns)");
+    ids->profiler_calls = find_field(m, NULL, "cpu_call_count_total");
+    ids->instructions = find_field(m, "counters", "instructions");
+    ids->cycles = find_field(m, "counters", "cycles");
+}
+
+static void
+_write_percent(FILE* fp, const char* key, double v, double parent_v) {
+    fprintf(fp, ",\"%s\":\"%.2f\"", key, parent_v > 0 ? v / parent_v * 100.0 : 100.0);
+}
+
+struct sort_item {
+    const struct merge_node* node;
+    double cost;
+};
+
+static int
+_cmp_tag(const char* a, const char* b) {
+    if (!a || !b) return a ? 1 : (b ? -1 : 0);
+    return strcmp(a, b);
+}
+
+// 按耗时降序，耗时相同时按 (name, tag) 排，输出和输入的顺序无关
+static int
+_cmp_sort_item(const void* a, const void* b) {
+    const struct sort_item* x = (const struct sort_item*)a;
+    const struct sort_item* y = (const struct sort_item*)b;
+    if (x->cost != y->cost) return x->cost < y->cost ? 1 : -1;
+    int c = strcmp(x->node->name, y->node->name);
+    return c != 0 ? c : _cmp_tag(x->node->tag, y->node->tag);
+}
+
+// 根节点的 tags 数组，各 tag 的合计按耗时降序
+static void
+_write_merged_tags(const struct lpmerge* m, FILE* fp, const struct merge_ids* ids, double scale) {
+    size_t n = 0;
+    for (const struct merge_node* t = m->tags; t; t = t->next_sibling) {
+        if (t->value_count[0] > 0) n++;
+    }
+    if (n == 0) return;
+    struct sort_item* items = (struct sort_item*)pmalloc(sizeof(struct sort_item) * n);
+    n = 0;
+    for (const struct merge_node* t = m->tags; t; t = t->next_sibling) {
+        if (t->value_count[0] == 0) continue;
+        items[n].node = t;
+        items[n].cost = node_number(m, t, 0, ids->cpu_raw);
+        n++;
+    }
+    qsort(items, n, sizeof(struct sort_item), _cmp_sort_item);
+    fputs(",\"tags\":[", fp);
+    for (size_t i = 0; i < n; i++) {
+        const struct merge_node* t = items[i].node;
+        fputs(i > 0 ? ",{\"tag\":" : "{\"tag\":", fp);
+        write_json_string(fp, t->name);
+        for (int k = 0; k < t->value_count[0]; k++) {
+            const struct field_value* v = &t->values[0][k];
+            const struct field_def* f = &m->fields[v->field];
+            fputs(",\"", fp);
+            fputs(f->key, fp);
+            fputs("\":", fp);
+            _write_value(fp, f, v, scale);
+        }
+        fputc('}', fp);
+    }
+    fputc(']', fp);
+    pfree(items);
+}
+
+// 写出节点的开头和字段，字段顺序同第一次读到的顺序，派生字段重新计算；children 和结尾由调用方写
+static void
+_write_merged_node(const struct lpmerge* m, FILE* fp, const struct merge_node* node, const struct merge_ids* ids, double scale) {
+    fputs("{\"name\":", fp);
+    write_json_string(fp, node->name);
+    if (node->tag) {
+        fputs(",\"tag\":", fp);
+        write_json_string(fp, node->tag);
+    }
+    for (int k = 0; k < node->value_count[0]; k++) {
+        const struct field_value* v = &node->values[0][k];
+        const struct field_def* f = &m->fields[v->field];
+        if (f->group) continue;
+        fputs(",\"", fp);
+        fputs(f->key, fp);
+        fputs("\":", fp);
+        _write_value(fp, f, v, scale);
+    }
+    if (ids->cpu_raw >= 0 && node_value(node, 0, ids->cpu_raw)) {
+        double parent = node->parent ? node_number(m, node->parent, 0, ids->cpu_raw) : 0;
+        _write_percent(fp, "cpu_cost_raw(%)", node_number(m, node, 0, ids->cpu_raw), parent);
+    }
+    if (ids->cpu_real >= 0 && node_value(node, 0, ids->cpu_real)) {
+        double parent = node->parent ? node_number(m, node->parent, 0, ids->cpu_real) : 0;
+        _write_percent(fp, "cpu_cost_real(%)", node_number(m, node, 0, ids->cpu_real), parent);
+    }
+    if (node_value(node, 0, ids->alloc_bytes) && node_value(node, 0, ids->free_bytes)) {
+        double alloc = node_number(m, node, 0, ids->alloc_bytes);
+        double freed = node_number(m, node, 0, ids->free_bytes);
+        fprintf(fp, ",\"inuse_bytes\":%.0f", alloc >= freed ? (alloc - freed) * scale : 9999999999.0);
+    }
+    if (node_value(node, 0, ids->profiler_calls)) {
+        double calls = node_number(m, node, 0, ids->profiler_calls);
+        fprintf(fp, ",\"avg_profiler_cost_per_call(ns)\":%.17g",
+            calls > 0 ? node_number(m, node, 0, ids->profiler_cost) / calls : 0.0);
+    }
+    // 嵌套的数值对象：按登记顺序找出各个 group，每个 group 写一次
+    for (int g = 0; g < m->field_count; g++) {
+        const char* group = m->fields[g].group;
+        if (!group) continue;
+        bool seen = false;
+        for (int e = 0; e < g && !seen; e++) {
+            seen = m->fields[e].group && strcmp(m->fields[e].group, group) == 0;
+        }
+        if (seen) continue;
+        bool opened = false;
+        for (int k = 0; k < node->value_count[0]; k++) {
+            const struct field_value* v = &node->values[0][k];
+            const struct field_def* f = &m->fields[v->field];
+            if (!f->group || strcmp(f->group, group) != 0) continue;
+            fputs(opened ? "," : ",\"", fp);
+            if (!opened) {
+                fputs(group, fp);
+                fputs("\":{", fp);
+            }
+            opened = true;
+            write_json_string(fp, f->key);
+            fputc(':', fp);
+            _write_value(fp, f, v, scale);
+        }
+        if (!opened) continue;
+        if (strcmp(group, "counters") == 0 && ids->instructions >= 0 && ids->cycles >= 0) {
+            double cycles = node_number(m, node, 0, ids->cycles);
+            if (cycles > 0) fprintf(fp, ",\"ipc\":%.17g", node_number(m, node, 0, ids->instructions) / cycles);
+        }
+        fputc('}', fp);
+    }
+    for (int k = 0; k < node->string_count; k++) {
+        fputs(",\"", fp);
+        fputs(m->fields[node->strings[k].field].key, fp);
+        fputs("\":", fp);
+        write_json_string(fp, node->strings[k].s);
+    }
+    if (!node->parent) _write_merged_tags(m, fp, ids, scale);
+}
+
+struct write_entry {
+    const struct merge_node* node;
+    uint32_t index;     // 在父节点 children 中的序号，从 1 开始
+    bool close;
+    bool has_children;
+};
+
+
+bool
+lpmerge_write_merged(struct lpmerge* m, FILE* out, bool average) {
+    if (!m->root || m->inputs[0] == 0) return false;
+    double scale = average ? 1.0 / m->inputs[0] : 1.0;
+    struct merge_ids ids;
+    _init_merge_ids(m, &ids);
+
+    fputs("{\"start_time\":", out);
+    write_json_string(out, m->start_time[0]);
+    fprintf(out, ",\"duration_seconds\":%.17g,\"inputs\":%d,\"nodes\":", m->duration[0] * scale, m->inputs[0]);
+
+    struct write_entry* stack = (struct write_entry*)pmalloc(sizeof(struct write_entry) * 64);
+    size_t top = 0;
+    size_t cap = 64;
+    struct sort_item* kids = NULL;
+    size_t kids_cap = 0;
+    stack[top++] = (struct write_entry){m->root, 1, false, false};
+    while (top > 0) {
+        struct write_entry e = stack[--top];
+        if (e.close) {
+            fputs(e.has_children ? "]}" : "}", out);
+            continue;
+        }
+        if (e.index > 1) fputc(',', out);
+        _write_merged_node(m, out, e.node, &ids, scale);
+
+        size_t n = 0;
+        for (const struct merge_node* c = e.node->first_child; c; c = c->next_sibling) {
+            if (n >= kids_cap) {
+                kids_cap = kids_cap ? kids_cap * 2 : 64;
+                kids = (struct sort_item*)prealloc(kids, sizeof(struct sort_item) * kids_cap);
+            }
+            kids[n].node = c;
+            kids[n].cost = node_number(m, c, 0, ids.cpu_raw);
+            n++;
+        }
+        if (n > 1) qsort(kids, n, sizeof(struct sort_item), _cmp_sort_item);
+        if (top + n + 1 > cap) {
+            while (cap < top + n + 1) cap *= 2;
+            stack = (struct write_entry*)prealloc(stack, sizeof(struct write_entry) * cap);
+        }
+        // 先压闭合标记，子节点逆序压栈，出栈时按降序写出
+        stack[top++] = (struct write_entry){e.node, 0, true, n > 0};
+        if (n > 0) fputs(",\"children\":[", out);
+        for (size_t i = n; i > 0; i--) {
+            stack[top++] = (struct write_entry){kids[i - 1].node, (uint32_t)i, false, false};
+        }
+    }
+    fputs("}\n", out);
+    pfree(kids);
+    pfree(stack);
+    return ferror(out) == 0;
+}
+
+// 对比的指标，incl 为节点上的值，self 为减去子节点之后的
+enum DIFF_METRIC {
+    DIFF_SELF_CPU,
+    DIFF_CPU,
+    DIFF_CALLS,
+    DIFF_ALLOC_BYTES,
+    DIFF_METRIC_COUNT,
+};
+
+static const char* diff_metric_names[DIFF_METRIC_COUNT] = {
+    "self_cpu_cost(ns)", "cpu_cost(ns)", "call_count", "alloc_bytes",
+};
+
+struct diff_row {
+    const struct merge_node* node;
+    size_t order;       // 先序遍历的序号，变化相同时按它排，输出稳定
+    double v[SIDES][DIFF_METRIC_COUNT];
+    bool present[SIDES];
+};
+
+static int
+_cmp_diff_row(const void* a, const void* b) {
+    const struct diff_row* x = (const struct diff_row*)a;
+    const struct diff_row* y = (const struct diff_row*)b;
+    double dx = fabs(x->v[1][DIFF_SELF_CPU] - x->v[0][DIFF_SELF_CPU]);
+    double dy = fabs(y->v[1][DIFF_SELF_CPU] - y->v[0][DIFF_SELF_CPU]);
+    if (dx != dy) return dx < dy ? 1 : -1;
+    dx = fabs(x->v[1][DIFF_CPU] - x->v[0][DIFF_CPU]);
+    dy = fabs(y->v[1][DIFF_CPU] - y->v[0][DIFF_CPU]);
+    if (dx != dy) return dx < dy ? 1 : -1;
+    return x->order < y->order ? -1 : (x->order > y->order ? 1 : 0);
+}
+
+// 从根到节点的路径，节点名之间用 ';' 分隔，同 folded 格式；tag 子树的根节点写成 "name [tag=xxx]"
+static void
+_write_diff_path(FILE* fp, const struct merge_node* node, const struct merge_node*** chain, size_t* chain_cap) {
+    size_t n = 0;
+    for (const struct merge_node* p = node; p; p = p->parent) {
+        if (n >= *chain_cap) {
+            *chain_cap = *chain_cap ? *chain_cap * 2 : 64;
+            *chain = (const struct merge_node**)prealloc((void*)*chain, sizeof(struct merge_node*) * *chain_cap);
+        }
+        (*chain)[n++] = p;
+    }
+    fputc('"', fp);
+    for (size_t i = n; i > 0; i--) {
+        const struct merge_node* p = (*chain)[i - 1];
+        write_json_chars(fp, p->name);
+        if (p->tag) {
+            // tag 子树的根节点带上 tag，同一个函数在不同 tag 下是不同的路径
+            fputs(" [tag=", fp);
+            write_json_chars(fp, p->tag);
+            fputc(']', fp);
+        }
+        if (i > 1) fputc(';', fp);
+    }
+    fputc('"', fp);
+}
+
+// 节点有开销扣除后的耗时就用它，否则用原始耗时
+static double
+_diff_cpu(const struct lpmerge* m, const struct merge_node* node, int side, const struct merge_ids* ids) {
+    if (node_value(node, side, ids->cpu_real)) return node_number(m, node, side, ids->cpu_real);
+    return node_number(m, node, side, ids->cpu_raw);
+}
+
+bool
+lpmerge_write_diff(struct lpmerge* m, FILE* out, size_t top, bool per_second) {
+    if (!m->root || m->inputs[0] == 0 || m->inputs[1] == 0) return false;
+    struct merge_ids ids;
+    _init_merge_ids(m, &ids);
+    int calls_field = find_field(m, NULL, "call_count");
+    double scale[SIDES];
+    for (int s = 0; s < SIDES; s++) {
+        scale[s] = (per_second && m->duration[s] > 0) ? 1.0 / m->duration[s] : 1.0;
+    }
+
+    // 先序收集所有节点
+    struct diff_row* rows = NULL;
+    size_t row_count = 0;
+    size_t row_cap = 0;
+    const struct merge_node** st = (const struct merge_node**)pmalloc(sizeof(struct merge_node*) * 64);
+    size_t st_top = 0;
+    size_t st_cap = 64;
+    st[st_top++] = m->root;
+    while (st_top > 0) {
+        const struct merge_node* node = st[--st_top];
+        if (row_count >= row_cap) {
+            row_cap = row_cap ? row_cap * 2 : 1024;
+            rows = (struct diff_row*)prealloc(rows, sizeof(struct diff_row) * row_cap);
+        }
+        struct diff_row* row = &rows[row_count++];
+        memset(row, 0, sizeof(*row));
+        row->node = node;
+        row->order = row_count - 1;
+        for (int s = 0; s < SIDES; s++) {
+            row->present[s] = node->value_count[s] > 0;
+            row->v[s][DIFF_CPU] = _diff_cpu(m, node, s, &ids) * scale[s];
+            row->v[s][DIFF_CALLS] = node_number(m, node, s, calls_field) * scale[s];
+            row->v[s][DIFF_ALLOC_BYTES] = node_number(m, node, s, ids.alloc_bytes) * scale[s];
+            double children = 0;
+            for (const struct merge_node* c = node->first_child; c; c = c->next_sibling) {
+                children += _diff_cpu(m, c, s, &ids) * scale[s];
+            }
+            double self = row->v[s][DIFF_CPU] - children;
+            row->v[s][DIFF_SELF_CPU] = self > 0 ? self : 0;
+        }
+        for (const struct merge_node* c = node->first_child; c; c = c->next_sibling) {
+            if (st_top >= st_cap) {
+                st_cap *= 2;
+                st = (const struct merge_node**)prealloc((void*)st, sizeof(struct merge_node*) * st_cap);
+            }
+            st[st_top++] = c;
+        }
+    }
+    pfree((void*)st);
+    qsort(rows, row_count, sizeof(struct diff_row), _cmp_diff_row);
+
+    fprintf(out, "{\"baseline\":{\"inputs\":%d,\"start_time\":", m->inputs[0]);
+    write_json_string(out, m->start_time[0]);
+    fprintf(out, ",\"duration_seconds\":%.17g},\"candidate\":{\"inputs\":%d,\"start_time\":", m->duration[0], m->inputs[1]);
+    write_json_string(out, m->start_time[1]);
+    fprintf(out, ",\"duration_seconds\":%.17g},\"per_second\":%s,\"paths\":%zu}\n",
+        m->duration[1], per_second ? "true" : "false", row_count);
+
+    const struct merge_node** chain = NULL;
+    size_t chain_cap = 0;
+    size_t limit = (top > 0 && top < row_count) ? top : row_count;
+    for (size_t i = 0; i < limit; i++) {
+        const struct diff_row* row = &rows[i];
+        fputs("{\"path\":", out);
+        _write_diff_path(out, row->node, &chain, &chain_cap);
+        if (!row->present[0]) fputs(",\"only_in\":\"candidate\"", out);
+        else if (!row->present[1]) fputs(",\"only_in\":\"baseline\"", out);
+        for (int k = 0; k < DIFF_METRIC_COUNT; k++) {
+            fprintf(out, ",\"%s\":{\"baseline\":%.17g,\"candidate\":%.17g,\"delta\":%.17g}", diff_metric_names[k],
+                row->v[0][k], row->v[1][k], row->v[1][k] - row->v[0][k]);
+        }
+        fputs("}\n", out);
+    }
+    pfree((void*)chain);
+    pfree(rows);
+    return ferror(out) == 0;
+}
+
+#ifndef LPMERGE_NO_MAIN
+
+static void
+usage(void) {
+    fprintf(stderr,
+        "usage: lpmerge merge [-o out.json] [--average] profile.json ...\n"
+        "       lpmerge diff [-o out.jsonl] [--top n] [--per-second] baseline.json candidate.json\n");
+}
+
+static bool
+add_file(struct lpmerge* m, int side, const char* path) {
+    FILE* fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "ERROR: open %s fail: %s\n", path, strerror(errno));
+        return false;
+    }
+    char err[512] = {0};
+    bool ok = lpmerge_add(m, side, fp, path, err, sizeof(err));
+    if (fp != stdin) fclose(fp);
+    if (!ok) fprintf(stderr, "ERROR: %s\n", err);
+    return ok;
+}
+
+int
+main(int argc, char** argv) {
+    if (argc < 2) {
+        usage();
+        return 2;
+    }
+    bool diff = false;
+    if (strcmp(argv[1], "diff") == 0) diff = true;
+    else if (strcmp(argv[1], "merge") != 0) {
+        usage();
+        return 2;
+    }
+
+    const char* out_path = NULL;
+    bool average = false;
+    bool per_second = false;
+    size_t top = 0;
+    const char** inputs = (const char**)pcalloc((size_t)argc, sizeof(char*));
+    int input_count = 0;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (!diff && strcmp(argv[i], "--average") == 0) {
+            average = true;
+        } else if (diff && strcmp(argv[i], "--per-second") == 0) {
+            per_second = true;
+        } else if (diff && strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+            top = (size_t)strtoull(argv[++i], NULL, 10);
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            fprintf(stderr, "ERROR: unknown option %s\n", argv[i]);
+            usage();
+            pfree((void*)inputs);
+            return 2;
+        } else {
+            inputs[input_count++] = argv[i];
+        }
+    }
+    if ((diff && input_count != 2) || (!diff && input_count < 1)) {
+        usage();
+        pfree((void*)inputs);
+        return 2;
+    }
+
+    struct lpmerge* m = lpmerge_create();
+    bool ok = true;
+    for (int i = 0; i < input_count && ok; i++) {
+        ok = add_file(m, diff ? i : 0, inputs[i]);
+    }
+    pfree((void*)inputs);
+    if (!ok) {
+        lpmerge_free(m);
+        return 1;
+    }
+
+    FILE* out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "ERROR: open %s fail: %s\n", out_path, strerror(errno));
+        lpmerge_free(m);
+        return 1;
+    }
+    char* buffer = (char*)pmalloc(WRITE_BUFFER_SIZE);
+    setvbuf(out, buffer, _IOFBF, WRITE_BUFFER_SIZE);
+    ok = diff ? lpmerge_write_diff(m, out, top, per_second) : lpmerge_write_merged(m, out, average);
+    if (out != stdout) {
+        if (fclose(out) != 0) ok = false;
+    } else if (fflush(out) != 0) {
+        ok = false;
+    }
+    pfree(buffer);
+    lpmerge_free(m);
+    if (!ok) {
+        fprintf(stderr, "ERROR: write fail\n");
+        return 1;
+    }
+    return 0;
+}
+
+#endif
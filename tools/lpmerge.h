@@ -0,0 +1,30 @@
+#ifndef LPMERGE_H
+#define LPMERGE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+离线合并、对比 luaprofile 的 json 导出（dump_json/swap_dump/dump_async 的输出，{ start_time, duration_seconds, nodes }）。
+节点按符号路径（从根到节点的 "name source:line" 序列，tag 子树的根节点再加上 tag）对齐，不依赖进程内的地址，不同进程的 dump 可以直接合并。
+输入按块流式解析，内存只和合并后不同路径的数量有关，和输入的大小、个数无关。
+每个 lpmerge 有两份统计（side 0/1）：合并只用 side 0，对比时 side 0 为基线、side 1 为候选。
+*/
+struct lpmerge;
+
+struct lpmerge* lpmerge_create(void);
+void lpmerge_free(struct lpmerge* m);
+
+// 把一个 dump 流式读入第 side 份统计，同一路径的数值累加。name 只用于错误信息；失败返回 false，原因写到 err
+bool lpmerge_add(struct lpmerge* m, int side, FILE* fp, const char* name, char* err, size_t errsz);
+
+// 按 dump 相同的格式写出 side 0 的合并结果，average 为 true 时可累加的数值除以输入的个数。
+// 根节点的 tags 按 tag 名字累加；overhead_per_event(ns) 是各进程各自校准的结果，不写出；空对象（如空的 realloc_sizes）不写出
+bool lpmerge_write_merged(struct lpmerge* m, FILE* out, bool average);
+
+// 写出 side 0 到 side 1 的逐路径差异，json lines：第一行为两边的概况，之后每行一条路径，按 self 耗时变化的绝对值降序。
+// top 为 0 表示全部输出；per_second 为 true 时两边都先除以各自的 duration_seconds，时长不同的 dump 也可以比较
+bool lpmerge_write_diff(struct lpmerge* m, FILE* out, size_t top, bool per_second);
+
+#endif